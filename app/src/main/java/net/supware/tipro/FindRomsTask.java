@@ -1,26 +1,60 @@
 package net.supware.tipro;
 
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
 import java.io.File;
-import java.util.LinkedList;
-import java.util.Queue;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.LinkedHashSet;
+import java.util.Map;
+import java.util.Set;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
 
+import android.content.Context;
 import android.os.AsyncTask;
 import android.os.Environment;
+import android.os.SystemClock;
 import android.text.TextUtils;
 import android.util.Log;
 
 import net.supware.tipro.model.TIGutsModel;
 
+/**
+ * Walks external storage for ROM images. Directories whose mtime has not
+ * changed since the last scan are not listed again: their subdirectories
+ * and ROMs come from an index kept in the app files directory. Listing
+ * and identifying run on a small thread pool.
+ */
 abstract public class FindRomsTask extends
 		AsyncTask<Void, FindRomsTask.ProgressData, Void> {
-	
+
 	private static final String TAG = FindRomsTask.class.getSimpleName();
 
+	private static final String INDEX_NAME = "roms.dirs";
+	private static final int INDEX_VERSION = 1;
+	private static final int THREADS = 4;
+
+	// Directories changed less than this long ago may still change within
+	// the same mtime tick, so they are not trusted on the next scan
+	private static final long MTIME_SLACK = 2000;
+
+	// Least time between onSearchDirectory() calls
+	private static final long PROGRESS_MS = 100;
+
 	private String[] SEARCH_LOCATIONS = {
 			Environment.getExternalStorageDirectory().getAbsolutePath(),
 			"/mnt/sdcard", "/mnt/sdcard-ext" };
 
-	protected Queue<String> mFileQueue = new LinkedList<>();
+	protected Set<String> mFileQueue = new LinkedHashSet<>();
 
 	class ProgressData {
 		public int model;
@@ -32,43 +66,240 @@ abstract public class FindRomsTask extends
 		}
 	}
 
+	// What a directory held when it was last listed
+	private static class DirEntry {
+		long mtime;
+		String[] dirs;
+		String[] roms;
+	}
+
+	private final File mIndexFile;
+	private final Map<String, DirEntry> mOldIndex = new ConcurrentHashMap<>();
+	private final Map<String, DirEntry> mNewIndex = new ConcurrentHashMap<>();
+	private final Set<String> mVisited = Collections
+			.newSetFromMap(new ConcurrentHashMap<String, Boolean>());
+	private final AtomicInteger mPending = new AtomicInteger();
+	private final AtomicInteger mListed = new AtomicInteger();
+	private final AtomicInteger mChecked = new AtomicInteger();
+	private ExecutorService mPool;
+	private volatile long mLastProgress;
+
+	public FindRomsTask(Context context) {
+		mIndexFile = new File(context.getFilesDir(), INDEX_NAME);
+	}
+
 	public void addToFileQueue(String... pathnames) {
 		for (String path : pathnames) {
-			if (TextUtils.isEmpty(path) || mFileQueue.contains(path))
+			if (TextUtils.isEmpty(path) || !mFileQueue.add(path))
 				continue;
-			
-			mFileQueue.add(path);
-			Log.e(TAG, "adding " + path);
+
+			Log.d(TAG, "adding " + path);
 		}
 	}
-	
+
 	@Override
 	public Void doInBackground(Void... params) {
+		long start = SystemClock.elapsedRealtime();
+
 		addToFileQueue(SEARCH_LOCATIONS);
+		loadIndex();
+
+		mPool = Executors.newFixedThreadPool(THREADS);
+		for (String path : mFileQueue) {
+			File file = new File(path);
+			try {
+				// Search locations are often links to each other
+				file = file.getCanonicalFile();
+			} catch (IOException e) {
+			}
+			if (file.isDirectory())
+				submitDir(file.getPath());
+			else
+				checkFile(file);
+		}
 
-		String next = mFileQueue.poll();
-		while (next != null) {
-			File nextFile = new File(next);
-			if (nextFile.isDirectory()) {
-				publishProgress(new ProgressData(-1, next));
+		// Wait for all queued directories, or cancellation
+		synchronized (mPending) {
+			while (mPending.get() > 0 && !isCancelled()) {
+				try {
+					mPending.wait(PROGRESS_MS);
+				} catch (InterruptedException e) {
+					break;
+				}
+			}
+		}
+		mPool.shutdownNow();
+		try {
+			mPool.awaitTermination(1, TimeUnit.SECONDS);
+		} catch (InterruptedException e) {
+		}
 
-				File subfiles[] = nextFile.listFiles();
-				if (subfiles != null) {
-					for (File f : subfiles) {
-						mFileQueue.add(f.getAbsolutePath());
+		saveIndex();
+
+		// Listed directories cost a listFiles() and a stat per entry,
+		// indexed ones only a stat of the directory and its ROMs
+		Log.d(TAG, "scanned " + mNewIndex.size() + " directories in "
+				+ (SystemClock.elapsedRealtime() - start) + "ms: "
+				+ mListed.get() + " listed, "
+				+ (mNewIndex.size() - mListed.get()) + " from index, "
+				+ mChecked.get() + " files checked, " + THREADS + " threads");
+		return null;
+	}
+
+	private void submitDir(final String path) {
+		if (isCancelled() || !mVisited.add(path))
+			return;
+
+		mPending.incrementAndGet();
+		mPool.execute(new Runnable() {
+			@Override
+			public void run() {
+				try {
+					if (!isCancelled())
+						scanDir(path);
+				} finally {
+					if (mPending.decrementAndGet() == 0) {
+						synchronized (mPending) {
+							mPending.notifyAll();
+						}
 					}
 				}
 			}
+		});
+	}
+
+	private void scanDir(String path) {
+		File dir = new File(path);
+		long mtime = dir.lastModified();
+		DirEntry entry = mOldIndex.get(path);
+
+		long now = SystemClock.elapsedRealtime();
+		if (now - mLastProgress >= PROGRESS_MS) {
+			mLastProgress = now;
+			publishProgress(new ProgressData(-1, path));
+		}
+
+		// Unchanged directory: trust the index, only recheck its ROMs
+		if (entry != null && entry.mtime == mtime && mtime != 0) {
+			mNewIndex.put(path, entry);
+			for (String name : entry.roms)
+				checkFile(new File(dir, name));
+			for (String name : entry.dirs)
+				submitDir(path + "/" + name);
+			return;
+		}
+
+		File[] files = dir.listFiles();
+		if (files == null)
+			return;
+		mListed.incrementAndGet();
+
+		ArrayList<String> dirs = new ArrayList<>();
+		ArrayList<String> roms = new ArrayList<>();
+		for (File f : files) {
+			if (isCancelled())
+				return;
+			if (f.isDirectory()) {
+				dirs.add(f.getName());
+				submitDir(f.getPath());
+			} else if (checkFile(f)) {
+				roms.add(f.getName());
+			}
+		}
+
+		entry = new DirEntry();
+		entry.mtime = System.currentTimeMillis() - mtime < MTIME_SLACK ? 0 : mtime;
+		entry.dirs = dirs.toArray(new String[dirs.size()]);
+		entry.roms = roms.toArray(new String[roms.size()]);
+		mNewIndex.put(path, entry);
+	}
+
+	private boolean checkFile(File file) {
+		mChecked.incrementAndGet();
+		int model = TIGutsModel.getRomFileType(file);
+		if (model == -1)
+			return false;
+
+		if (!isCancelled())
+			publishProgress(new ProgressData(model, file.getPath()));
+		return true;
+	}
+
+	private void loadIndex() {
+		DataInputStream in = null;
+		try {
+			in = new DataInputStream(new BufferedInputStream(
+					new FileInputStream(mIndexFile)));
+			if (in.readInt() != INDEX_VERSION)
+				return;
+
+			for (int n = in.readInt(); n > 0; --n) {
+				String path = in.readUTF();
+				DirEntry entry = new DirEntry();
+				entry.mtime = in.readLong();
+				entry.dirs = new String[in.readInt()];
+				for (int j = 0; j < entry.dirs.length; ++j)
+					entry.dirs[j] = in.readUTF();
+				entry.roms = new String[in.readInt()];
+				for (int j = 0; j < entry.roms.length; ++j)
+					entry.roms[j] = in.readUTF();
+				mOldIndex.put(path, entry);
+			}
+		} catch (IOException e) {
+			// Missing or damaged index: everything gets listed
+		} finally {
+			if (in != null) {
+				try {
+					in.close();
+				} catch (IOException e) {
+				}
+			}
+		}
+	}
 
-			else if (nextFile.isFile()) {
-				int model = TIGutsModel.getRomFileType(nextFile);
-				if (model != -1)
-					publishProgress(new ProgressData(model, next));
+	private void saveIndex() {
+		// Keep what this scan did not get to, if it was cut short.
+		// Otherwise whatever was not reached is gone.
+		if (isCancelled()) {
+			for (Map.Entry<String, DirEntry> e : mOldIndex.entrySet()) {
+				if (!mNewIndex.containsKey(e.getKey()))
+					mNewIndex.put(e.getKey(), e.getValue());
 			}
+		}
 
-			next = mFileQueue.poll();
+		File tmp = new File(mIndexFile.getPath() + ".tmp");
+		DataOutputStream out = null;
+		try {
+			out = new DataOutputStream(new BufferedOutputStream(
+					new FileOutputStream(tmp)));
+			out.writeInt(INDEX_VERSION);
+			out.writeInt(mNewIndex.size());
+			for (Map.Entry<String, DirEntry> e : mNewIndex.entrySet()) {
+				DirEntry entry = e.getValue();
+				out.writeUTF(e.getKey());
+				out.writeLong(entry.mtime);
+				out.writeInt(entry.dirs.length);
+				for (String name : entry.dirs)
+					out.writeUTF(name);
+				out.writeInt(entry.roms.length);
+				for (String name : entry.roms)
+					out.writeUTF(name);
+			}
+			out.close();
+			out = null;
+			if (!tmp.renameTo(mIndexFile))
+				tmp.delete();
+		} catch (IOException e) {
+			Log.e(TAG, "can't save " + mIndexFile, e);
+			tmp.delete();
+		} finally {
+			if (out != null) {
+				try {
+					out.close();
+				} catch (IOException e) {
+				}
+			}
 		}
-		return null;
 	}
 
 	@Override
@@ -34,10 +34,13 @@ public class MainActivity extends Ti8xActivity {
 			// Clear the ROM name from the settings
 			setPreference(SettingsActivity.KEY_ROM_FILENAME, "");
 
-			// Ax the RAM to go too
+			// Ax the RAM and flash image to go too
 			File ramFile = new File(calculateRamFilename(romFilename));
 			if (ramFile.exists())
 				ramFile.delete();
+			File flashFile = new File(calculateFlashFilename(romFilename));
+			if (flashFile.exists())
+				flashFile.delete();
 			romFilename = "";
 		}
 
@@ -64,6 +67,9 @@ public class MainActivity extends Ti8xActivity {
 			return new TISkinModel(96, 64, R.raw.ti83_480x800,
 					R.drawable.ti83_480x800);
 		case TIGutsModel.ATI_TI83P:
+		case TIGutsModel.ATI_TI83SE:
+		case TIGutsModel.ATI_TI84P:
+		case TIGutsModel.ATI_TI84SE:
 			return new TISkinModel(96, 64, R.raw.ti83p_480x800,
 					R.drawable.ti83p_480x800);
 		case TIGutsModel.ATI_TI85:
@@ -104,8 +110,19 @@ public class MainActivity extends Ti8xActivity {
 		return ramFilename;
 	}
 
+	// Writable copy of TI-83+/84+ flash, named by the native side after the
+	// RAM file
+	private String calculateFlashFilename(String romFilename) {
+		int mid = romFilename.lastIndexOf(".");
+		return (mid == -1 ? romFilename : romFilename.substring(0, mid)) + ".FLASH";
+	}
+
 	private class FindAnyRomTask extends FindRomsTask {
 
+		FindAnyRomTask() {
+			super(MainActivity.this);
+		}
+
 		@Override
 		public void onPreExecute() {
 			mHasSearchedSD = true;
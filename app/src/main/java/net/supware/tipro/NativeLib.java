@@ -4,6 +4,27 @@ public class NativeLib {
 	private static final String TAG = NativeLib.class.getSimpleName();
 	private static final int IO_BUFFER_SIZE = 4 * 1024;
 
+	// Flags for renderScreen(), same as RENDER_* in Render.h
+	public static final int RENDER_GRID = 0x01;
+	public static final int RENDER_FILTER = 0x0E;
+	public static final int RENDER_SCALE2X = 0x02;
+	public static final int RENDER_SCALE3X = 0x04;
+	public static final int RENDER_HQ2X = 0x06;
+	public static final int RENDER_FORCE = 0x80;
+
+	// Key event flag for exchangeFrame(), same as KEY_PRESSED in ti8x.c
+	public static final int KEY_PRESSED = 0x100;
+
+	// Status returned by exchangeFrame(), same as STATUS_* in ti8x.c
+	public static final int STATUS_RUNNING = 0x01;
+	public static final int STATUS_SCREEN_ON = 0x02;
+	public static final int STATUS_NEW_FRAME = 0x04;
+	public static final int STATUS_FLAGS = 0;
+	public static final int STATUS_FRAME = 1;
+	public static final int STATUS_KHZ = 2;
+	public static final int STATUS_EVENTS = 3;
+	public static final int STATUS_SIZE = 4;
+
 	// load our native library
 	static {
 		System.loadLibrary("ti8x");
@@ -20,11 +41,77 @@ public class NativeLib {
 
 	//public static native void loadState(String ramFilename);
 
-	//public static native void saveState(String ramFilename);
+	// Saves state in the background, the emulator keeps running.
+	// saveStateStatus() returns SAVE_BUSY until it is written, then
+	// SAVE_OK or SAVE_FAILED.
+	public static native void saveState(String ramFilename);
+
+	public static final int SAVE_BUSY   = -1;
+	public static final int SAVE_FAILED = 0;
+	public static final int SAVE_OK     = 1;
+
+	public static native int saveStateStatus();
+
+	// Renders the LCD into bitmap, scaled by scaleX x scaleY. Returns false,
+	// leaving bitmap untouched, if the screen hasn't changed since last call.
+	public static native boolean renderScreen(int[] bitmap, int scaleX, int scaleY, int flags);
+
+	// Does all per-frame work in one call: queues count key events, given as
+	// (key | KEY_PRESSED, uptime ms) pairs in events, then renders like
+	// renderScreen() and fills status[STATUS_SIZE]. status[STATUS_EVENTS]
+	// tells how many events were queued; the rest should be passed again.
+	// Returns true if bitmap holds a new frame.
+	public static native boolean exchangeFrame(int[] events, int count, int[] bitmap,
+			int scaleX, int scaleY, int flags, int[] status);
+
+	// Blends the last frames LCD samples, taken every period timer ticks,
+	// into gray shades. frames < 2 turns blending off.
+	public static native void setGrayscale(int frames, int period);
+
+	// Connects the link cable to another emulator on this device, or
+	// drops it. The first emulator waits for the second one to connect.
+	public static native void setLink(boolean on);
+
+	// Keeps ROM images LZ4-packed in memory, unpacking 16kB pages as the
+	// calculator maps them in. Applies to ROMs loaded from then on.
+	public static native void setLowMemory(boolean on);
 
-	public static native void renderScreen(int[] bitmap);
+	// Clears calculator RAM. Restores the snapshot taken right after
+	// the first boot with this ROM, or reboots and takes one.
+	public static native void resetRAM();
+
+	// Copies emulator state into one of SLOTS in-memory slots, taking well
+	// under a frame, and also saves it to a file in the background if
+	// persist is set. loadSlot() restores it, from the file if the slot
+	// is empty.
+	public static final int SLOTS = 8;
+
+	public static native void saveSlot(int slot, boolean persist);
+
+	public static native void loadSlot(int slot);
+
+	// Returns the TIGutsModel.ATI_* model of a ROM image, told from its
+	// contents, or -1 if it is not one. Results are remembered by path,
+	// size and mtime in the file given to setRomCache().
+	public static native int identifyRom(String filename);
+
+	// Returns the OS version of a ROM image, like "2.55MP", or null if it
+	// is not one or the version is not known. Cached like identifyRom().
+	public static native String romVersion(String filename);
+
+	public static native void setRomCache(String filename);
+
+	// Puts variables from a .8xp/.8xv/... file into calculator RAM,
+	// replacing ones with the same names. TI83+ family only.
+	public static native void loadVariable(String filename);
 
 	public static native void start(int modelId, String romFilename, String ramFilename);
 
 	public static native void stop();
+
+	// Parks the emulator thread on its next timer tick, keeping all of
+	// its state in memory, until resume(). Both return at once.
+	public static native void suspend();
+
+	public static native void resume();
 }
@@ -41,6 +41,10 @@ public class SettingsActivity extends PreferenceActivity {
 	private class FindAllRomsTask extends FindRomsTask {
 		HashSet<String> mFoundNames = new HashSet<String>();
 
+		FindAllRomsTask() {
+			super(SettingsActivity.this);
+		}
+
 		@Override
 		public void onPreExecute() {
 			String foundNamesCSV = getPreference(KEY_FOUND_FILENAMES, "");
@@ -82,6 +86,12 @@ public class SettingsActivity extends PreferenceActivity {
 			case TIGutsModel.ATI_TI83SE:
 				modelResId = R.string.model_ti83se;
 				break;
+			case TIGutsModel.ATI_TI84P:
+				modelResId = R.string.model_ti84p;
+				break;
+			case TIGutsModel.ATI_TI84SE:
+				modelResId = R.string.model_ti84se;
+				break;
 			case TIGutsModel.ATI_TI85:
 				modelResId = R.string.model_ti85;
 				break;
@@ -89,8 +99,9 @@ public class SettingsActivity extends PreferenceActivity {
 				modelResId = R.string.model_ti86;
 				break;
 			}
+			String version = TIGutsModel.getRomVersion(new File(filename));
 			RomPreference preference = new RomPreference(
-					SettingsActivity.this, mRoms, modelResId, filename);
+					SettingsActivity.this, mRoms, modelResId, version, filename);
 			mRoms.addPreference(preference);
 		}
 
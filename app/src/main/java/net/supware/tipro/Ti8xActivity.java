@@ -49,11 +49,21 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 	private static final String KEY_HAPTIC_FEEDBACK = "haptic_feedback";
 	private static final String KEY_ZOOM = "zoom";
 	private static final String KEY_WAKE_LOCK = "wake_lock";
+	private static final String KEY_PIXEL_GRID = "pixel_grid";
+	private static final String KEY_GRAYSCALE = "grayscale";
+	private static final String KEY_FILTER = "filter";
+	private static final String KEY_LINK = "link";
+	private static final String KEY_LOW_MEMORY = "low_memory";
+
+	// LCD samples blended in grayscale mode, one per timer tick
+	private static final int GRAYSCALE_FRAMES = 6;
 
 	private static final int IO_BUFFER_SIZE = 4 * 1024;
 
 	protected static final int DIALOG_ABOUT = 2;
 	protected static final int DIALOG_SUPPORT = 4;
+	protected static final int DIALOG_SAVE_SLOT = 8;
+	protected static final int DIALOG_LOAD_SLOT = 16;
 
 	public SkinView mSkinView;
 	public ScreenView mScreenView;
@@ -174,8 +184,11 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 		super.onCreate(savedInstanceState);
 		setContentView(R.layout.activity_main);
 
+		NativeLib.setRomCache(new File(getFilesDir(), "roms.idx").getAbsolutePath());
+
 		PowerManager pm = (PowerManager) getSystemService(Context.POWER_SERVICE);
 		mWakeLock = pm.newWakeLock(PowerManager.SCREEN_DIM_WAKE_LOCK, "Andie Graph Wake Lock");
+		mWakeLock.setReferenceCounted(false);
 
 		mSkinView = (SkinView) findViewById(R.id.skin);
 		mSkinView.setClickable(true);
@@ -197,11 +210,22 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 		mIsZoomed = getPreference(KEY_ZOOM, false);
 		mDoWakeLock = getPreference(KEY_WAKE_LOCK, false);
 		mSkinView.setIsZoomed(mIsZoomed);
+		mScreenView.setPixelGrid(getPreference(KEY_PIXEL_GRID, false));
+		mScreenView.setFilter(getFilter(getPreference(KEY_FILTER, "none")));
+		NativeLib.setGrayscale(getPreference(KEY_GRAYSCALE, false) ? GRAYSCALE_FRAMES : 0, 1);
+		NativeLib.setLink(getPreference(KEY_LINK, false));
+		NativeLib.setLowMemory(getPreference(KEY_LOW_MEMORY, false));
 
 		initSkin();
 
 		NativeLib.onResume();
-		startEmulator();
+
+		// Continue a suspended emulator right where it was
+		NativeLib.resume();
+		if (!startEmulator() && mThread != null && mThread.isAlive()
+				&& mWakeLock != null && mDoWakeLock) {
+			mWakeLock.acquire();
+		}
 
 		super.onStart();
 	}
@@ -213,7 +237,15 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 		}
 		isPausing = true;
 
-		//NativeLib.stop();
+		// Park the emulator rather than stop it, saving state in the
+		// background in case the process gets killed while stopped
+		if (mThread != null && mThread.isAlive()) {
+			NativeLib.saveState(mGutsModel.mRamFilename);
+			NativeLib.suspend();
+		}
+		if (mWakeLock != null && mWakeLock.isHeld()) {
+			mWakeLock.release();
+		}
 		NativeLib.onPause();
 
 		mScreenView.clear();
@@ -236,6 +268,18 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 			startActivity(getSettingsIntent());
 			return true;
 		}
+		else if (id == R.id.menu_reset_ram) {
+			NativeLib.resetRAM();
+			return true;
+		}
+		else if (id == R.id.menu_save_slot) {
+			showDialog(DIALOG_SAVE_SLOT);
+			return true;
+		}
+		else if (id == R.id.menu_load_slot) {
+			showDialog(DIALOG_LOAD_SLOT);
+			return true;
+		}
 		else if (id == R.id.menu_about) {
 			showDialog(DIALOG_ABOUT);
 			return true;
@@ -310,6 +354,31 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 			return builder.create();
 		}
 
+		case DIALOG_SAVE_SLOT:
+		case DIALOG_LOAD_SLOT: {
+			final boolean save = id == DIALOG_SAVE_SLOT;
+			String[] slots = new String[NativeLib.SLOTS];
+			for (int i = 0; i < slots.length; i++) {
+				slots[i] = getString(R.string.text_slot, i + 1);
+			}
+
+			builder = new AlertDialog.Builder(this);
+			builder.setTitle(save ? R.string.menu_save_slot : R.string.menu_load_slot);
+			builder.setCancelable(true);
+			builder.setItems(slots, new DialogInterface.OnClickListener() {
+				public void onClick(DialogInterface dialog, int which) {
+					if (save) {
+						NativeLib.saveSlot(which, true);
+					} else {
+						NativeLib.loadSlot(which);
+					}
+					dialog.dismiss();
+				}
+			});
+
+			return builder.create();
+		}
+
 		case DIALOG_SUPPORT: {
 			builder = new AlertDialog.Builder(this);
 			builder.setIcon(getLauncherIconResId());
@@ -404,6 +473,16 @@ public abstract class Ti8xActivity extends FullScreenActivity {
 		return dest;
 	}
 
+	private static int getFilter(String name) {
+		if ("scale2x".equals(name))
+			return NativeLib.RENDER_SCALE2X;
+		if ("scale3x".equals(name))
+			return NativeLib.RENDER_SCALE3X;
+		if ("hq2x".equals(name))
+			return NativeLib.RENDER_HQ2X;
+		return 0;
+	}
+
 	public String getPreference(String key, String defaultValue) {
 		if (mPreferences == null) {
 			mPreferences = PreferenceManager.getDefaultSharedPreferences(this);
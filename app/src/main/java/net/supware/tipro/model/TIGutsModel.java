@@ -4,6 +4,8 @@ import java.io.File;
 
 import android.util.Log;
 
+import net.supware.tipro.NativeLib;
+
 public class TIGutsModel {
 	private static final String TAG = TIGutsModel.class.getSimpleName();
 
@@ -32,33 +34,30 @@ public class TIGutsModel {
 	}
 
 	/**
-	 * Returns the (guessed) model of the ROM of the file passed in.
+	 * Returns the model of the ROM of the file passed in, told from its
+	 * contents by the native side, so renamed dumps are found too.
 	 * 
 	 * @param file
-	 * @return one of the ATI_* constants defined in this module.
+	 * @return one of the ATI_* constants defined in this module, or -1.
 	 */
 	public static int getRomFileType(File file) {
-		String ucfilename = file.getName().toUpperCase();
+		// Cheap size check first, only these can be ROM images
 		long size = file.length();
-
-		if (!ucfilename.contains("TI"))
+		if (size != 0x20000 && size != 0x40000 && size != 0x80000
+				&& size != 0x100000 && size != 0x200000)
 			return -1;
 
-		if (size == 0x20000 && ucfilename.contains("82"))
-			return ATI_TI82;
-
-		if (size == 0x40000 && ucfilename.contains("83"))
-			return ATI_TI83;
-
-		if (size == 0x80000 && ucfilename.contains("83"))
-			return ATI_TI83P;
-
-		if (size == 0x20000 && ucfilename.contains("85"))
-			return ATI_TI85;
-
-		if (size == 0x40000 && ucfilename.contains("86"))
-			return ATI_TI86;
+		return NativeLib.identifyRom(file.getAbsolutePath());
+	}
 
-		return -1;
+	/**
+	 * Returns the OS version found in the ROM file passed in. Only does a
+	 * stat() for files getRomFileType() has already seen.
+	 * 
+	 * @param file
+	 * @return a version like "2.55MP", or null if not known.
+	 */
+	public static String getRomVersion(File file) {
+		return NativeLib.romVersion(file.getAbsolutePath());
 	}
 }
@@ -12,12 +12,17 @@ public class RomPreference extends RadioButtonPreference {
 	int mModelResId;
 	Checkable mRadioView;
 
-	public RomPreference(Context context, PreferenceCategory group, int modelResId, String filename) {
+	public RomPreference(Context context, PreferenceCategory group, int modelResId, String version,
+			String filename) {
 		super(context, group);
 		mModelResId = modelResId;
 		setWidgetLayoutResource(R.layout.preference_widget_radio);
 
-		setTitle(context.getString(mModelResId));
+		if (version == null)
+			setTitle(context.getString(mModelResId));
+		else
+			setTitle(context.getString(R.string.text_rom_model_version,
+					context.getString(mModelResId), version));
 		setSummary(filename);
 		setKey("rom_filename");
 		setValue(filename);
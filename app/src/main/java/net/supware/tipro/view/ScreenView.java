@@ -3,14 +3,13 @@ package net.supware.tipro.view;
 import java.util.LinkedList;
 import java.util.Queue;
 
-import android.annotation.TargetApi;
 import android.content.Context;
 import android.graphics.Bitmap;
 import android.graphics.BitmapFactory;
 import android.graphics.Canvas;
 import android.graphics.Color;
 import android.graphics.Rect;
-import android.os.Build;
+import android.os.SystemClock;
 import android.util.AttributeSet;
 import android.util.Log;
 import android.view.View;
@@ -21,36 +20,46 @@ import net.supware.tipro.R;
 public class ScreenView extends View {
 	private static final String TAG = ScreenView.class.getSimpleName();
 
+	// How often to check the emulator for a changed frame
+	private static final int FRAME_PERIOD_MS = 15;
+
+	// Frames between logging the time spent in exchangeFrame()
+	private static final int TIMING_FRAMES = 600;
+
 	private Bitmap mBitmap, mOverlay;
 	private boolean mHasDrawnValidFrame;
+	private boolean mPixelsStale;
 
 	private int mPixelWidth, mPixelHeight;
+	private int mScaleX, mScaleY, mRenderFlags;
 	private Rect mDstRect, mOverlaySrcRect, mOverlayDstRect;
 	private int[] mPixels;
+	private int[] mKeyEvents = new int[2 * 64];
+	private int[] mStatus = new int[NativeLib.STATUS_SIZE];
+	private long mExchangeNs;
+	private int mExchangeCount;
 
-	// Make keypresses more stable by syncing to each screen refresh
+	// Keypresses are handed to the emulator in batches, once per frame, with
+	// their time so that it can replay them with the original spacing
 	public static class KeyState {
 		public int code;
 		public boolean pressed;
+		public int time;
 
 		public KeyState(int code, boolean pressed) {
 			this.code = code;
 			this.pressed = pressed;
+			this.time = (int) SystemClock.uptimeMillis();
 		}
 	}
 
 	public Queue<KeyState> mKeyQueue;
 
-	@TargetApi(11)
 	public ScreenView(Context context, AttributeSet attributes) {
 		super(context, attributes);
 
-		// Hardware rendering for this view forces it to antialias (and blur)
-		// In this specific case, we want sharp pixels.
-		if (Build.VERSION.SDK_INT >= 11) {
-			setLayerType(View.LAYER_TYPE_SOFTWARE, null);
-		}
-
+		// The native side scales the screen by whole pixels, so the bitmap
+		// is always drawn 1:1 and hardware rendering can't blur it.
 		mKeyQueue = new LinkedList<KeyState>();
 	}
 
@@ -60,45 +69,148 @@ public class ScreenView extends View {
 
 		mPixelWidth = width;
 		mPixelHeight = height;
-		mPixels = new int[width * height];
-		mBitmap = Bitmap.createBitmap(width, height, Bitmap.Config.ARGB_8888);
+		createBitmap();
 	}
 
 	public void setViewPixelsRegion(Rect region) {
 		mDstRect = new Rect(region);
+		createBitmap();
+	}
+
+	public void setPixelGrid(boolean grid) {
+		mRenderFlags = (mRenderFlags & ~NativeLib.RENDER_GRID) | (grid ? NativeLib.RENDER_GRID : 0);
+		mPixelsStale = true;
+	}
+
+	/**
+	 * Selects a NativeLib.RENDER_FILTER pixel art filter, or 0 for none. The
+	 * filter only applies at scales that are a multiple of its factor.
+	 */
+	public void setFilter(int filter) {
+		mRenderFlags = (mRenderFlags & ~NativeLib.RENDER_FILTER) | (filter & NativeLib.RENDER_FILTER);
+		mPixelsStale = true;
+	}
+
+	/**
+	 * Allocates the bitmap at the destination size, rounded down to a whole
+	 * number of device pixels per calculator pixel.
+	 */
+	private void createBitmap() {
+		if (mPixelWidth == 0 || mPixelHeight == 0)
+			return;
+
+		int scaleX = mDstRect == null ? 1 : Math.max(1, mDstRect.width() / mPixelWidth);
+		int scaleY = mDstRect == null ? 1 : Math.max(1, mDstRect.height() / mPixelHeight);
+		if (mBitmap != null && scaleX == mScaleX && scaleY == mScaleY)
+			return;
+
+		mScaleX = scaleX;
+		mScaleY = scaleY;
+		mPixels = new int[mPixelWidth * scaleX * mPixelHeight * scaleY];
+		mBitmap = Bitmap.createBitmap(mPixelWidth * scaleX, mPixelHeight * scaleY,
+				Bitmap.Config.ARGB_8888);
+		mPixelsStale = true;
 	}
 
 	public void clear() {
 		mPixelWidth = 0;
 		mPixelHeight = 0;
+		mScaleX = 0;
+		mScaleY = 0;
 		mBitmap = null;
 		mHasDrawnValidFrame = false;
 		mPixels = null;
 	}
 
 	@Override
-	protected void onDraw(Canvas canvas) {
-		if (mBitmap == null) {
-			drawOverlay(canvas);
-			return;
-		}
+	protected void onAttachedToWindow() {
+		super.onAttachedToWindow();
+		post(mFrameLoop);
+	}
 
-		if (!mKeyQueue.isEmpty()) {
-			KeyState key = mKeyQueue.poll();
-			if (key.pressed) {
-				NativeLib.keyDown(key.code);
-			}
-			else {
-				NativeLib.keyUp(key.code);
+	@Override
+	protected void onDetachedFromWindow() {
+		removeCallbacks(mFrameLoop);
+		super.onDetachedFromWindow();
+	}
+
+	// Polls the emulator for a new frame. The bitmap is only updated and the
+	// view only invalidated when the calculator screen actually changed.
+	private final Runnable mFrameLoop = new Runnable() {
+		@Override
+		public void run() {
+			if (mBitmap != null && mDstRect != null && pollFrame()) {
+				invalidate();
 			}
+			postDelayed(this, FRAME_PERIOD_MS);
+		}
+	};
+
+	private boolean pollFrame() {
+		int count = 0;
+		for (KeyState key : mKeyQueue) {
+			if (count == mKeyEvents.length / 2)
+				break;
+			mKeyEvents[2 * count] = key.code | (key.pressed ? NativeLib.KEY_PRESSED : 0);
+			mKeyEvents[2 * count + 1] = key.time;
+			count++;
 		}
 
 		try {
-			NativeLib.renderScreen(mPixels);
-			mBitmap.setPixels(mPixels, 0, mPixelWidth, 0, 0, mPixelWidth, mPixelHeight);
+			int flags = mRenderFlags | (mPixelsStale ? NativeLib.RENDER_FORCE : 0);
+			long start = System.nanoTime();
+			boolean changed = NativeLib.exchangeFrame(mKeyEvents, count, mPixels,
+					mScaleX, mScaleY, flags, mStatus);
+			logTiming(System.nanoTime() - start);
+
+			// Events the emulator had no room for go again next frame
+			for (int j = mStatus[NativeLib.STATUS_EVENTS]; j > 0; --j)
+				mKeyQueue.poll();
+			if (!changed) {
+				return false;
+			}
+			mPixelsStale = false;
+			mBitmap.setPixels(mPixels, 0, mBitmap.getWidth(), 0, 0,
+					mBitmap.getWidth(), mBitmap.getHeight());
 		}
 		catch (UnsatisfiedLinkError e) {
-			Log.e(TAG, "renderScreen not found");
+			Log.e(TAG, "exchangeFrame not found");
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Logs the average wall time of exchangeFrame() every TIMING_FRAMES
+	 * frames. A -DBENCHMARK native build logs the native part of the same
+	 * call, so the difference is the JNI overhead per frame.
+	 */
+	private void logTiming(long ns) {
+		if (!Log.isLoggable(TAG, Log.DEBUG)) {
+			return;
+		}
+		mExchangeNs += ns;
+		if (++mExchangeCount == TIMING_FRAMES) {
+			Log.d(TAG, "exchangeFrame: " + mExchangeNs / TIMING_FRAMES + "ns/frame, emulating "
+					+ mStatus[NativeLib.STATUS_KHZ] / 1000f + "MHz");
+			mExchangeNs = 0;
+			mExchangeCount = 0;
+		}
+	}
+
+	/**
+	 * Returns the NativeLib.STATUS_* flags from the last frame exchange.
+	 */
+	public int getStatusFlags() {
+		return mStatus[NativeLib.STATUS_FLAGS];
+	}
+
+	@Override
+	protected void onDraw(Canvas canvas) {
+		if (mBitmap == null || mDstRect == null) {
+			drawOverlay(canvas);
+			return;
 		}
 
 		// Detect if calculator is turned on by testing if a pixel (we'll just
@@ -114,10 +226,10 @@ public class ScreenView extends View {
 		// running ok.
 		mHasDrawnValidFrame = true;
 
-		canvas.drawBitmap(mBitmap, null, mDstRect, null);
-
-		// We'll refresh the screen as fast as possible
-		postInvalidate();
+		// Integer scaling leaves a gap, keep the border even
+		canvas.drawBitmap(mBitmap,
+				mDstRect.left + (mDstRect.width() - mBitmap.getWidth()) / 2,
+				mDstRect.top + (mDstRect.height() - mBitmap.getHeight()) / 2, null);
 	}
 
 	/**
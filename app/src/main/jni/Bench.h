@@ -0,0 +1,26 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Bench.h                        **/
+/**                                                         **/
+/** This file contains timing helpers used by the built-in  **/
+/** microbenchmarks. Compile with -DBENCHMARK to get them.  **/
+/**                                                         **/
+/*************************************************************/
+#ifndef BENCH_H
+#define BENCH_H
+#ifdef BENCHMARK
+
+#include <time.h>
+
+/** BenchNS() ************************************************/
+/** Return monotonic time in nanoseconds.                   **/
+/*************************************************************/
+static inline long long BenchNS(void)
+{
+  struct timespec T;
+  clock_gettime(CLOCK_MONOTONIC,&T);
+  return((long long)T.tv_sec*1000000000LL+T.tv_nsec);
+}
+
+#endif /* BENCHMARK */
+#endif /* BENCH_H */
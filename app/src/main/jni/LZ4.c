@@ -0,0 +1,136 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          LZ4.c                          **/
+/**                                                         **/
+/** This file contains a small LZ4 block format packer and  **/
+/** unpacker. It favors speed over ratio: one hash probe    **/
+/** per position, skipping faster over incompressible data. **/
+/**                                                         **/
+/*************************************************************/
+#include "LZ4.h"
+
+#include <string.h>
+
+#define HASH_BITS   12         /* 4096-entry match table     */
+#define MIN_MATCH   4          /* Shortest match             */
+#define LAST_LITS   5          /* Format: last 5 bytes are   */
+#define MATCH_LIMIT 12         /* literals, last match starts*/
+                               /* 12 bytes before the end    */
+
+static unsigned int Rd32(const byte *P)
+{ return(P[0]|((unsigned int)P[1]<<8)|((unsigned int)P[2]<<16)|((unsigned int)P[3]<<24)); }
+
+/** PutLength() **********************************************/
+/** Write extra bytes of a length L>=15 stored in a token   **/
+/** nibble.                                                 **/
+/*************************************************************/
+static byte *PutLength(byte *P,int L)
+{
+  for(L-=15;L>=255;L-=255) *P++=255;
+  *P++=L;
+  return(P);
+}
+
+/** LZ4Pack() ************************************************/
+/** Pack N<=LZ4_MAXIN bytes from In into at most Max bytes  **/
+/** at Out. Returns packed size, or 0 if it does not fit.   **/
+/*************************************************************/
+int LZ4Pack(const byte *In,int N,byte *Out,int Max)
+{
+  word Hash[1<<HASH_BITS];
+  const byte *IP,*Anchor,*Ref,*End,*Limit;
+  byte *OP,*Token;
+  unsigned int V;
+  int L,M,H;
+
+  if((N<0)||(N>LZ4_MAXIN)) return(0);
+
+  memset(Hash,0,sizeof(Hash));
+  IP=Anchor = In;
+  End       = In+N;
+  Limit     = N>MATCH_LIMIT? End-MATCH_LIMIT:In;
+  OP        = Out;
+
+  while(IP<Limit)
+  {
+    /* Look up the last position with the same 4 bytes */
+    V       = Rd32(IP);
+    H       = (V*2654435761U)>>(32-HASH_BITS);
+    Ref     = In+Hash[H];
+    Hash[H] = IP-In;
+    if((Ref>=IP)||(Rd32(Ref)!=V)) { IP+=1+((IP-Anchor)>>6);continue; }
+
+    /* Extend match forward */
+    for(M=MIN_MATCH;(IP+M<End-LAST_LITS)&&(IP[M]==Ref[M]);++M);
+
+    /* Emit literals, offset, and match length */
+    L = IP-Anchor;
+    if(OP+L+L/255+M/255+8>Out+Max) return(0);
+    Token = OP++;
+    if(L>=15) { *Token=0xF0;OP=PutLength(OP,L); } else *Token=L<<4;
+    memcpy(OP,Anchor,L);
+    OP   += L;
+    *OP++ = (IP-Ref)&0xFF;
+    *OP++ = (IP-Ref)>>8;
+    if(M-MIN_MATCH>=15) { *Token|=0x0F;OP=PutLength(OP,M-MIN_MATCH); }
+    else *Token|=M-MIN_MATCH;
+
+    IP=Anchor = IP+M;
+  }
+
+  /* Emit remaining literals */
+  L = End-Anchor;
+  if(OP+L+L/255+2>Out+Max) return(0);
+  Token = OP++;
+  if(L>=15) { *Token=0xF0;OP=PutLength(OP,L); } else *Token=L<<4;
+  memcpy(OP,Anchor,L);
+  OP += L;
+
+  return(OP-Out);
+}
+
+/** LZ4Unpack() **********************************************/
+/** Unpack N bytes from In into at most Max bytes at Out.   **/
+/** Returns unpacked size, or -1 if In is corrupt.          **/
+/*************************************************************/
+int LZ4Unpack(const byte *In,int N,byte *Out,int Max)
+{
+  const byte *IP,*End,*Ref;
+  byte *OP,*OEnd;
+  int T,L,C;
+
+  IP   = In;
+  End  = In+N;
+  OP   = Out;
+  OEnd = Out+Max;
+
+  while(IP<End)
+  {
+    /* Copy literals */
+    T = *IP++;
+    L = T>>4;
+    if(L==15) do { if(IP>=End) return(-1);C=*IP++;L+=C; } while(C==255);
+    if((L>End-IP)||(L>OEnd-OP)) return(-1);
+    memcpy(OP,IP,L);
+    OP += L;
+    IP += L;
+
+    /* The last sequence has no match */
+    if(IP>=End) break;
+
+    /* Copy match, which may overlap its own output */
+    if(End-IP<2) return(-1);
+    C   = IP[0]|((int)IP[1]<<8);
+    IP += 2;
+    if(!C||(C>OP-Out)) return(-1);
+    L = T&0x0F;
+    if(L==15) do { if(IP>=End) return(-1);T=*IP++;L+=T; } while(T==255);
+    L += MIN_MATCH;
+    if(L>OEnd-OP) return(-1);
+    Ref = OP-C;
+    if(C>=L) { memcpy(OP,Ref,L);OP+=L; }
+    else while(L--) *OP++=*Ref++;
+  }
+
+  return(OP-Out);
+}
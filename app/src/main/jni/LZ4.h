@@ -0,0 +1,33 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          LZ4.h                          **/
+/**                                                         **/
+/** This file contains declarations for a small LZ4 block   **/
+/** format packer and unpacker, used for state files.       **/
+/**                                                         **/
+/*************************************************************/
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "Z80/Z80.h"           /* byte, word                 */
+
+#define LZ4_MAXIN 0x10000      /* Largest LZ4Pack() input    */
+
+/** LZ4Bound() ***********************************************/
+/** Largest LZ4Pack() output for N input bytes.             **/
+/*************************************************************/
+#define LZ4Bound(N) ((N)+(N)/255+16)
+
+/** LZ4Pack() ************************************************/
+/** Pack N<=LZ4_MAXIN bytes from In into at most Max bytes  **/
+/** at Out. Returns packed size, or 0 if it does not fit.   **/
+/*************************************************************/
+int LZ4Pack(const byte *In,int N,byte *Out,int Max);
+
+/** LZ4Unpack() **********************************************/
+/** Unpack N bytes from In into at most Max bytes at Out.   **/
+/** Returns unpacked size, or -1 if In is corrupt.          **/
+/*************************************************************/
+int LZ4Unpack(const byte *In,int N,byte *Out,int Max);
+
+#endif /* LZ4_H */
@@ -0,0 +1,431 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Link.c                         **/
+/**                                                         **/
+/** This file contains the link cable connecting two        **/
+/** emulator processes. Line changes are batched into time- **/
+/** stamped messages. While a transfer is active, both      **/
+/** sides share a time base set by the listening side, and  **/
+/** whoever polls the lines ahead of the other one waits    **/
+/** for it to catch up, so answers arrive at the emulated   **/
+/** time they are given, not a socket round trip later.     **/
+/**                                                         **/
+/*************************************************************/
+#include "Link.h"
+#include "TI85.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <android/log.h>
+#define LOG_TAG "Link"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+#define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+#define LINK_QUANTUM (LINK_HZ/10000) /* 100us lockstep when busy */
+#define LINK_IDLE    (LINK_HZ/1000)  /* 1ms heartbeat when idle  */
+#define LINK_ACTIVE  LINK_HZ         /* Busy for 1s after change */
+#define LINK_POLL    (LINK_HZ/200000) /* 5us between line polls */
+#define LINK_WAIT    100       /* ms to wait for a stuck peer */
+#define LINK_QUEUE   64        /* Messages batched per send   */
+
+#define MSG_LINES    1         /* Data = peer's pulled lines  */
+#define MSG_TIME     2         /* Heartbeat, Time only        */
+#define MSG_SYNC     3         /* Time matches our time Ref   */
+#define MSG_BYTE     4         /* Data = byte from link assist*/
+#define MSG_ACK      5         /* Peer has taken our byte     */
+
+/** Link messages, same byte order on both local peers *******/
+typedef struct
+{
+  unsigned int Time;           /* Sender's emulated time      */
+  unsigned int Ref;            /* MSG_SYNC: receiver's time   */
+  byte Type;                   /* MSG_* message type          */
+  byte Data;                   /* Message data                */
+  byte Pad[2];
+} LinkMsg;
+
+static volatile int LinkWant;  /* 1: link requested by user   */
+static int LinkOn;             /* 1: link opened/listening    */
+static int ListenFD = -1;      /* Listening socket or -1      */
+static int LinkFD   = -1;      /* Connected socket or -1      */
+
+static LinkMsg OutMsg[LINK_QUEUE]; /* Batched outgoing msgs   */
+static int OutCount;
+static byte InBuf[sizeof(LinkMsg)*LINK_QUEUE];
+static int InCount;            /* Bytes buffered at InBuf     */
+
+static byte SentLines;         /* Lines we are pulling low    */
+static byte PeerLines;         /* Lines the peer pulls low    */
+static unsigned int PeerTime;  /* Latest peer time, peer clock*/
+static unsigned int Offset;    /* Peer clock minus our clock  */
+static unsigned int LastPoll;  /* Our time at the last poll   */
+static unsigned int LastMove;  /* Our time at last line change*/
+static int Busy;               /* 1: transfer in progress     */
+static int Synced;             /* 1: Offset agreed with peer  */
+static int Server;             /* 1: we accepted connection   */
+
+static int RxByte;             /* Byte from peer, or -1       */
+static int TxFree;             /* 1: peer can take a byte     */
+
+/** LinkAddr() ***********************************************/
+/** Fill in peer address, an abstract UNIX socket named     **/
+/** after LinkPort. Returns address length.                 **/
+/*************************************************************/
+static socklen_t LinkAddr(struct sockaddr_un *A)
+{
+  memset(A,0,sizeof(*A));
+  A->sun_family = AF_UNIX;
+  /* Leading zero byte makes an abstract name, no file */
+  return(offsetof(struct sockaddr_un,sun_path)+1+
+    sprintf(A->sun_path+1,"AlmostTI.link.%d",LinkPort));
+}
+
+/** LinkStart() **********************************************/
+/** Start talking to a connected peer.                      **/
+/*************************************************************/
+static void LinkStart(int FD,int Accepted)
+{
+  fcntl(FD,F_SETFL,fcntl(FD,F_GETFL)|O_NONBLOCK);
+
+  if(ListenFD>=0) { close(ListenFD);ListenFD=-1; }
+  LinkFD    = FD;
+  OutCount  = InCount = 0;
+  SentLines = PeerLines = 0;
+  Busy      = Synced = 0;
+  Server    = Accepted;
+  RxByte    = -1;
+  TxFree    = 1;
+  if(Verbose) LOGD("Link connected\n");
+}
+
+/** LinkOpen() ***********************************************/
+/** Connect to a waiting peer, or start waiting for one.    **/
+/*************************************************************/
+static void LinkOpen(void)
+{
+  struct sockaddr_un A;
+  socklen_t L;
+  int FD;
+
+  /* Try connecting to a peer that is already listening */
+  L  = LinkAddr(&A);
+  FD = socket(AF_UNIX,SOCK_STREAM,0);
+  if(FD<0) return;
+  if(!connect(FD,(struct sockaddr *)&A,L)) { LinkStart(FD,0);return; }
+  close(FD);
+
+  /* None there, listen for the peer to connect to us */
+  FD = socket(AF_UNIX,SOCK_STREAM,0);
+  if(FD<0) return;
+  if(bind(FD,(struct sockaddr *)&A,L)||listen(FD,1))
+  {
+    if(Verbose) LOGE("Link: cannot listen (%s)\n",strerror(errno));
+    close(FD);
+    return;
+  }
+  fcntl(FD,F_SETFL,fcntl(FD,F_GETFL)|O_NONBLOCK);
+  ListenFD = FD;
+  if(Verbose) LOGD("Link waiting for peer\n");
+}
+
+/** LinkDrop() ***********************************************/
+/** Close peer connection, release its lines.               **/
+/*************************************************************/
+static void LinkDrop(void)
+{
+  if(LinkFD>=0) { close(LinkFD);LinkFD=-1; }
+  PeerLines = 0;
+  Busy      = Synced = 0;
+  if(Verbose) LOGD("Link disconnected\n");
+}
+
+/** LinkClose() **********************************************/
+/** Close link cable sockets.                               **/
+/*************************************************************/
+void LinkClose(void)
+{
+  if(LinkFD>=0)   LinkDrop();
+  if(ListenFD>=0) { close(ListenFD);ListenFD=-1; }
+  LinkOn = 0;
+}
+
+/** LinkEnable() *********************************************/
+/** Ask the emulation thread to connect (On=1) or drop (0)  **/
+/** the link cable. Safe to call from any thread.           **/
+/*************************************************************/
+void LinkEnable(int On) { LinkWant=!!On; }
+
+/** LinkFlush() **********************************************/
+/** Send batched messages to the peer.                      **/
+/*************************************************************/
+static void LinkFlush(void)
+{
+  struct pollfd P;
+  byte *Buf = (byte *)OutMsg;
+  int Len   = OutCount*sizeof(LinkMsg);
+  int J;
+
+  OutCount = 0;
+  while((LinkFD>=0)&&(Len>0))
+  {
+    J = send(LinkFD,Buf,Len,MSG_NOSIGNAL);
+    if(J>0) { Buf+=J;Len-=J;continue; }
+    if((J<0)&&(errno==EAGAIN||errno==EINTR))
+    {
+      /* Peer is not reading, give it a moment */
+      P.fd=LinkFD;P.events=POLLOUT;
+      if(poll(&P,1,LINK_WAIT)>0) continue;
+    }
+    LinkDrop();
+  }
+}
+
+/** LinkPost() ***********************************************/
+/** Queue a message for the peer.                           **/
+/*************************************************************/
+static void LinkPost(byte Type,byte Data,unsigned int Now,unsigned int Ref)
+{
+  if(OutCount>=LINK_QUEUE) LinkFlush();
+  OutMsg[OutCount].Time = Now;
+  OutMsg[OutCount].Ref  = Ref;
+  OutMsg[OutCount].Type = Type;
+  OutMsg[OutCount].Data = Data;
+  OutMsg[OutCount].Pad[0] = OutMsg[OutCount].Pad[1] = 0;
+  ++OutCount;
+}
+
+/** LinkBusy() ***********************************************/
+/** Lines moved at time Now, keep lockstep going. Server    **/
+/** sets the time base, client asks for one with MSG_SYNC.  **/
+/*************************************************************/
+static void LinkBusy(unsigned int Now,int Remap)
+{
+  LastMove = Now;
+  if(Busy&&!Remap) return;
+
+  Busy = 1;
+  if(!Server) { Synced=0;LinkPost(MSG_SYNC,0,Now,0);return; }
+
+  /* Take peer's latest time as now, pass it on */
+  Offset = PeerTime-Now;
+  Synced = 1;
+  LinkPost(MSG_SYNC,0,Now,PeerTime);
+}
+
+/** LinkRecv() ***********************************************/
+/** Receive and apply any messages from the peer. Returns   **/
+/** the number of messages applied.                         **/
+/*************************************************************/
+static int LinkRecv(unsigned int Now)
+{
+  LinkMsg M;
+  int J,N;
+
+  for(N=0;LinkFD>=0;)
+  {
+    J = recv(LinkFD,InBuf+InCount,sizeof(InBuf)-InCount,MSG_DONTWAIT);
+    if(!J||((J<0)&&(errno!=EAGAIN)&&(errno!=EINTR))) { LinkDrop();break; }
+    if(J<0) break;
+
+    for(InCount+=J,J=0;InCount-J>=sizeof(M);J+=sizeof(M),++N)
+    {
+      memcpy(&M,InBuf+J,sizeof(M));
+      PeerTime = M.Time;
+      if((M.Type==MSG_LINES)&&(PeerLines!=M.Data))
+      {
+        /* Peer moved its lines, go into lockstep */
+        PeerLines = M.Data;
+        LinkBusy(Now,0);
+      }
+      else if(M.Type==MSG_BYTE)
+      {
+        /* Peer's link assist sent a byte */
+        RxByte = M.Data;
+        LinkBusy(Now,0);
+      }
+      else if(M.Type==MSG_ACK)
+      {
+        /* Peer's link assist took our byte */
+        TxFree = 1;
+        LinkBusy(Now,0);
+      }
+      else if(M.Type==MSG_SYNC)
+      {
+        /* Server gives time base, client asks for one */
+        if(Server) LinkBusy(Now,1);
+        else { Offset=M.Time-M.Ref;Synced=Busy=1;LastMove=Now; }
+      }
+    }
+
+    /* Keep partial message for the next time */
+    InCount-=J;
+    if(InCount) memmove(InBuf,InBuf+J,InCount);
+  }
+
+  return(N);
+}
+
+/** LinkWait() ***********************************************/
+/** While a transfer is active, wait until the peer is no   **/
+/** more than Ahead units behind emulated time Now.         **/
+/*************************************************************/
+static void LinkWait(unsigned int Now,int Ahead)
+{
+  struct pollfd P;
+  int J;
+
+  for(J=0;Busy&&Synced&&(LinkFD>=0)&&((int)(Now-(PeerTime-Offset))>Ahead);)
+  {
+    P.fd=LinkFD;P.events=POLLIN;
+    if(poll(&P,1,1)>0) LinkRecv(Now);
+    else if(++J>=LINK_WAIT)
+    {
+      /* Peer has stopped, let it catch up on next change */
+      if(Verbose) LOGD("Link peer stalled\n");
+      Busy=Synced=0;
+    }
+  }
+}
+
+/** LinkTick() ***********************************************/
+/** Open, accept, or close connections as requested. Called **/
+/** on every 200Hz emulation tick. Returns 1 if connected.  **/
+/*************************************************************/
+int LinkTick(void)
+{
+  int FD;
+
+  if(LinkWant!=LinkOn)
+  {
+    if(LinkWant) { LinkOn=1;LinkOpen(); } else LinkClose();
+  }
+
+  /* Lost peer: wait for another one */
+  if(LinkOn&&(LinkFD<0)&&(ListenFD<0)) LinkOpen();
+
+  if(ListenFD>=0)
+  {
+    FD = accept(ListenFD,0,0);
+    if(FD>=0) LinkStart(FD,1);
+  }
+
+  return(LinkFD>=0);
+}
+
+/** LinkSync() ***********************************************/
+/** Send emulated time Now to the peer, receive its data,   **/
+/** and wait for a lagging peer while a transfer is active. **/
+/** Returns LINK_HZ units until the next LinkSync() call,   **/
+/** or 0 if the link has been closed.                       **/
+/*************************************************************/
+int LinkSync(unsigned int Now)
+{
+  if(LinkFD<0) return(0);
+
+  LinkPost(MSG_TIME,0,Now,0);
+  LinkFlush();
+  LinkRecv(Now);
+  LastPoll = Now;
+
+  /* Transfer over, stop lockstep */
+  if(Busy&&((int)(Now-LastMove)>LINK_ACTIVE)) Busy=Synced=0;
+
+  /* While busy, do not run ahead of the peer */
+  LinkWait(Now,2*LINK_QUANTUM);
+
+  return(LinkFD<0? 0:Busy? LINK_QUANTUM:LINK_IDLE);
+}
+
+/** LinkPoll() ***********************************************/
+/** Exchange messages with the peer, at most once every     **/
+/** LINK_POLL of emulated time, batching changes between.   **/
+/*************************************************************/
+static void LinkPoll(unsigned int Now)
+{
+  if((int)(Now-LastPoll)<LINK_POLL) return;
+
+  LastPoll = Now;
+  if(OutCount) LinkFlush();
+
+  /* Polling ahead of the peer: tell it our time, then */
+  /* let it catch up and answer                        */
+  if(!LinkRecv(Now)&&Busy&&Synced&&((int)(Now-(PeerTime-Offset))>LINK_POLL))
+  {
+    LinkPost(MSG_TIME,0,Now,0);
+    LinkFlush();
+    LinkWait(Now,LINK_POLL);
+  }
+}
+
+/** SIOExchange() ********************************************/
+/** Drive link lines with Vout (bit set: pull line low) at  **/
+/** emulated time Now. Returns line levels (bit set: line   **/
+/** is high), combining Vout with the peer's lines.         **/
+/*************************************************************/
+byte SIOExchange(byte Vout,unsigned int Now)
+{
+  Vout&=0x03;
+
+  /* No cable: only our own lines count */
+  if(LinkFD<0) return(~Vout&0x03);
+
+  if(Vout!=SentLines)
+  {
+    SentLines = Vout;
+    LinkBusy(Now,0);
+    LinkPost(MSG_LINES,Vout,Now,0);
+  }
+
+  LinkPoll(Now);
+  return(~(Vout|PeerLines)&0x03);
+}
+
+/** LinkBytes() **********************************************/
+/** Return link assist state at emulated time Now: LINK_RX  **/
+/** if LinkGet() has a byte, LINK_TX if LinkPut() can send  **/
+/** one, LINK_BUSY if the peer has not taken the last one.  **/
+/*************************************************************/
+int LinkBytes(unsigned int Now)
+{
+  if(LinkFD<0) return(0);
+  LinkPoll(Now);
+  return((RxByte>=0? LINK_RX:0)|(TxFree? LINK_TX:LINK_BUSY));
+}
+
+/** LinkPut() ************************************************/
+/** Send byte V to the peer's link assist at emulated time  **/
+/** Now. Returns 0 if there is no peer or it is still busy  **/
+/** with the previous byte.                                 **/
+/*************************************************************/
+int LinkPut(byte V,unsigned int Now)
+{
+  if((LinkFD<0)||!TxFree) return(0);
+  TxFree = 0;
+  LinkBusy(Now,0);
+  LinkPost(MSG_BYTE,V,Now,0);
+  return(1);
+}
+
+/** LinkGet() ************************************************/
+/** Take the byte received from the peer at emulated time   **/
+/** Now, letting it send the next one. Returns -1 if there  **/
+/** is no byte.                                             **/
+/*************************************************************/
+int LinkGet(unsigned int Now)
+{
+  int V = RxByte;
+
+  if((LinkFD<0)||(V<0)) return(-1);
+  RxByte = -1;
+  LinkBusy(Now,0);
+  LinkPost(MSG_ACK,0,Now,0);
+  return(V);
+}
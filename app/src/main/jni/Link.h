@@ -0,0 +1,79 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Link.h                         **/
+/**                                                         **/
+/** This file contains declarations for the link cable      **/
+/** connecting two emulator processes on the same device    **/
+/** through a local UNIX socket.                            **/
+/**                                                         **/
+/*************************************************************/
+#ifndef LINK_H
+#define LINK_H
+
+#include "Z80/Z80.h"           /* byte, word                 */
+
+/** Link time ************************************************/
+/** Link messages are stamped with emulated time counted at **/
+/** LINK_HZ, so that 6MHz and 15MHz peers agree on it.      **/
+/*************************************************************/
+#define LINK_HZ 30000000       /* Link clock, 5x6MHz/2x15MHz */
+
+/** LinkEnable() *********************************************/
+/** Ask the emulation thread to connect (On=1) or drop (0)  **/
+/** the link cable. Safe to call from any thread.           **/
+/*************************************************************/
+void LinkEnable(int On);
+
+/** LinkTick() ***********************************************/
+/** Open, accept, or close connections as requested. Called **/
+/** on every 200Hz emulation tick. Returns 1 if connected.  **/
+/*************************************************************/
+int LinkTick(void);
+
+/** LinkSync() ***********************************************/
+/** Send emulated time Now to the peer, receive its data,   **/
+/** and wait for a lagging peer while a transfer is active. **/
+/** Returns LINK_HZ units until the next LinkSync() call,   **/
+/** or 0 if the link has been closed.                       **/
+/*************************************************************/
+int LinkSync(unsigned int Now);
+
+/** SIOExchange() ********************************************/
+/** Drive link lines with Vout (bit set: pull line low) at  **/
+/** emulated time Now. Returns line levels (bit set: line   **/
+/** is high), combining Vout with the peer's lines.         **/
+/*************************************************************/
+byte SIOExchange(byte Vout,unsigned int Now);
+
+/** LinkBytes() Results **************************************/
+#define LINK_RX   0x01         /* LinkGet() has a byte        */
+#define LINK_TX   0x02         /* LinkPut() can send a byte   */
+#define LINK_BUSY 0x04         /* Peer still has our byte     */
+
+/** LinkBytes() **********************************************/
+/** Return link assist state at emulated time Now: LINK_RX  **/
+/** if LinkGet() has a byte, LINK_TX if LinkPut() can send  **/
+/** one, LINK_BUSY if the peer has not taken the last one.  **/
+/*************************************************************/
+int LinkBytes(unsigned int Now);
+
+/** LinkPut() ************************************************/
+/** Send byte V to the peer's link assist at emulated time  **/
+/** Now. Returns 0 if there is no peer or it is still busy  **/
+/** with the previous byte.                                 **/
+/*************************************************************/
+int LinkPut(byte V,unsigned int Now);
+
+/** LinkGet() ************************************************/
+/** Take the byte received from the peer at emulated time   **/
+/** Now, letting it send the next one. Returns -1 if there  **/
+/** is no byte.                                             **/
+/*************************************************************/
+int LinkGet(unsigned int Now);
+
+/** LinkClose() **********************************************/
+/** Close link cable sockets.                               **/
+/*************************************************************/
+void LinkClose(void);
+
+#endif /* LINK_H */
@@ -0,0 +1,320 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Pack.c                         **/
+/**                                                         **/
+/** This file contains the packed ROM used in low memory    **/
+/** mode. ROM pages are kept LZ4-packed and unpacked into a **/
+/** small cache as the Z80 maps them in.                    **/
+/**                                                         **/
+/*************************************************************/
+#include "TI85.h"
+#include "Pack.h"
+#include "LZ4.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <android/log.h>
+#define LOG_TAG "Pack"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+#define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+/** Packed ROM ***********************************************/
+/** In low memory mode, ROM pages are kept LZ4-packed, with **/
+/** identical pages sharing data, and ROM points to address **/
+/** space reserved with no access. MapPage() unpacks pages  **/
+/** into a small LRU cache as the mapper selects them.      **/
+/** Written flash pages stay unpacked in RawROM[] and go    **/
+/** back to the flash image file in FlushROM().             **/
+/*************************************************************/
+#define PAGE_CACHE  8          /* Unpacked ROM pages kept    */
+
+static byte *PackedROM[FLASH_PAGES]; /* LZ4 data, or raw page */
+static int  PackedLen[FLASH_PAGES];  /* 4000h: kept unpacked  */
+static byte *PackedBlock[FLASH_PAGES+1]; /* Distinct data     */
+static int  PackedCount;             /* Entries in PackedBlock*/
+static int  PackedBytes;             /* Total PackedBlock size*/
+static byte *ErasedPage;             /* Packed all-FFh page   */
+static int  ErasedLen;
+static byte *RawROM[FLASH_PAGES];    /* Written pages, or 0   */
+static byte ROMWritten[FLASH_PAGES]; /* 1: write back page    */
+static char PackedPath[sizeof(FlashPath)]; /* Write back here */
+byte ROMPacked;                      /* 1: ROM is packed      */
+
+static struct
+{
+  const byte *Src;             /* PackedROM[] data unpacked  */
+  byte *Data;                  /* Unpacked 16kB page         */
+  unsigned int Used;           /* Last use, for replacement  */
+} PageCache[PAGE_CACHE];
+
+static unsigned int PageUse;   /* PageCache[] use counter    */
+static unsigned int PageFaults; /* Pages unpacked so far     */
+static long long PageFaultNS;  /* Time spent unpacking       */
+
+/** PackData() ***********************************************/
+/** Return packed data equal to N bytes at P, sharing a     **/
+/** block already kept if there is one. Returns 0 if out of **/
+/** memory.                                                 **/
+/*************************************************************/
+static byte *PackData(const byte *P,int N)
+{
+  byte *D;
+  int J;
+
+  for(J=0;J<FLASH_PAGES;++J)
+    if(PackedROM[J]&&(PackedLen[J]==N)&&!memcmp(PackedROM[J],P,N))
+      return(PackedROM[J]);
+  if(ErasedPage&&(ErasedLen==N)&&!memcmp(ErasedPage,P,N)) return(ErasedPage);
+
+  if(!(D=(byte *)malloc(N))) return(0);
+  memcpy(D,P,N);
+  PackedBlock[PackedCount++]=D;
+  PackedBytes+=N;
+  return(D);
+}
+
+/** PackROMPage() ********************************************/
+/** Pack 16kB page at P into Buf, return its packed length  **/
+/** and data, kept as is if it does not pack.               **/
+/*************************************************************/
+static int PackROMPage(const byte *P,byte *Buf,const byte **Data)
+{
+  int N;
+
+  N=LZ4Pack(P,0x4000,Buf,0x4000-1);
+  *Data=N? Buf:P;
+  return(N? N:0x4000);
+}
+
+/** UnpackROM() **********************************************/
+/** Free a packed ROM. Call FlushROM() first to keep flash  **/
+/** changes.                                                **/
+/*************************************************************/
+void UnpackROM(void)
+{
+  int J;
+
+  for(J=0;J<FLASH_PAGES;++J)
+  {
+    free(RawROM[J]);
+    RawROM[J]=PackedROM[J]=0;
+    ROMWritten[J]=0;
+  }
+
+  while(PackedCount) free(PackedBlock[--PackedCount]);
+  PackedBytes=0;
+  for(J=0;J<PAGE_CACHE;++J)
+  {
+    free(PageCache[J].Data);
+    PageCache[J].Data=0;
+    PageCache[J].Src=0;
+  }
+  ErasedPage=0;
+  ROMPacked=0;
+}
+
+/** PackROM() ************************************************/
+/** Pack Size bytes of ROM image at P by 16kB pages. Sets   **/
+/** ROM to reserved address space. Returns 0 on failure,    **/
+/** leaving ROM alone.                                      **/
+/*************************************************************/
+int PackROM(const byte *P,int Size)
+{
+  const byte *D;
+  byte *V,*Buf;
+  int J,N;
+
+  if(Size>(FLASH_PAGES<<14)) return(0);
+  V=(byte *)mmap(0,Size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(V==MAP_FAILED) return(0);
+  if(!(Buf=(byte *)malloc(LZ4Bound(0x4000)+0x4000))) { munmap(V,Size);return(0); }
+
+  /* Erased flash pages are all FFh */
+  memset(Buf+LZ4Bound(0x4000),0xFF,0x4000);
+  N=PackROMPage(Buf+LZ4Bound(0x4000),Buf,&D);
+  ErasedPage=PackData(D,N);
+  ErasedLen=N;
+
+  for(J=0;ErasedPage&&(J<(Size>>14));++J)
+  {
+    N=PackROMPage(P+(J<<14),Buf,&D);
+    if(!(PackedROM[J]=PackData(D,N))) break;
+    PackedLen[J]=N;
+  }
+  free(Buf);
+
+  /* ROMPage() must never run out of memory */
+  for(N=0;(N<PAGE_CACHE)&&(PageCache[N].Data=(byte *)malloc(0x4000));++N);
+  if(N<PAGE_CACHE) ErasedPage=0;
+
+  /* MapROM() may change FlashPath before UnmapROM() */
+  ROMPacked=1;
+  strcpy(PackedPath,ROMShared? FlashPath:"");
+  if(!ErasedPage||(J<(Size>>14))) { UnpackROM();munmap(V,Size);return(0); }
+
+  /* The whole image is still resident here, compare with */
+  /* ReportROM() figures once it runs packed               */
+  ROM        = V;
+  PageFaults = 0;
+  PageFaultNS= 0;
+  LOGD("Packed ROM: %dkB of %dkB in %d distinct pages, resident %dkB unpacked",
+    PackedBytes>>10,Size>>10,PackedCount,ResidentKB()
+  );
+  return(1);
+}
+
+/** ROMPage() ************************************************/
+/** Return data of 16kB ROM page J, unpacking it if needed. **/
+/** Unpacked pages stay valid until the next ROMPage() call **/
+/** unless mapped into Page[].                              **/
+/*************************************************************/
+byte *ROMPage(int J)
+{
+  struct timespec T0,T1;
+  const byte *Src;
+  byte *D;
+  int K,V;
+
+  if(!ROMPacked) return(ROM+(J<<14));
+  if(RawROM[J]) return(RawROM[J]);
+
+  Src=PackedROM[J];
+  for(K=0,V=-1;K<PAGE_CACHE;++K)
+  {
+    if(PageCache[K].Src==Src)
+    {
+      PageCache[K].Used=++PageUse;
+      return(PageCache[K].Data);
+    }
+    /* Replace least recently used page not in Page[] */
+    D=PageCache[K].Data;
+    if((Page[0]!=D)&&(Page[1]!=D)&&(Page[2]!=D)&&(Page[3]!=D)
+     &&((V<0)||(PageCache[K].Used<PageCache[V].Used))) V=K;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&T0);
+  if(PackedLen[J]==0x4000) memcpy(PageCache[V].Data,Src,0x4000);
+  else LZ4Unpack(Src,PackedLen[J],PageCache[V].Data,0x4000);
+  PageCache[V].Src  = Src;
+  PageCache[V].Used = ++PageUse;
+  clock_gettime(CLOCK_MONOTONIC,&T1);
+
+  ++PageFaults;
+  PageFaultNS+=(T1.tv_sec-T0.tv_sec)*1000000000LL+(T1.tv_nsec-T0.tv_nsec);
+  return(PageCache[V].Data);
+}
+
+/** RemapROM() ***********************************************/
+/** Point Page[] slots showing ROM page J at its new data.  **/
+/*************************************************************/
+static void RemapROM(int J)
+{
+  int N;
+
+  for(N=0;N<4;++N)
+    if((size_t)(PageAt[N]-ROM-(J<<14))<0x4000) Page[N]=ROMPage(J);
+}
+
+/** WritePage() **********************************************/
+/** Return writable data of 16kB ROM page J. Packed pages   **/
+/** get unpacked for good. Returns 0 if out of memory, and  **/
+/** the write must be dropped.                              **/
+/*************************************************************/
+byte *WritePage(int J)
+{
+  byte *P;
+
+  if(!ROMPacked) return(ROM+(J<<14));
+
+  if(!RawROM[J])
+  {
+    if(!(P=(byte *)malloc(0x4000)))
+    {
+      if(Verbose) LOGE("Out of memory writing ROM page %d",J);
+      return(0);
+    }
+    memcpy(P,ROMPage(J),0x4000);
+    RawROM[J]=P;
+    RemapROM(J);
+  }
+
+  ROMWritten[J]=1;
+  return(RawROM[J]);
+}
+
+/** FillROM() ************************************************/
+/** Fill Size bytes of ROM at A with FFh, as erased flash.  **/
+/** Whole packed pages share the erased page data.          **/
+/*************************************************************/
+void FillROM(int A,int Size)
+{
+  byte *P;
+  int J,N;
+
+  for(;Size>0;A+=N,Size-=N)
+  {
+    J = A>>14;
+    N = 0x4000-(A&0x3FFF);
+    N = N<Size? N:Size;
+    if(!ROMPacked||(N<0x4000))
+    { if((P=WritePage(J))) memset(P+(A&0x3FFF),0xFF,N); }
+    else
+    {
+      free(RawROM[J]);
+      RawROM[J]    = 0;
+      PackedROM[J] = ErasedPage;
+      PackedLen[J] = ErasedLen;
+      ROMWritten[J]= 1;
+      RemapROM(J);
+    }
+  }
+}
+
+/** FlushROM() ***********************************************/
+/** Write flash changes back to the flash image file and    **/
+/** wait until they are on storage.                         **/
+/*************************************************************/
+void FlushROM(void)
+{
+  int F,J,OK;
+
+  if(!ROMPacked)
+  {
+    if(ROMShared&&msync(ROM,ROMMapSize,MS_SYNC)&&Verbose)
+      LOGE("Failed writing back %s",FlashPath);
+    return;
+  }
+
+  /* Written packed pages go back by themselves */
+  for(J=0;(J<FLASH_PAGES)&&!ROMWritten[J];++J);
+  if(!*PackedPath||(J==FLASH_PAGES)) return;
+
+  if((F=open(PackedPath,O_WRONLY))<0) OK=0;
+  else
+  {
+    for(OK=1;OK&&(J<FLASH_PAGES);++J)
+      OK=!ROMWritten[J]||(pwrite(F,ROMPage(J),0x4000,(off_t)J<<14)==0x4000);
+    OK=!fsync(F)&&OK;
+    close(F);
+  }
+
+  /* Keep pages marked for the next try if anything failed */
+  if(OK) memset(ROMWritten,0,sizeof(ROMWritten));
+  else if(Verbose) LOGE("Failed writing back %s",PackedPath);
+}
+
+/** ReportROM() **********************************************/
+/** Log page faults and resident memory in low memory mode. **/
+/*************************************************************/
+void ReportROM(void)
+{
+  if(!ROMPacked) return;
+  LOGD("Packed ROM: %u page faults, %lldus each, resident %dkB packed",
+    PageFaults,PageFaults? PageFaultNS/PageFaults/1000:0,ResidentKB()
+  );
+}
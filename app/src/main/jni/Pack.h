@@ -0,0 +1,61 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Pack.h                         **/
+/**                                                         **/
+/** This file contains declarations for the packed ROM used **/
+/** in low memory mode. Calls other than PackROM() work on  **/
+/** unpacked ROM as well.                                   **/
+/**                                                         **/
+/*************************************************************/
+#ifndef PACK_H
+#define PACK_H
+
+#include "Z80/Z80.h"           /* byte, word                 */
+
+#define FLASH_PAGES 128        /* 16kB pages in 2MB flash    */
+
+extern byte ROMPacked;         /* 1: ROM is packed, PackROM()*/
+
+/** PackROM() ************************************************/
+/** Pack Size bytes of ROM image at P by 16kB pages. Sets   **/
+/** ROM to reserved address space. Returns 0 on failure,    **/
+/** leaving ROM alone.                                      **/
+/*************************************************************/
+int PackROM(const byte *P,int Size);
+
+/** UnpackROM() **********************************************/
+/** Free a packed ROM. Call FlushROM() first to keep flash  **/
+/** changes.                                                **/
+/*************************************************************/
+void UnpackROM(void);
+
+/** ROMPage() ************************************************/
+/** Return data of 16kB ROM page J, unpacking it if needed. **/
+/** Unpacked pages stay valid until the next ROMPage() call **/
+/** unless mapped into Page[].                              **/
+/*************************************************************/
+byte *ROMPage(int J);
+
+/** WritePage() **********************************************/
+/** Return writable data of 16kB ROM page J. Returns 0 if   **/
+/** out of memory, and the write must be dropped.           **/
+/*************************************************************/
+byte *WritePage(int J);
+
+/** FillROM() ************************************************/
+/** Fill Size bytes of ROM at A with FFh, as erased flash.  **/
+/*************************************************************/
+void FillROM(int A,int Size);
+
+/** FlushROM() ***********************************************/
+/** Write flash changes back to the flash image file and    **/
+/** wait until they are on storage.                         **/
+/*************************************************************/
+void FlushROM(void);
+
+/** ReportROM() **********************************************/
+/** Log page faults and resident memory in low memory mode. **/
+/*************************************************************/
+void ReportROM(void);
+
+#endif /* PACK_H */
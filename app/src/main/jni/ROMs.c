@@ -0,0 +1,374 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          ROMs.c                         **/
+/**                                                         **/
+/** This file contains the ROM image identifier. It tells   **/
+/** the model and OS version from image contents rather     **/
+/** than file names, and remembers results by path, size,   **/
+/** and mtime, so that rescanning storage does not re-read  **/
+/** megabytes of flash.                                     **/
+/**                                                         **/
+/*************************************************************/
+#define _GNU_SOURCE            /* For memmem()               */
+#include "TI85.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <android/log.h>
+#define LOG_TAG "ROMs"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+#define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+#define ROM_CACHE   256        /* Files remembered           */
+#define ROM_PAGE    0x4000     /* Boot code is the last page */
+#define OS_VERSION  0x0064     /* TI83+ OS version string    */
+
+/** ROMEntry *************************************************/
+/** IdentROM() result for one file.                         **/
+/*************************************************************/
+typedef struct
+{
+  char *Path;                  /* File name, malloc()ed      */
+  long long Size;              /* File size, in bytes        */
+  long long MTime;             /* File modification time     */
+  unsigned int Hash;           /* Contents hash, 0 if no ROM */
+  int Model;                   /* ATI_* model, or -1         */
+  char Version[ROM_VERSION];   /* OS version, "" if unknown  */
+} ROMEntry;
+
+static ROMEntry Cache[ROM_CACHE];
+static int CacheCount;
+static char CachePath[256];
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** HashImage() **********************************************/
+/** FNV-1a hash of an image, a 32bit word at a time.        **/
+/*************************************************************/
+static unsigned int HashImage(const byte *P,int Size)
+{
+  unsigned int H,W;
+  int J;
+
+  for(H=2166136261U,J=0;J+4<=Size;J+=4)
+  {
+    memcpy(&W,P+J,4);
+    H=(H^W)*16777619U;
+  }
+  for(;J<Size;++J) H=(H^P[J])*16777619U;
+  return(H? H:1);
+}
+
+/** HasText() ************************************************/
+/** Return 1 if any of the given 0-terminated list of       **/
+/** strings occurs in N bytes at P.                         **/
+/*************************************************************/
+static int HasText(const byte *P,int N,const char *const *Text)
+{
+  for(;*Text;++Text)
+    if(memmem(P,N,*Text,strlen(*Text))) return(1);
+  return(0);
+}
+
+/** HasName() ************************************************/
+/** Return 1 if the file name, sans directory, contains S.  **/
+/*************************************************************/
+static int HasName(const char *FileName,const char *S)
+{
+  const char *P=strrchr(FileName,'/');
+  return(!!strstr(P? P+1:FileName,S));
+}
+
+/** IdentImage() *********************************************/
+/** Tell the model of a ROM image in memory, using its size **/
+/** to pick candidates and model strings to pick one, with  **/
+/** the file name as the last resort. Returns -1 if it does **/
+/** not look like a ROM at all.                             **/
+/*************************************************************/
+static int IdentImage(const byte *P,int Size,const char *FileName)
+{
+  static const char *const TI82[] = { "TI-82","TI82",0 };
+  static const char *const TI83[] = { "TI-83","TI83",0 };
+  static const char *const TI84[] = { "TI-84","TI84",0 };
+  static const char *const TI85[] = { "TI-85","TI85",0 };
+  static const char *const TI86[] = { "TI-86","TI86",0 };
+  static const char *const Menu[] = { "CATALOG",0 };
+  static const char *const Any[]  = { "TI-8","TI8",0 };
+  const byte *Boot;
+  int Named;
+
+  /* Every model starts at 0000h with DI or JP */
+  if((P[0]!=0xF3)&&(P[0]!=0xC3)) return(-1);
+
+  /* Model strings, or a name hint, must be there somewhere */
+  Named = HasName(FileName,"8");
+  if(!Named&&!HasText(P,Size,Any)) return(-1);
+
+  /* TI83+ family boot code sits in the last page */
+  Boot = P+Size-ROM_PAGE;
+
+  switch(Size)
+  {
+    case 0x20000:
+      /* TI82 has no CATALOG, TI85 does */
+      if(HasText(P,Size,TI85)||HasText(P,Size,Menu)) return(ATI_TI85);
+      if(HasText(P,Size,TI82)) return(ATI_TI82);
+      return(HasName(FileName,"85")? ATI_TI85:HasName(FileName,"82")? ATI_TI82:-1);
+
+    case 0x40000:
+      if(HasText(P,Size,TI86)) return(ATI_TI86);
+      if(HasText(P,Size,TI83)) return(ATI_TI83);
+      return(HasName(FileName,"86")? ATI_TI86:HasName(FileName,"83")? ATI_TI83:-1);
+
+    case 0x80000:
+      return(ATI_TI83P);
+
+    case 0x100000:
+      return(ATI_TI84P);
+
+    case 0x200000:
+      /* OS is shared by both SEs, boot code is not */
+      if(HasText(Boot,ROM_PAGE,TI84)) return(ATI_TI84SE);
+      if(HasText(Boot,ROM_PAGE,TI83)) return(ATI_TI83SE);
+      return(HasName(FileName,"84")? ATI_TI84SE:ATI_TI83SE);
+  }
+
+  return(-1);
+}
+
+/** GetVersion() *********************************************/
+/** Copy a version number like "1.19" or "2.55MP" from N    **/
+/** bytes at P to Version. Returns its length, or 0 if P    **/
+/** does not start with a version number.                   **/
+/*************************************************************/
+static int GetVersion(const byte *P,int N,char *Version)
+{
+  int J;
+
+  for(J=0;(J<N)&&(P[J]>='0')&&(P[J]<='9');++J);
+  if(!J||(J+1>=N)||(P[J]!='.')||(P[J+1]<'0')||(P[J+1]>'9')) return(0);
+  for(J+=2;(J<N)&&(J<ROM_VERSION-1)&&(P[J]>='0')&&(P[J]<='9');++J);
+  for(;(J<N)&&(J<ROM_VERSION-1)&&(P[J]>='A')&&(P[J]<='Z');++J);
+
+  memcpy(Version,P,J);
+  Version[J]='\0';
+  return(J);
+}
+
+/** IdentVersion() *******************************************/
+/** Find the OS version of a ROM image of the given model.  **/
+/** TI83+ family OS keeps it as a string at 0064h of page   **/
+/** 0. Older models only show it next to the model name on  **/
+/** their self-test screen, so take the first number after **/
+/** that. Version gets "" if nothing is found.              **/
+/*************************************************************/
+static void IdentVersion(const byte *P,int Size,int Model,char *Version)
+{
+  static const char *const Names[] = { "TI-82","TI-83","TI-85","TI-86",0 };
+  const byte *Q,*R,*End;
+  int J;
+
+  *Version='\0';
+
+  if(Model>=ATI_TI83P)
+  {
+    GetVersion(P+OS_VERSION,ROM_VERSION,Version);
+    return;
+  }
+
+  for(J=0;Names[J];++J)
+    for(Q=P;(Q=memmem(Q,P+Size-Q,Names[J],5));Q+=5)
+      for(End=Q+64<P+Size? Q+64:P+Size,R=Q+5;R<End;++R)
+        if(((R[-1]<'0')||(R[-1]>'9'))&&GetVersion(R,End-R,Version))
+          return;
+}
+
+/** ReadImage() **********************************************/
+/** Map a file and identify it. Returns model, -1 if it is  **/
+/** not a ROM, or -2 if it could not be read. Version gets  **/
+/** the OS version, if found.                               **/
+/*************************************************************/
+static int ReadImage(const char *FileName,int Size,unsigned int *Hash,char *Version)
+{
+  byte *P;
+  int F,M;
+
+  *Hash=0;
+  *Version='\0';
+  if((F=open(FileName,O_RDONLY))<0) return(-2);
+  P=(byte *)mmap(0,Size,PROT_READ,MAP_PRIVATE,F,0);
+  close(F);
+  if(P==MAP_FAILED) return(-2);
+
+  M     = IdentImage(P,Size,FileName);
+  *Hash = M<0? 0:HashImage(P,Size);
+  if(M>=0) IdentVersion(P,Size,M,Version);
+
+  munmap(P,Size);
+  return(M);
+}
+
+/** SaveCache() **********************************************/
+/** Write cached results to CachePath, if set, one per     **/
+/** line: model, hash, size, mtime, version or "-", path.   **/
+/** Called with CacheLock held.                             **/
+/*************************************************************/
+static void SaveCache(void)
+{
+  char Tmp[sizeof(CachePath)+4];
+  FILE *F;
+  int J;
+
+  if(!*CachePath) return;
+  sprintf(Tmp,"%s.tmp",CachePath);
+  if(!(F=fopen(Tmp,"wb"))) return;
+
+  for(J=0;J<CacheCount;++J)
+    fprintf(F,"%d %08X %lld %lld %s %s\n",
+      Cache[J].Model,Cache[J].Hash,Cache[J].Size,Cache[J].MTime,
+      *Cache[J].Version? Cache[J].Version:"-",Cache[J].Path
+    );
+
+  if(fclose(F)||rename(Tmp,CachePath)) unlink(Tmp);
+}
+
+/** AddCache() ***********************************************/
+/** Remember a result, dropping the oldest one if full.     **/
+/** Called with CacheLock held.                             **/
+/*************************************************************/
+static void AddCache(const char *Path,long long Size,long long MTime,unsigned int Hash,int Model,const char *Version)
+{
+  ROMEntry *E;
+  char *P;
+  int J;
+
+  if(!(P=strdup(Path))) return;
+
+  /* Replace stale entry for the same file */
+  for(J=0;(J<CacheCount)&&strcmp(Cache[J].Path,Path);++J);
+  if(J<CacheCount) free(Cache[J].Path);
+  else if(CacheCount<ROM_CACHE) J=CacheCount++;
+  else
+  {
+    free(Cache[0].Path);
+    memmove(Cache,Cache+1,(ROM_CACHE-1)*sizeof(ROMEntry));
+    J=ROM_CACHE-1;
+  }
+
+  E        = Cache+J;
+  E->Path  = P;
+  E->Size  = Size;
+  E->MTime = MTime;
+  E->Hash  = Hash;
+  E->Model = Model;
+  strncpy(E->Version,Version,ROM_VERSION-1);
+  E->Version[ROM_VERSION-1]='\0';
+}
+
+/** ROMCache() ***********************************************/
+/** Keep IdentROM() results in a file, so they survive      **/
+/** restarts. Loads results saved there before. Lines from **/
+/** before versions were kept have the path right after    **/
+/** mtime, and paths are absolute, so they still load.     **/
+/*************************************************************/
+void ROMCache(const char *FileName)
+{
+  char S[512],Version[ROM_VERSION];
+  long long Size,MTime;
+  unsigned int Hash;
+  int Model,N,J;
+  FILE *F;
+
+  pthread_mutex_lock(&CacheLock);
+
+  while(CacheCount) free(Cache[--CacheCount].Path);
+  strncpy(CachePath,FileName,sizeof(CachePath)-1);
+  CachePath[sizeof(CachePath)-1]='\0';
+
+  if((F=fopen(CachePath,"rb")))
+  {
+    while(fgets(S,sizeof(S),F))
+    {
+      N=strlen(S);
+      if(N&&(S[N-1]=='\n')) S[--N]='\0';
+      if(sscanf(S,"%d %X %lld %lld %n",&Model,&Hash,&Size,&MTime,&N)<4) continue;
+      for(J=N;S[J]&&(S[J]!=' ')&&(S[J]!='/');++J);
+      if((S[J]==' ')&&(J-N<ROM_VERSION))
+      {
+        memcpy(Version,S+N,J-N);
+        Version[J-N]='\0';
+        if(!strcmp(Version,"-")) *Version='\0';
+        N=J+1;
+      }
+      else *Version='\0';
+      if(S[N]) AddCache(S+N,Size,MTime,Hash,Model,Version);
+    }
+    fclose(F);
+  }
+
+  pthread_mutex_unlock(&CacheLock);
+}
+
+/** IdentROM() ***********************************************/
+/** Identify a ROM image file by its contents. Returns one  **/
+/** of ATI_* models, or -1 if it is not a ROM. Hash, if not **/
+/** 0, gets contents hash. Version, if not 0, gets the OS   **/
+/** version, or "" if unknown, and must have ROM_VERSION    **/
+/** bytes. Safe to call from any thread.                    **/
+/*************************************************************/
+int IdentROM(const char *FileName,unsigned int *Hash,char *Version)
+{
+  char V[ROM_VERSION];
+  struct stat St;
+  unsigned int H;
+  int J,M;
+
+  if(Hash) *Hash=0;
+  if(Version) *Version='\0';
+  if(stat(FileName,&St)||!S_ISREG(St.st_mode)) return(-1);
+
+  /* Only the sizes in Config[] can be ROMs */
+  for(J=0;Config[J].ROMSize&&(Config[J].ROMSize!=St.st_size);++J);
+  if(!Config[J].ROMSize) return(-1);
+
+  /* Look for a cached result first */
+  pthread_mutex_lock(&CacheLock);
+  for(J=0;J<CacheCount;++J)
+    if(!strcmp(Cache[J].Path,FileName)) break;
+  if((J<CacheCount)&&(Cache[J].Size==St.st_size)&&(Cache[J].MTime==St.st_mtime))
+  {
+    M=Cache[J].Model;
+    if(Hash) *Hash=Cache[J].Hash;
+    if(Version) strcpy(Version,Cache[J].Version);
+    pthread_mutex_unlock(&CacheLock);
+    return(M);
+  }
+  pthread_mutex_unlock(&CacheLock);
+
+  /* Read and identify the image without holding the lock */
+  M=ReadImage(FileName,St.st_size,&H,V);
+
+  /* Do not cache read failures, file may be readable later */
+  if(M<-1)
+  {
+    if(Verbose) LOGE("IdentROM(%s): can't read file",FileName);
+    return(-1);
+  }
+
+  if(Verbose) LOGD("IdentROM(%s): model %Xh, OS %s, hash %08Xh",FileName,M,*V? V:"unknown",H);
+  if(Hash) *Hash=H;
+  if(Version) strcpy(Version,V);
+
+  pthread_mutex_lock(&CacheLock);
+  AddCache(FileName,St.st_size,St.st_mtime,H,M,V);
+  SaveCache();
+  pthread_mutex_unlock(&CacheLock);
+
+  return(M);
+}
@@ -0,0 +1,415 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                         Render.c                        **/
+/**                                                         **/
+/** This file contains the code converting 1bpp LCD images  **/
+/** into scaled 32bit pixels. Scaled lines are built once   **/
+/** and then replicated with 16-byte vector stores, which   **/
+/** the compiler turns into NEON (ARM) or SSE (x86) code.   **/
+/**                                                         **/
+/*************************************************************/
+#include "Render.h"
+#include "Bench.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <android/log.h>
+#define LOG_TAG "Render"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+
+typedef int  v4si  __attribute__((vector_size(16)));
+typedef byte v16qu __attribute__((vector_size(16)));
+
+/** Temporal blending state **********************************/
+static byte BlendRing[BLEND_MAX][16*64]; /* Last LCD samples */
+static byte BlendAcc[64*128];  /* Samples with pixel on, by  */
+                               /* line, then bit, then byte  */
+static int  BlendFrames;       /* Samples kept, 0: disabled  */
+static int  BlendHead;         /* Oldest sample in BlendRing */
+unsigned int BlendGen;         /* Bumped when BlendAcc moves */
+
+/** Pixel art filters ****************************************/
+static byte FilterTab[512][9]; /* 3x3 neighbourhood -> FxF   */
+                               /* dots, 0..4 quarters of "on"*/
+static int  FilterBuilt = -1;  /* RENDER_FILTER in FilterTab */
+
+/** FillLine() ***********************************************/
+/** Write N copies of C to D, four pixels per vector store. **/
+/** Returns pointer past the last written pixel.            **/
+/*************************************************************/
+static inline int *FillLine(int *D,int C,int N)
+{
+  v4si V = { C,C,C,C };
+
+  for(;N>=4;N-=4,D+=4) memcpy(D,&V,sizeof(V));
+  while(N-->0) *D++=C;
+  return(D);
+}
+
+/** CopyLine() ***********************************************/
+/** Copy N pixels from S to D, 16 pixels per iteration.     **/
+/*************************************************************/
+static inline void CopyLine(int *D,const int *S,int N)
+{
+  v4si V0,V1,V2,V3;
+
+  for(;N>=16;N-=16,D+=16,S+=16)
+  {
+    memcpy(&V0,S,sizeof(V0));
+    memcpy(&V1,S+4,sizeof(V1));
+    memcpy(&V2,S+8,sizeof(V2));
+    memcpy(&V3,S+12,sizeof(V3));
+    memcpy(D,&V0,sizeof(V0));
+    memcpy(D+4,&V1,sizeof(V1));
+    memcpy(D+8,&V2,sizeof(V2));
+    memcpy(D+12,&V3,sizeof(V3));
+  }
+  if(N>0) memcpy(D,S,N*sizeof(int));
+}
+
+/** GapColor() ***********************************************/
+/** Color of the gap around a dot of color C: halfway to    **/
+/** the background color B, slightly darkened.              **/
+/*************************************************************/
+static int GapColor(int C,int B)
+{
+  int M;
+
+  M = ((C>>1)&0x7F7F7F)+((B>>1)&0x7F7F7F);
+  M-= (M>>3)&0x1F1F1F;
+  return(M|(C&0xFF000000));
+}
+
+/** ScaleLine() **********************************************/
+/** Scale one line of W palette indices by SX,SY. Gap[] is  **/
+/** only used when Grid is set. Returns pointer past the    **/
+/** last written pixel.                                     **/
+/*************************************************************/
+static int *ScaleLine(int *Dst,const byte *Idx,int W,int SX,int SY,const int *Palette,const int *Gap,int Grid)
+{
+  int *Line,X,J;
+
+  /* Build the first line of scaled dots */
+  Line=Dst;
+  if(SX==1)
+    for(X=0;X<W;++X) *Dst++=Palette[Idx[X]];
+  else if(!Grid)
+    for(X=0;X<W;++X) Dst=FillLine(Dst,Palette[Idx[X]],SX);
+  else
+    for(X=0;X<W;++X) { Dst=FillLine(Dst,Palette[Idx[X]],SX-1);*Dst++=Gap[Idx[X]]; }
+
+  /* Replicate it vertically */
+  for(J=Grid? 2:1;J<SY;++J,Dst+=W*SX) CopyLine(Dst,Line,W*SX);
+
+  /* Bottom gap line */
+  if(Grid)
+    for(X=0;X<W;++X) Dst=FillLine(Dst,Gap[Idx[X]],SX);
+
+  return(Dst);
+}
+
+/** Corner() *************************************************/
+/** HQ2x-style corner dot next to horizontal neighbour P,   **/
+/** vertical neighbour Q and diagonal R of center dot E, in **/
+/** quarters of "on".                                       **/
+/*************************************************************/
+static byte Corner(int E,int P,int Q,int R)
+{
+  /* No edge through this corner: keep center color */
+  if((P!=Q)||(P==E)) return(E*4);
+  /* Solid corner: mostly neighbour color */
+  if(R==P) return(E+3*P);
+  /* Thin diagonal line: half way */
+  return(2*E+P+Q);
+}
+
+/** BuildFilter() ********************************************/
+/** Fill FilterTab[] for the RENDER_FILTER value F.         **/
+/*************************************************************/
+static void BuildFilter(int F)
+{
+  int N,A,B,C,D,E,G,H,I;
+  int FF;
+  byte *T;
+
+  for(N=0;N<512;++N)
+  {
+    /* A B C */
+    /* D E F */
+    /* G H I */
+    A=(N>>8)&1;B=(N>>7)&1;C=(N>>6)&1;
+    D=(N>>5)&1;E=(N>>4)&1;FF=(N>>3)&1;
+    G=(N>>2)&1;H=(N>>1)&1;I=N&1;
+    T=FilterTab[N];
+
+    switch(F)
+    {
+      case RENDER_SCALE2X:
+        T[0] = D==B&&B!=FF&&D!=H? D:E;
+        T[1] = B==FF&&B!=D&&FF!=H? FF:E;
+        T[2] = D==H&&D!=B&&H!=FF? D:E;
+        T[3] = H==FF&&D!=H&&B!=FF? FF:E;
+        T[0]*=4;T[1]*=4;T[2]*=4;T[3]*=4;
+        break;
+
+      case RENDER_SCALE3X:
+        T[0] = D==B&&B!=FF&&D!=H? D:E;
+        T[1] = (D==B&&B!=FF&&D!=H&&E!=C)||(B==FF&&B!=D&&FF!=H&&E!=A)? B:E;
+        T[2] = B==FF&&B!=D&&FF!=H? FF:E;
+        T[3] = (D==B&&B!=FF&&D!=H&&E!=G)||(D==H&&D!=B&&H!=FF&&E!=A)? D:E;
+        T[4] = E;
+        T[5] = (B==FF&&B!=D&&FF!=H&&E!=I)||(H==FF&&D!=H&&B!=FF&&E!=C)? FF:E;
+        T[6] = D==H&&D!=B&&H!=FF? D:E;
+        T[7] = (D==H&&D!=B&&H!=FF&&E!=I)||(H==FF&&D!=H&&B!=FF&&E!=G)? H:E;
+        T[8] = H==FF&&D!=H&&B!=FF? FF:E;
+        for(A=0;A<9;++A) T[A]*=4;
+        break;
+
+      case RENDER_HQ2X:
+        T[0] = Corner(E,D,B,A);
+        T[1] = Corner(E,FF,B,C);
+        T[2] = Corner(E,D,H,G);
+        T[3] = Corner(E,FF,H,I);
+        break;
+    }
+  }
+
+  FilterBuilt=F;
+}
+
+/** RenderFilter() *******************************************/
+/** Render WxH 1bpp LCD image scaled by SX,SY through one of **/
+/** the table-driven RENDER_FILTER filters. Returns 0 if    **/
+/** SX,SY are not multiples of the filter factor.           **/
+/*************************************************************/
+static int RenderFilter(int *Dst,const byte *Src,int W,int H,int SX,int SY,const int *Palette,int F)
+{
+  word Idx[128];
+  byte Rows[3][130];
+  int Shades[5],X,Y,R,C,J,N,RX,RY,*Line;
+  const byte *P;
+
+  /* Filters output NxN dots per pixel */
+  N  = F==RENDER_SCALE3X? 3:2;
+  RX = SX/N;
+  RY = SY/N;
+  if(!RX||!RY||(SX%N)||(SY%N)) return(0);
+  if(FilterBuilt!=F) BuildFilter(F);
+
+  /* Five shades, for 0..4 quarters of "on" */
+  for(J=0;J<5;++J)
+  {
+    for(X=C=0;X<24;X+=8)
+      C|=((((Palette[0]>>X)&0xFF)*(4-J)+((Palette[1]>>X)&0xFF)*J)/4)<<X;
+    Shades[J] = C|(Palette[1]&0xFF000000);
+  }
+
+  for(Y=0;Y<H;++Y)
+  {
+    /* Unpack lines Y-1,Y,Y+1 with edge pixels repeated */
+    for(R=0;R<3;++R)
+    {
+      J = Y+R-1;
+      P = Src+16*(J<0? 0:J>=H? H-1:J);
+      for(X=0;X<W;++X) Rows[R][X+1]=(P[X>>3]>>(~X&7))&1;
+      Rows[R][0]   = Rows[R][1];
+      Rows[R][W+1] = Rows[R][W];
+    }
+
+    /* Compute 3x3 neighbourhoods */
+    for(X=0;X<W;++X)
+      Idx[X] = (Rows[0][X]<<8)|(Rows[0][X+1]<<7)|(Rows[0][X+2]<<6)
+             | (Rows[1][X]<<5)|(Rows[1][X+1]<<4)|(Rows[1][X+2]<<3)
+             | (Rows[2][X]<<2)|(Rows[2][X+1]<<1)|Rows[2][X+2];
+
+    /* Output N lines of dots, each replicated RY times */
+    for(R=0;R<N;++R)
+    {
+      Line=Dst;
+      for(X=0;X<W;++X)
+        for(C=0;C<N;++C)
+          Dst=FillLine(Dst,Shades[FilterTab[Idx[X]][R*N+C]],RX);
+      for(J=1;J<RY;++J,Dst+=W*SX) CopyLine(Dst,Line,W*SX);
+    }
+  }
+
+  return(1);
+}
+
+/** RenderFill() *********************************************/
+/** Fill N pixels at Dst with color C.                      **/
+/*************************************************************/
+void RenderFill(int *Dst,int C,int N) { FillLine(Dst,C,N); }
+
+/** RenderLCD() **********************************************/
+/** Convert WxH pixels of a 1bpp LCD image (16 bytes per    **/
+/** line) into 32bit pixels through Palette[0..1], scaling  **/
+/** it by integer factors SX,SY.                            **/
+/*************************************************************/
+void RenderLCD(int *Dst,const byte *Src,int W,int H,int SX,int SY,const int *Palette,int Flags)
+{
+  int Gap[2],X,Y,Grid;
+  byte Idx[128];
+
+  SX   = SX<1? 1:SX;
+  SY   = SY<1? 1:SY;
+  W    = W>128? 128:W;
+  Grid = (Flags&RENDER_GRID)&&(SX>=3)&&(SY>=3);
+
+  /* Use pixel art filter if it fits the scale */
+  if((Flags&RENDER_FILTER)&&RenderFilter(Dst,Src,W,H,SX,SY,Palette,Flags&RENDER_FILTER))
+    return;
+
+  if(Grid)
+  {
+    Gap[0] = GapColor(Palette[0],Palette[0]);
+    Gap[1] = GapColor(Palette[1],Palette[0]);
+  }
+
+  for(Y=0;Y<H;++Y,Src+=16)
+  {
+    for(X=0;X<W;++X) Idx[X]=(Src[X>>3]>>(~X&7))&1;
+    Dst=ScaleLine(Dst,Idx,W,SX,SY,Palette,Gap,Grid);
+  }
+}
+
+/** BlendReset() *********************************************/
+/** Start blending the last Frames LCD samples together.    **/
+/** Frames<2 disables blending.                             **/
+/*************************************************************/
+void BlendReset(int Frames)
+{
+  BlendFrames = Frames<2? 0:Frames>BLEND_MAX? BLEND_MAX:Frames;
+  BlendHead   = 0;
+  memset(BlendRing,0x00,sizeof(BlendRing));
+  memset(BlendAcc,0x00,sizeof(BlendAcc));
+  ++BlendGen;
+}
+
+/** BlendCount() *********************************************/
+/** Return number of LCD samples blended, 0 if disabled.    **/
+/*************************************************************/
+int BlendCount(void) { return(BlendFrames); }
+
+/** BlendFrame() *********************************************/
+/** Add a 1bpp LCD sample (16 bytes per line, 64 lines) to  **/
+/** the blend, dropping the oldest one. Pixel counts are    **/
+/** updated 16 bytes (128 pixels) per vector operation.     **/
+/*************************************************************/
+void BlendFrame(const byte *Src)
+{
+  v16qu New,Old,Acc;
+  byte *Ring,*P;
+  int Y,B;
+
+  if(!BlendFrames) return;
+
+  /* Replace the oldest sample */
+  Ring=BlendRing[BlendHead];
+  BlendHead=(BlendHead+1)%BlendFrames;
+  if(!memcmp(Ring,Src,sizeof(BlendRing[0]))) return;
+
+  for(Y=0,P=BlendAcc;Y<64;++Y,Src+=16,Ring+=16)
+  {
+    memcpy(&New,Src,sizeof(New));
+    memcpy(&Old,Ring,sizeof(Old));
+    memcpy(Ring,Src,16);
+
+    /* Byte I of plane B holds pixel I*8+B */
+    for(B=0;B<8;++B,P+=16)
+    {
+      memcpy(&Acc,P,sizeof(Acc));
+      Acc+=((New>>(7-B))&1)-((Old>>(7-B))&1);
+      memcpy(P,&Acc,sizeof(Acc));
+    }
+  }
+
+  ++BlendGen;
+}
+
+/** RenderBlend() ********************************************/
+/** Like RenderLCD(), but show the blended LCD samples, as  **/
+/** shades between Palette[0] and Palette[1].               **/
+/*************************************************************/
+void RenderBlend(int *Dst,int W,int H,int SX,int SY,const int *Palette,int Flags)
+{
+  int Shades[BLEND_MAX+1],Gap[BLEND_MAX+1];
+  int X,Y,J,C,Grid;
+  const byte *P;
+  byte Idx[128];
+
+  if(!BlendFrames) return;
+
+  SX   = SX<1? 1:SX;
+  SY   = SY<1? 1:SY;
+  W    = W>128? 128:W;
+  Grid = (Flags&RENDER_GRID)&&(SX>=3)&&(SY>=3);
+
+  /* Interpolate shades between the two LCD colors */
+  for(J=0;J<=BlendFrames;++J)
+  {
+    for(X=C=0;X<24;X+=8)
+      C|=((((Palette[0]>>X)&0xFF)*(BlendFrames-J)+((Palette[1]>>X)&0xFF)*J)/BlendFrames)<<X;
+    Shades[J] = C|(Palette[1]&0xFF000000);
+    Gap[J]    = GapColor(Shades[J],Palette[0]);
+  }
+
+  for(Y=0,P=BlendAcc;Y<H;++Y,P+=128)
+  {
+    for(X=0;X<W;++X) Idx[X]=P[((X&7)<<4)+(X>>3)];
+    Dst=ScaleLine(Dst,Idx,W,SX,SY,Shades,Gap,Grid);
+  }
+}
+
+/** BenchRender() ********************************************/
+/** Time RenderLCD() at common scale factors and log it.    **/
+/*************************************************************/
+#ifdef BENCHMARK
+void BenchRender(void)
+{
+  static const int Scales[] = { 1,2,3,4,5,6,8,0 };
+  int Palette[2] = { 0xFF9CA884,0xFF1C1C3C };
+  byte Src[16*64];
+  long long T;
+  int *Dst,J,N;
+
+  for(J=0;J<sizeof(Src);++J) Src[J]=(J*0x9D)^(J>>4);
+  Dst=(int *)malloc(128*8*64*8*sizeof(int));
+  if(!Dst) return;
+
+  for(J=0;Scales[J];++J)
+  {
+    T=BenchNS();
+    for(N=0;N<200;++N)
+      RenderLCD(Dst,Src,128,64,Scales[J],Scales[J],Palette,N&1? RENDER_GRID:0);
+    T=BenchNS()-T;
+    LOGD("RenderLCD 128x64 x%d: %lldns/frame",Scales[J],T/200);
+  }
+
+  /* Pixel art filters at the smallest fitting scale */
+  T=BenchNS();
+  for(N=0;N<200;++N) RenderLCD(Dst,Src,128,64,2,2,Palette,RENDER_SCALE2X);
+  LOGD("Scale2x 128x64 x2: %lldns/frame",(BenchNS()-T)/200);
+  T=BenchNS();
+  for(N=0;N<200;++N) RenderLCD(Dst,Src,128,64,3,3,Palette,RENDER_SCALE3X);
+  LOGD("Scale3x 128x64 x3: %lldns/frame",(BenchNS()-T)/200);
+  T=BenchNS();
+  for(N=0;N<200;++N) RenderLCD(Dst,Src,128,64,4,4,Palette,RENDER_HQ2X);
+  LOGD("HQ2x 128x64 x4: %lldns/frame",(BenchNS()-T)/200);
+
+  /* Blending 8 samples, one new sample per iteration */
+  BlendReset(BLEND_MAX);
+  T=BenchNS();
+  for(N=0;N<1000;++N) { Src[N&0x3FF]^=0x55;BlendFrame(Src); }
+  T=BenchNS()-T;
+  LOGD("BlendFrame: %lldns/sample",T/1000);
+  T=BenchNS();
+  for(N=0;N<200;++N) RenderBlend(Dst,128,64,4,4,Palette,0);
+  T=BenchNS()-T;
+  LOGD("RenderBlend 128x64 x4: %lldns/frame",T/200);
+  BlendReset(0);
+
+  free(Dst);
+}
+#endif /* BENCHMARK */
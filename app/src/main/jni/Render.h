@@ -0,0 +1,75 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                         Render.h                        **/
+/**                                                         **/
+/** This file contains declarations for the code converting **/
+/** 1bpp LCD images into scaled 32bit pixels, used by the   **/
+/** Android driver.                                         **/
+/**                                                         **/
+/*************************************************************/
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "Z80/Z80.h"           /* byte, word                 */
+
+/** RenderLCD() Flags ****************************************/
+#define RENDER_GRID  0x01      /* Shade gaps between LCD dots */
+#define RENDER_FILTER  0x0E    /* Pixel art filter:          */
+#define RENDER_SCALE2X 0x02    /*   Scale2x, scales 2,4,6... */
+#define RENDER_SCALE3X 0x04    /*   Scale3x, scales 3,6,9... */
+#define RENDER_HQ2X    0x06    /*   HQ2x-like, scales 2,4,.. */
+#define RENDER_FORCE 0x80      /* Render even if unchanged   */
+                               /* (renderScreen() JNI only)  */
+
+/** RenderLCD() **********************************************/
+/** Convert WxH pixels of a 1bpp LCD image (16 bytes per    **/
+/** line) into 32bit pixels through Palette[0..1], scaling  **/
+/** it by integer factors SX,SY. Dst must have room for     **/
+/** (W*SX)x(H*SY) pixels. With RENDER_GRID, the last column **/
+/** and row of each scaled dot are shaded (scales >=3 only).**/
+/** A RENDER_FILTER filter replaces both when the scales    **/
+/** are multiples of its factor, else it is ignored.        **/
+/*************************************************************/
+void RenderLCD(int *Dst,const byte *Src,int W,int H,int SX,int SY,const int *Palette,int Flags);
+
+/** RenderFill() *********************************************/
+/** Fill N pixels at Dst with color C.                      **/
+/*************************************************************/
+void RenderFill(int *Dst,int C,int N);
+
+/** Temporal blending of LCD samples (grayscale) ************/
+#define BLEND_MAX    8         /* Max number of LCD samples  */
+
+extern unsigned int BlendGen;  /* Bumped when blend changes  */
+
+/** BlendReset() *********************************************/
+/** Start blending the last Frames LCD samples together.    **/
+/** Frames<2 disables blending.                             **/
+/*************************************************************/
+void BlendReset(int Frames);
+
+/** BlendCount() *********************************************/
+/** Return number of LCD samples blended, 0 if disabled.    **/
+/*************************************************************/
+int BlendCount(void);
+
+/** BlendFrame() *********************************************/
+/** Add a 1bpp LCD sample (16 bytes per line, 64 lines) to  **/
+/** the blend, dropping the oldest one.                     **/
+/*************************************************************/
+void BlendFrame(const byte *Src);
+
+/** RenderBlend() ********************************************/
+/** Like RenderLCD(), but show the blended LCD samples, as  **/
+/** shades between Palette[0] and Palette[1].               **/
+/*************************************************************/
+void RenderBlend(int *Dst,int W,int H,int SX,int SY,const int *Palette,int Flags);
+
+/** BenchRender() ********************************************/
+/** Time RenderLCD() at common scale factors and log it.    **/
+/*************************************************************/
+#ifdef BENCHMARK
+void BenchRender(void);
+#endif
+
+#endif /* RENDER_H */
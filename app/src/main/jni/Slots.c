@@ -0,0 +1,239 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Slots.c                        **/
+/**                                                         **/
+/** This file contains in-memory state slots, saved and     **/
+/** restored in a few milliseconds, with flash kept as the  **/
+/** pages written since the slots were started.             **/
+/**                                                         **/
+/*************************************************************/
+#include "TI85.h"
+#include "Slots.h"
+#include "State.h"
+#include "Pack.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/** STASlot **************************************************/
+/** In-memory state slot. Flash is kept as the pages that   **/
+/** differ from FlashBase[], which holds the contents flash **/
+/** pages had before they were first written while slots    **/
+/** were in use.                                            **/
+/*************************************************************/
+#define STA_SLOTS   8          /* Number of state slots      */
+
+typedef struct
+{
+  int  Mode;                   /* Model and mode bits        */
+  unsigned int Hash;           /* HashROM() result           */
+  Z80  CPU;                    /* CPU registers              */
+  byte Ports[sizeof(Ports)];   /* I/O ports                  */
+  TI83LCD LCD;                 /* LCD controller             */
+  byte FlashStep,StartupOn;    /* Flash and [ON] key state   */
+  byte *RAM;                   /* RAM copy, RAMSize bytes    */
+  int  RAMSize;                /* RAM size, in bytes         */
+  unsigned int RAMFilled;      /* RAM pages ever used        */
+  unsigned int Mark;           /* DirtyMark() when RAM copied*/
+  const byte *ROM;             /* Flash mapping slot is for  */
+  unsigned int Epoch;          /* FlashEpoch when saved      */
+  byte *Flash[FLASH_PAGES];    /* Written flash pages, or 0  */
+} STASlot;
+
+static STASlot *Slots[STA_SLOTS];
+static byte *FlashBase[FLASH_PAGES]; /* Flash before writes  */
+static const byte *FlashROM;   /* Mapping FlashBase[] is for */
+static unsigned int FlashEpoch; /* Bumped when it is dropped */
+
+/** DropFlashBase() ******************************************/
+/** Forget FlashBase[] if it is for flash mapped at P, or   **/
+/** for any flash if P=0. Slots made for it stop working.   **/
+/*************************************************************/
+void DropFlashBase(const byte *P)
+{
+  int J;
+
+  if(P&&(P!=FlashROM)) return;
+  for(J=0;J<FLASH_PAGES;++J) { free(FlashBase[J]);FlashBase[J]=0; }
+  FlashROM=0;
+  ++FlashEpoch;
+}
+
+/** FlashKeep() **********************************************/
+/** Called before Size bytes of flash at A get written, to  **/
+/** keep their old contents for state slots.                **/
+/*************************************************************/
+void FlashKeep(int A,int Size)
+{
+  int J;
+
+  if(!FlashROM||(FlashROM!=ROM)) return;
+  for(J=A/STA_PAGE;J<=(A+Size-1)/STA_PAGE;++J)
+    if(!FlashBase[J]&&(FlashBase[J]=(byte *)malloc(STA_PAGE)))
+      memcpy(FlashBase[J],ROMPage(J),STA_PAGE);
+}
+
+/** FreeSlot() ***********************************************/
+/** Free in-memory state slot N.                            **/
+/*************************************************************/
+static void FreeSlot(int N)
+{
+  int J;
+
+  if(!Slots[N]) return;
+  for(J=0;J<FLASH_PAGES;++J) free(Slots[N]->Flash[J]);
+  free(Slots[N]->RAM);
+  free(Slots[N]);
+  Slots[N]=0;
+}
+
+/** SlotName() ***********************************************/
+/** Make file name for slot N next to the RAM file.         **/
+/*************************************************************/
+static int SlotName(char *Name,int N)
+{
+  char Ext[8];
+
+  sprintf(Ext,".S%d",N);
+  return(RAMName(Name,Ext));
+}
+
+/** SaveSlot() ***********************************************/
+/** Copy emulation state into in-memory slot N, only RAM    **/
+/** pages written since the last copy. If Persist=1, also   **/
+/** save it to a file in the background. Returns 1 on       **/
+/** success, 0 on failure.                                  **/
+/*************************************************************/
+int SaveSlot(int N,int Persist)
+{
+  char Name[264];
+  STASlot *S;
+  int J,All;
+
+  if((N<0)||(N>=STA_SLOTS)||!RAM) return(0);
+
+  if(!(S=Slots[N]))
+  {
+    if(!(S=Slots[N]=(STASlot *)calloc(1,sizeof(STASlot)))) return(0);
+  }
+
+  /* New RAM copy if size changed */
+  All=!S->RAM||(S->RAMSize!=RAMSize);
+  if(All)
+  {
+    free(S->RAM);
+    if(!(S->RAM=(byte *)malloc(RAMSize))) { FreeSlot(N);return(0); }
+    S->RAMSize=RAMSize;
+  }
+
+  /* Copy used pages written since the last copy */
+  for(J=0;J<RAMSize;J+=STA_PAGE)
+    if((RAMFilled&(1<<(J/STA_PAGE)))&&(All||DirtySince(S->Mark,J,STA_PAGE)))
+      memcpy(S->RAM+J,RAM+J,STA_PAGE);
+
+  S->Mode      = Mode;
+  S->Hash      = HashROM();
+  S->CPU       = CPU;
+  S->LCD       = LCD;
+  S->FlashStep = FlashStep;
+  S->StartupOn = StartupOn;
+  S->RAMFilled = RAMFilled;
+  S->Mark      = DirtyMark();
+  memcpy(S->Ports,Ports,sizeof(Ports));
+
+  /* Flash goes as pages changed since FlashBase[] was started */
+  if(TI83P_FAMILY&&(FlashROM!=ROM)) { DropFlashBase(0);FlashROM=ROM; }
+  S->ROM   = TI83P_FAMILY? ROM:0;
+  S->Epoch = FlashEpoch;
+  for(J=0;J<FLASH_PAGES;++J)
+    if(!S->ROM||!FlashBase[J]) { free(S->Flash[J]);S->Flash[J]=0; }
+    else if(S->Flash[J]||(S->Flash[J]=(byte *)malloc(STA_PAGE)))
+      memcpy(S->Flash[J],ROMPage(J),STA_PAGE);
+
+  /* Write slot file in the background */
+  if(Persist&&SlotName(Name,N)) SnapSTA(Name);
+
+  return(1);
+}
+
+/** LoadSlot() ***********************************************/
+/** Restore emulation state from slot N, or from its file   **/
+/** if the slot is empty. Returns 1 on success, 0 on        **/
+/** failure.                                                **/
+/*************************************************************/
+int LoadSlot(int N)
+{
+  char Name[264];
+  const byte *P;
+  STASlot *S;
+  byte *D;
+  int J,M;
+
+  if((N<0)||(N>=STA_SLOTS)) return(0);
+
+  /* Empty slot comes from its file, if any */
+  if(!(S=Slots[N]))
+    return(SlotName(Name,N)&&LoadSTA(Name)&&SaveSlot(N,0));
+
+  /* Flash changes only apply to the same mapping */
+  if(S->ROM&&((S->ROM!=FlashROM)||(S->Epoch!=FlashEpoch))) return(0);
+
+  /* Check the slot against the ROM its model would use */
+  for(M=0;Config[M].ROMSize&&((S->Mode&ATI_MODEL)!=Config[M].Model);++M);
+  if(!Config[M].ROMSize||(S->RAMSize!=Config[M].RAMSize)) return(0);
+  if(S->ROM)
+  {
+    /* Flash slots need the very same mapping back */
+    if((S->ROM!=ROM)&&!KeptROM(S->ROM,M)) return(0);
+  }
+  else
+  {
+    D=(byte *)malloc(2*STA_PAGE);
+    J=D&&PeekROM(M,D)&&(S->Hash==HashPages(D,D+STA_PAGE));
+    free(D);
+    if(!J) return(0);
+  }
+
+  /* Switch model only once the slot is known to fit */
+  if((S->Mode!=Mode)&&(ResetTI85(S->Mode)!=S->Mode)) return(0);
+  if((S->RAMSize!=RAMSize)||(S->ROM&&(S->ROM!=ROM)))
+  {
+    ResetTI85(Mode);
+    return(0);
+  }
+
+  CPU       = S->CPU;
+  LCD       = S->LCD;
+  FlashStep = S->FlashStep;
+  StartupOn = S->StartupOn;
+  memcpy(Ports,S->Ports,sizeof(Ports));
+
+  /* Unused pages get NORAM when mapped */
+  for(J=0;J<RAMSize;J+=STA_PAGE)
+    if(S->RAMFilled&(1<<(J/STA_PAGE))) memcpy(RAM+J,S->RAM+J,STA_PAGE);
+  RAMFilled=S->RAMFilled;
+
+  /* Put back written flash pages */
+  if(S->ROM)
+    for(J=0;J<FLASH_PAGES;++J)
+      if(FlashBase[J]&&(P=S->Flash[J]? S->Flash[J]:FlashBase[J])&&memcmp(ROMPage(J),P,STA_PAGE)&&(D=WritePage(J)))
+        memcpy(D,P,STA_PAGE);
+
+  StateLoaded();
+
+  /* Slot now matches RAM again */
+  S->Mark=DirtyMark();
+  return(1);
+}
+
+/** FreeSlots() **********************************************/
+/** Free all in-memory state slots.                         **/
+/*************************************************************/
+void FreeSlots(void)
+{
+  int N;
+
+  for(N=0;N<STA_SLOTS;++N) FreeSlot(N);
+  DropFlashBase(0);
+}
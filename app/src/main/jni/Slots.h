@@ -0,0 +1,31 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Slots.h                        **/
+/**                                                         **/
+/** This file contains declarations for in-memory state     **/
+/** slots. SaveSlot() and LoadSlot() are in TI85.h.         **/
+/**                                                         **/
+/*************************************************************/
+#ifndef SLOTS_H
+#define SLOTS_H
+
+#include "Z80/Z80.h"           /* byte, word                 */
+
+/** DropFlashBase() ******************************************/
+/** Forget FlashBase[] if it is for flash mapped at P, or   **/
+/** for any flash if P=0. Slots made for it stop working.   **/
+/*************************************************************/
+void DropFlashBase(const byte *P);
+
+/** FlashKeep() **********************************************/
+/** Called before Size bytes of flash at A get written, to  **/
+/** keep their old contents for state slots.                **/
+/*************************************************************/
+void FlashKeep(int A,int Size);
+
+/** FreeSlots() **********************************************/
+/** Free all in-memory state slots.                         **/
+/*************************************************************/
+void FreeSlots(void);
+
+#endif /* SLOTS_H */
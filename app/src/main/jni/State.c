@@ -0,0 +1,847 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          State.c                        **/
+/**                                                         **/
+/** This file contains state files: saving them in the      **/
+/** background, loading them only once they check out, and  **/
+/** the snapshot restored on cold boots.                    **/
+/**                                                         **/
+/*************************************************************/
+#include "TI85.h"
+#include "State.h"
+#include "Pack.h"
+#include "Slots.h"
+#include "LZ4.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <android/log.h>
+#define LOG_TAG "State"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+#define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+#ifdef ZLIB
+#include <zlib.h>
+#define fopen           gzopen
+#define fclose          gzclose
+#define fread(B,L,N,F)  gzread(F,B,(L)*(N))
+#define fwrite(B,L,N,F) gzwrite(F,B,(L)*(N))
+#define fseek           gzseek
+#define rewind          gzrewind
+#define fgetc           gzgetc
+#define ftell           gztell
+#endif
+
+/** Boot snapshot ********************************************/
+/** After a cold boot, the machine is saved to BootPath once**/
+/** the OS idles, and later cold boots restore it.          **/
+#define BOOT_IDLE  100       /* HALTed ticks to be idle      */
+int  BootIdle = -1;          /* Idle ticks so far, -1: off   */
+static unsigned int BootKey; /* HashBoot() of current ROM    */
+char BootPath[264];          /* Boot snapshot file name      */
+/*************************************************************/
+
+/** State files **********************************************/
+/** A state file is STA_MAGIC, a 16bit version, and chunks, **/
+/** each a 4-char tag, 32bit size, and data, ending with an **/
+/** "END " chunk. All numbers are little-endian. Unknown    **/
+/** chunks are skipped. Memory chunks hold the memory size  **/
+/** and then each 16kB page as its 32bit size and data:    **/
+/** LZ4 packed, 0x4000 stored as is, or 0 never used.       **/
+/*************************************************************/
+#define STA_MAGIC   "ATI-STA\x1A"
+#define STA_VERSION 1
+#define STA_HEAD    16         /* HEAD chunk size            */
+#define STA_THUMB   (4+16*64)  /* THMB chunk size            */
+#define STA_CPU     43         /* CPU chunk size             */
+#define STA_HW      (sizeof(Ports)+2)
+#define STA_LCD     (sizeof(LCD.Buffer)+6)
+#define STA_PAGES(N) (4+((N)/STA_PAGE)*(4+LZ4Bound(STA_PAGE)))
+
+static byte *Put16(byte *P,unsigned int V)
+{ P[0]=V;P[1]=V>>8;return(P+2); }
+static byte *Put32(byte *P,unsigned int V)
+{ P[0]=V;P[1]=V>>8;P[2]=V>>16;P[3]=V>>24;return(P+4); }
+static unsigned int Get16(const byte *P)
+{ return(P[0]|((unsigned int)P[1]<<8)); }
+static unsigned int Get32(const byte *P)
+{ return(P[0]|((unsigned int)P[1]<<8)|((unsigned int)P[2]<<16)|((unsigned int)P[3]<<24)); }
+
+/** HashPages() **********************************************/
+/** FNV-1a hash of the first (OS) and last (boot) 16kB ROM  **/
+/** pages, given at OS and Boot.                            **/
+/*************************************************************/
+unsigned int HashPages(const byte *OS,const byte *Boot)
+{
+  unsigned int H;
+  int J;
+
+  for(H=2166136261U,J=0;J<STA_PAGE;++J) H=(H^OS[J])*16777619U;
+  for(J=0;J<STA_PAGE;++J) H=(H^Boot[J])*16777619U;
+  return(H);
+}
+
+/** HashROM() ************************************************/
+/** Identify the ROM by HashPages() of its first and last   **/
+/** pages.                                                  **/
+/*************************************************************/
+unsigned int HashROM(void)
+{
+  return(HashPages(ROMPage(0),ROMPage((ROMSize>>14)-1)));
+}
+
+/** PeekROM() ************************************************/
+/** Read the first and last 16kB pages of the ROM image     **/
+/** that ResetTI85() maps for Config[M] into Buf[8000h],    **/
+/** without mapping it. Returns 0 on failure.               **/
+/*************************************************************/
+int PeekROM(int M,byte *Buf)
+{
+  char Name[sizeof(BootPath)];
+  struct stat St;
+  int F,J,Size;
+
+  Size=Config[M].ROMSize;
+
+  /* Current ROM is already there */
+  if(ROMSize&&(Config[M].Model==(Mode&ATI_MODEL)))
+  {
+    memcpy(Buf,ROMPage(0),STA_PAGE);
+    memcpy(Buf+STA_PAGE,ROMPage((Size>>14)-1),STA_PAGE);
+    return(1);
+  }
+
+  /* Flash image if MapROM() would use it, else ROM image. */
+  /* BlankEEPROM() never touches first and last pages.     */
+  F=-1;
+  if((Config[M].Model>=ATI_TI83P)&&RAMName(Name,".FLASH")&&((F=open(Name,O_RDONLY))>=0))
+    if(fstat(F,&St)||(St.st_size!=Size)) { close(F);F=-1; }
+  if((F<0)&&((F=open(ROMPath,O_RDONLY))<0)) return(0);
+
+  J = !fstat(F,&St)&&(St.st_size>=Size)
+    &&(pread(F,Buf,STA_PAGE,0)==STA_PAGE)
+    &&(pread(F,Buf+STA_PAGE,STA_PAGE,Size-STA_PAGE)==STA_PAGE);
+  close(F);
+  return(J);
+}
+
+/** PutChunk() ***********************************************/
+/** Start a chunk with a given tag at P, return its data.   **/
+/** EndChunk() fills in the size once the data is written.  **/
+/*************************************************************/
+static byte *PutChunk(byte *P,const char *Tag)
+{ memcpy(P,Tag,4);return(P+8); }
+static byte *EndChunk(byte *Data,byte *End)
+{ Put32(Data-4,End-Data);return(End); }
+
+/** Packed RAM pages *****************************************/
+/** Saving keeps packed RAM pages and repacks only the ones **/
+/** written since PackMark.                                 **/
+#define STA_RAMPAGES (DIRTY_BLOCKS>>(14-DIRTY_SHIFT))
+static byte *PackPage[STA_RAMPAGES]; /* Packed page data    */
+static int PackLen[STA_RAMPAGES];    /* Packed size, 0: none*/
+static unsigned int PackMark;        /* DirtyMark() at save */
+/*************************************************************/
+
+/** PutPages() ***********************************************/
+/** Pack Size bytes of memory at Src page by page. Pages    **/
+/** not set in Used are stored as never used. With Cache=1, **/
+/** pages not set in Fresh come from PackPage[], the others **/
+/** are packed and kept there.                              **/
+/*************************************************************/
+static byte *PutPages(byte *P,const byte *Src,int Size,unsigned int Used,unsigned int Fresh,int Cache)
+{
+  int J,K,N;
+
+  P=Put32(P,Size);
+  for(J=0,K=0;J<Size;J+=STA_PAGE,++K)
+    if(!(Used&(1<<K))) P=Put32(P,0);
+    else if(Cache&&!(Fresh&(1<<K)))
+    {
+      memcpy(P+4,PackPage[K],N=PackLen[K]);
+      P=Put32(P,N)+N;
+    }
+    else
+    {
+      N=LZ4Pack(Src+J,STA_PAGE,P+4,STA_PAGE-1);
+      if(!N) { memcpy(P+4,Src+J,N=STA_PAGE); }
+      if(Cache)
+      {
+        if(!PackPage[K]) PackPage[K]=(byte *)malloc(LZ4Bound(STA_PAGE));
+        if(PackPage[K]) memcpy(PackPage[K],P+4,N);
+        PackLen[K]=PackPage[K]? N:0;
+      }
+      P=Put32(P,N)+N;
+    }
+
+  return(P);
+}
+
+/** GetPages() ***********************************************/
+/** Unpack Size bytes of memory from N bytes at P into Dst, **/
+/** writing only changed bytes. Clears bits of pages never  **/
+/** used in *Used. Returns 0 if the chunk is corrupt.       **/
+/*************************************************************/
+static int GetPages(const byte *P,int N,byte *Dst,int Size,unsigned int *Used)
+{
+  byte Buf[STA_PAGE];
+  const byte *End;
+  int J,L;
+
+  End=P+N;
+  if((N<4)||(Get32(P)!=Size)) return(0);
+
+  for(J=0,P+=4;J<Size;J+=STA_PAGE,P+=L)
+  {
+    if(End-P<4) return(0);
+    L = Get32(P);
+    P+= 4;
+    if(L>End-P) return(0);
+    if(!L)
+    { if(Used) *Used&=~(1<<(J/STA_PAGE)); }
+    else if(L==STA_PAGE)
+    { if(memcmp(Dst+J,P,L)) memcpy(Dst+J,P,L); }
+    else if(LZ4Unpack(P,L,Buf,STA_PAGE)!=STA_PAGE) return(0);
+    else if(memcmp(Dst+J,Buf,STA_PAGE)) memcpy(Dst+J,Buf,STA_PAGE);
+  }
+
+  return(1);
+}
+
+/** PutFlash() ***********************************************/
+/** Copy flash contents at Buf into ROM, only pages that    **/
+/** differ, so that packed ROM pages stay packed.           **/
+/*************************************************************/
+static void PutFlash(const byte *Buf)
+{
+  byte *P;
+  int J;
+
+  for(J=0;J<ROMSize;J+=STA_PAGE)
+    if(memcmp(Buf+J,ROMPage(J/STA_PAGE),STA_PAGE)&&(P=WritePage(J/STA_PAGE)))
+      memcpy(P,Buf+J,STA_PAGE);
+}
+
+/** STASnap **************************************************/
+/** Everything a state file needs, taken in one go so that  **/
+/** packing and writing it can go on in the background.     **/
+/*************************************************************/
+typedef struct
+{
+  int  Mode;                   /* Model and mode bits        */
+  unsigned int Hash;           /* HashROM() result           */
+  Z80  CPU;                    /* CPU registers              */
+  byte Ports[sizeof(Ports)];   /* I/O ports                  */
+  TI83LCD LCD;                 /* LCD controller             */
+  byte FlashStep,StartupOn;    /* Flash and [ON] key state   */
+  byte Thumb[16*64];           /* Screen thumbnail, 1bpp     */
+  int  ThumbW;                 /* Thumbnail width, pixels    */
+  const byte *RAM,*Flash;      /* Memory, Flash=0: not saved */
+  int  RAMSize,ROMSize;        /* Memory sizes, in bytes     */
+  int  FlashSize;              /* Saved flash size, in bytes */
+  unsigned int RAMFilled;      /* RAM pages ever used        */
+  unsigned int Fresh;          /* RAM pages to pack anew     */
+  byte *Copy;                  /* Own copy of memory, or 0   */
+  unsigned int BootKey;        /* HashBoot() or 0 if no BOOT */
+  char FileName[264];          /* File to write              */
+} STASnap;
+
+/** Background saving ****************************************/
+static pthread_mutex_t SaveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  SaveDone = PTHREAD_COND_INITIALIZER;
+static int SaveBusy;         /* 1: Worker is still saving    */
+static int SaveResult = 1;   /* Last save result, 1 if OK    */
+/*************************************************************/
+
+/** TakeSnap() ***********************************************/
+/** Take a state snapshot into S. With Copy=1, RAM and saved**/
+/** flash are copied, else S points to live memory. Returns **/
+/** 0 if out of memory.                                     **/
+/*************************************************************/
+static int TakeSnap(STASnap *S,int Copy)
+{
+  const byte *P;
+  byte *D;
+  int J;
+
+  /* States rely on the flash image when not saving flash */
+  FlushROM();
+
+  S->Mode      = Mode;
+  S->Hash      = HashROM();
+  S->CPU       = CPU;
+  S->FlashStep = FlashStep;
+  S->StartupOn = StartupOn;
+  S->LCD       = LCD;
+  S->ThumbW    = TI85_FAMILY? 128:96;
+  S->RAM       = RAM;
+  S->RAMSize   = RAMSize;
+  S->ROMSize   = ROMSize;
+  S->RAMFilled = RAMFilled;
+  S->Copy      = 0;
+  S->BootKey   = 0;
+  memcpy(S->Ports,Ports,sizeof(Ports));
+
+  /* Flash is saved when no flash image file keeps it */
+  S->Flash     = TI83P_FAMILY&&!ROMShared? ROM:0;
+  S->FlashSize = S->Flash? ROMSize:0;
+
+  /* Screen thumbnail, 16 bytes per line */
+  P=TI85_FAMILY? SCREEN_BUFFER:LCD.Buffer;
+  if(SLEEP_ON) memset(S->Thumb,0,sizeof(S->Thumb));
+  else memcpy(S->Thumb,P,sizeof(S->Thumb));
+
+  /* Pages written since the last save, or never packed */
+  for(J=0,S->Fresh=0;J<S->RAMSize;J+=STA_PAGE)
+    if(!PackLen[J/STA_PAGE]||DirtySince(PackMark,J,STA_PAGE))
+      S->Fresh|=1<<(J/STA_PAGE);
+
+  /* Copy used fresh RAM pages and flash */
+  if(Copy)
+  {
+    if(!(D=S->Copy=(byte *)malloc(S->RAMSize+S->FlashSize))) return(0);
+    for(J=0;J<S->RAMSize;J+=STA_PAGE)
+      if(S->RAMFilled&S->Fresh&(1<<(J/STA_PAGE))) memcpy(D+J,RAM+J,STA_PAGE);
+    if(S->Flash) memcpy(D+S->RAMSize,ROM,S->FlashSize);
+    S->RAM   = D;
+    S->Flash = S->Flash? D+S->RAMSize:0;
+  }
+
+  PackMark=DirtyMark();
+  return(1);
+}
+
+/** PackSTA() ************************************************/
+/** Pack snapshot S into a new buffer at *Buf. Returns its  **/
+/** size, or 0 if out of memory.                            **/
+/*************************************************************/
+static int PackSTA(const STASnap *S,byte **Buf)
+{
+  const Z80 *R;
+  byte *P,*D;
+  int N;
+
+  N = 8+4+9*8+4+STA_HEAD+STA_THUMB+STA_CPU+STA_HW+STA_LCD
+    + STA_PAGES(S->RAMSize)+STA_PAGES(S->FlashSize);
+  if(!(*Buf=(byte *)malloc(N))) { memset(PackLen,0,sizeof(PackLen));return(0); }
+
+  /* Header */
+  memcpy(*Buf,STA_MAGIC,8);
+  P=Put16(Put16(*Buf+8,STA_VERSION),0);
+
+  /* Model and ROM identity */
+  P=D=PutChunk(P,"HEAD");
+  P=Put32(P,S->Mode);
+  P=Put32(P,S->Hash);
+  P=Put32(P,S->RAMSize);
+  P=Put32(P,S->ROMSize);
+  P=EndChunk(D,P);
+
+  /* Boot snapshot key, checked before anything else */
+  if(S->BootKey)
+  {
+    P=D=PutChunk(P,"BOOT");
+    P=EndChunk(D,Put32(P,S->BootKey));
+  }
+
+  /* Screen thumbnail, 1bpp, 16 bytes per line */
+  P=D=PutChunk(P,"THMB");
+  P=Put16(P,S->ThumbW);
+  P=Put16(P,64);
+  memcpy(P,S->Thumb,sizeof(S->Thumb));
+  P=EndChunk(D,P+sizeof(S->Thumb));
+
+  /* CPU registers */
+  R=&S->CPU;
+  P=D=PutChunk(P,"CPU ");
+  P=Put16(P,R->AF.W);P=Put16(P,R->BC.W);P=Put16(P,R->DE.W);P=Put16(P,R->HL.W);
+  P=Put16(P,R->IX.W);P=Put16(P,R->IY.W);P=Put16(P,R->PC.W);P=Put16(P,R->SP.W);
+  P=Put16(P,R->AF1.W);P=Put16(P,R->BC1.W);P=Put16(P,R->DE1.W);P=Put16(P,R->HL1.W);
+  *P++=R->IFF;*P++=R->I;*P++=R->R;
+  P=Put32(P,R->IPeriod);P=Put32(P,R->ICount);P=Put32(P,R->IBackup);
+  P=Put16(P,R->IRequest);
+  *P++=R->IAutoReset;*P++=R->TrapBadOps;
+  P=EndChunk(D,P);
+
+  /* I/O ports and flash chip */
+  P=D=PutChunk(P,"HW  ");
+  memcpy(P,S->Ports,sizeof(S->Ports));
+  P+=sizeof(S->Ports);
+  *P++=S->FlashStep;*P++=S->StartupOn;
+  P=EndChunk(D,P);
+
+  /* LCD controller */
+  P=D=PutChunk(P,"LCD ");
+  memcpy(P,S->LCD.Buffer,sizeof(S->LCD.Buffer));
+  P+=sizeof(S->LCD.Buffer);
+  *P++=S->LCD.Status;*P++=S->LCD.Col;*P++=S->LCD.Row;
+  *P++=S->LCD.Delay;*P++=S->LCD.Scroll;*P++=S->LCD.Contrast;
+  P=EndChunk(D,P);
+
+  /* RAM and flash */
+  P=D=PutChunk(P,"RAM ");
+  P=EndChunk(D,PutPages(P,S->RAM,S->RAMSize,S->RAMFilled,S->Fresh,1));
+  if(S->Flash)
+  {
+    P=D=PutChunk(P,"FLSH");
+    P=EndChunk(D,PutPages(P,S->Flash,S->FlashSize,~0,~0,0));
+  }
+  P=EndChunk(PutChunk(P,"END "),P+8);
+
+  return(P-*Buf);
+}
+
+/** WriteSTA() ***********************************************/
+/** Write N bytes at Buf into a temporary file and rename it**/
+/** to FileName, so that FileName is never left half-done.  **/
+/** Returns 0 on failure.                                   **/
+/*************************************************************/
+static int WriteSTA(const char *FileName,const byte *Buf,int N)
+{
+  char Tmp[sizeof(((STASnap *)0)->FileName)+4];
+  int F,J,K;
+
+  if(strlen(FileName)>=sizeof(Tmp)-4) return(0);
+  sprintf(Tmp,"%s.tmp",FileName);
+  if((F=open(Tmp,O_WRONLY|O_CREAT|O_TRUNC,0644))<0) return(0);
+
+  for(J=0;(J<N)&&((K=write(F,Buf+J,N-J))>0);J+=K);
+  J=(J==N)&&!fsync(F);
+  J=!close(F)&&J&&!rename(Tmp,FileName);
+
+  if(!J) unlink(Tmp);
+  return(J);
+}
+
+/** SaveSTA() ************************************************/
+/** Save emulation state to a .STA file.                    **/
+/*************************************************************/
+int SaveSTA(const char *FileName)
+{
+  STASnap S;
+  byte *Buf;
+  int J,N;
+
+  if(Verbose) LOGD("Saving state: %s",FileName);
+
+  /* Packed pages are shared with background saving */
+  PollSTA(1);
+  TakeSnap(&S,0);
+  if(!(N=PackSTA(&S,&Buf))) return(0);
+  J=WriteSTA(FileName,Buf,N);
+  free(Buf);
+
+  if(Verbose) LOGD("Saved %dkB state",N>>10);
+  return(J);
+}
+
+/** SaveWorker() *********************************************/
+/** Background thread packing and writing a snapshot.       **/
+/*************************************************************/
+static void *SaveWorker(void *Arg)
+{
+  STASnap *S = (STASnap *)Arg;
+  byte *Buf;
+  int J,N;
+
+  J=(N=PackSTA(S,&Buf))&&WriteSTA(S->FileName,Buf,N);
+  if(N) free(Buf);
+  if(Verbose) LOGD("Saving %s...%s (%dkB)",S->FileName,J? "OK":"FAILED",N>>10);
+  free(S->Copy);
+  free(S);
+
+  pthread_mutex_lock(&SaveLock);
+  SaveResult = J;
+  SaveBusy   = 0;
+  pthread_cond_broadcast(&SaveDone);
+  pthread_mutex_unlock(&SaveLock);
+  return(0);
+}
+
+/** SnapState() **********************************************/
+/** Take a state snapshot and save it in the background,    **/
+/** with a BOOT chunk holding Key if Key is not 0.          **/
+/*************************************************************/
+static int SnapState(const char *FileName,unsigned int Key)
+{
+  pthread_attr_t Attr;
+  pthread_t Thread;
+  STASnap *S;
+  int J;
+
+  /* One save at a time */
+  PollSTA(1);
+
+  if(strlen(FileName)>=sizeof(S->FileName)) return(0);
+  if(!(S=(STASnap *)malloc(sizeof(STASnap)))) return(0);
+  if(!TakeSnap(S,1)) { free(S);return(0); }
+  strcpy(S->FileName,FileName);
+  S->BootKey=Key;
+
+  pthread_mutex_lock(&SaveLock);
+  SaveBusy=1;
+  pthread_mutex_unlock(&SaveLock);
+
+  /* Save right here if there is no thread */
+  pthread_attr_init(&Attr);
+  pthread_attr_setdetachstate(&Attr,PTHREAD_CREATE_DETACHED);
+  J=pthread_create(&Thread,&Attr,SaveWorker,S);
+  pthread_attr_destroy(&Attr);
+  if(J) SaveWorker(S);
+
+  return(1);
+}
+
+/** SnapSTA() ************************************************/
+/** Take a state snapshot and save it to a .STA file in the **/
+/** background. Returns 0 if the snapshot failed. Check     **/
+/** completion with PollSTA().                              **/
+/*************************************************************/
+int SnapSTA(const char *FileName) { return(SnapState(FileName,0)); }
+
+/** PollSTA() ************************************************/
+/** Return -1 while SnapSTA() is still saving, else 1 if    **/
+/** the last save succeeded, 0 if it failed. With Wait=1,   **/
+/** wait for saving to finish.                              **/
+/*************************************************************/
+int PollSTA(int Wait)
+{
+  int J;
+
+  pthread_mutex_lock(&SaveLock);
+  while(Wait&&SaveBusy) pthread_cond_wait(&SaveDone,&SaveLock);
+  J=SaveBusy? -1:SaveResult;
+  pthread_mutex_unlock(&SaveLock);
+  return(J);
+}
+
+/** LoadOldSTA() *********************************************/
+/** Load emulation state from an old, raw .STA file, made   **/
+/** by a build with the same struct layouts.                **/
+/*************************************************************/
+static int LoadOldSTA(FILE *F)
+{
+  TI83LCD NewLCD;
+  byte NewPorts[sizeof(Ports)],*NewRAM;
+  void *User;
+  Z80 NewCPU;
+  int J,M;
+
+  /* Read mode, find its configuration */
+  rewind(F);
+  if(fread(&J,1,sizeof(J),F)!=sizeof(J)) return(0);
+  for(M=0;Config[M].ROMSize&&((J&ATI_MODEL)!=Config[M].Model);++M);
+  if(!Config[M].ROMSize) return(0);
+
+  /* Read everything aside before touching anything */
+  if(!(NewRAM=(byte *)malloc(Config[M].RAMSize))) return(0);
+  if((fread(&NewCPU,1,sizeof(NewCPU),F)!=sizeof(NewCPU))
+   ||(fread(NewPorts,1,sizeof(NewPorts),F)!=sizeof(NewPorts))
+   ||(fread(&NewLCD,1,sizeof(NewLCD),F)!=sizeof(NewLCD))
+   ||(fread(NewRAM,1,Config[M].RAMSize,F)!=Config[M].RAMSize)
+   ||((J!=Mode)&&(J!=ResetTI85(J))))
+  { free(NewRAM);return(0); }
+
+  User=CPU.User;
+  CPU=NewCPU;
+  CPU.User=User;
+  memcpy(Ports,NewPorts,sizeof(Ports));
+  LCD=NewLCD;
+  memcpy(RAM,NewRAM,RAMSize);
+  RAMFilled=~0;
+  free(NewRAM);
+
+  StateLoaded();
+  return(1);
+}
+
+/** GetChunk() ***********************************************/
+/** Read next chunk from F into a new buffer at *Data, put  **/
+/** its tag into Tag[4]. Returns chunk size or -1 on error. **/
+/*************************************************************/
+static int GetChunk(FILE *F,char *Tag,byte **Data)
+{
+  byte H[8];
+  int N;
+
+  *Data=0;
+  if(fread(H,1,8,F)!=8) return(-1);
+  memcpy(Tag,H,4);
+  N=Get32(H+4);
+  if((N<0)||(N>STA_PAGES(0x400000))) return(-1);
+  if(!(*Data=(byte *)malloc(N+1))) return(-1);
+  if(fread(*Data,1,N,F)!=N) { free(*Data);*Data=0;return(-1); }
+  return(N);
+}
+
+/** LoadState() **********************************************/
+/** Load emulation state from a .STA file. If Key is not 0, **/
+/** the file must have a BOOT chunk with the same key.      **/
+/*************************************************************/
+static int LoadState(const char *FileName,unsigned int Key)
+{
+  char Tag[4];
+  byte H[12],*P,*Regs,*HW,*Scr,*NewRAM,*NewFlash,*OldROM;
+  unsigned int Hash,Used;
+  int J,M,N,Got,NewMode,NRAM,NROM;
+  FILE *F;
+
+  if(Verbose) LOGD("Loading state: %s",FileName);
+
+  /* Let background saving finish first */
+  PollSTA(1);
+
+  /* Open state file */
+  F=fopen(FileName,"rb");
+  if(!F) return(0);
+
+  /* Fall back to old raw state files */
+  if((fread(H,1,12,F)!=12)||memcmp(H,STA_MAGIC,8))
+  { J=!Key&&LoadOldSTA(F);fclose(F);return(J); }
+  if(Get16(H+8)>STA_VERSION)
+  {
+    if(Verbose) LOGE("%s: state version %d is too new",FileName,Get16(H+8));
+    fclose(F);
+    return(0);
+  }
+
+  /* HEAD must come first, its model must have our sizes */
+  if((GetChunk(F,Tag,&P)<STA_HEAD)||memcmp(Tag,"HEAD",4))
+  { free(P);fclose(F);return(0); }
+  NewMode=Get32(P);
+  Hash=Get32(P+4);
+  for(M=0;Config[M].ROMSize&&((NewMode&ATI_MODEL)!=Config[M].Model);++M);
+  NRAM=Config[M].RAMSize;
+  NROM=Config[M].ROMSize;
+  J=!NROM||(Get32(P+8)!=NRAM)||(Get32(P+12)!=NROM);
+  free(P);
+  if(J) { fclose(F);return(0); }
+
+  /* Get OS and boot pages of the ROM this model would use */
+  if(!(OldROM=(byte *)malloc(2*STA_PAGE))||!PeekROM(M,OldROM))
+  {
+    if(Verbose) LOGE("%s: no ROM for this state",FileName);
+    free(OldROM);
+    fclose(F);
+    return(0);
+  }
+
+  /* Without flash contents, the state must match that ROM */
+  if((Config[M].Model<ATI_TI83P)&&(Hash!=HashPages(OldROM,OldROM+STA_PAGE)))
+  {
+    if(Verbose) LOGE("%s: state was made with a different ROM",FileName);
+    free(OldROM);
+    fclose(F);
+    return(0);
+  }
+
+  /* Boot snapshots must match the ROM exactly */
+  if(Key)
+  {
+    J=(GetChunk(F,Tag,&P)<4)||memcmp(Tag,"BOOT",4)||(Get32(P)!=Key);
+    free(P);
+    if(J) { free(OldROM);fclose(F);return(0); }
+  }
+
+  /* Go through chunks until "END ", keeping registers and */
+  /* unpacking memory aside, so that a bad state file does  */
+  /* not touch the running emulation                        */
+  Regs=HW=Scr=NewFlash=0;
+  NewRAM=(byte *)calloc(1,NRAM);
+  Used=~0;
+  for(Got=0;NewRAM&&((N=GetChunk(F,Tag,&P))>=0);free(P))
+  {
+    if(!memcmp(Tag,"END ",4)) { Got|=16;break; }
+    else if(!memcmp(Tag,"CPU ",4)&&(N>=STA_CPU)) { free(Regs);Regs=P;P=0;Got|=1; }
+    else if(!memcmp(Tag,"HW  ",4)&&(N>=STA_HW))  { free(HW);HW=P;P=0;Got|=2; }
+    else if(!memcmp(Tag,"LCD ",4)&&(N>=STA_LCD)) { free(Scr);Scr=P;P=0; }
+    else if(!memcmp(Tag,"RAM ",4))
+    {
+      if(!GetPages(P,N,NewRAM,NRAM,&Used)) break;
+      Got|=4;
+    }
+    else if(!memcmp(Tag,"FLSH",4)&&(Config[M].Model>=ATI_TI83P))
+    {
+      if(!NewFlash&&!(NewFlash=(byte *)calloc(1,NROM))) break;
+      if(!GetPages(P,N,NewFlash,NROM,0)) break;
+      Got|=8;
+    }
+  }
+  free(P);
+  fclose(F);
+
+  /* Must be complete and made with the same ROM. Saved     */
+  /* flash must match its hash and keep the ROM boot page,  */
+  /* which flash writes never change.                       */
+  if((Got&0x17)!=0x17)
+  {
+    if(Verbose) LOGE("%s: state is incomplete or corrupt",FileName);
+    J=0;
+  }
+  else if(NewFlash?
+     (Hash!=HashPages(NewFlash,NewFlash+NROM-STA_PAGE))
+   ||memcmp(NewFlash+NROM-FLASH_BOOT,OldROM+2*STA_PAGE-FLASH_BOOT,FLASH_BOOT)
+   : (Hash!=HashPages(OldROM,OldROM+STA_PAGE)))
+  {
+    if(Verbose) LOGE("%s: state was made with a different ROM",FileName);
+    J=0;
+  }
+  /* All checked, switch model if needed */
+  else if((NewMode!=Mode)&&(ResetTI85(NewMode)!=NewMode))
+  {
+    if(Verbose) LOGE("%s: could not switch model",FileName);
+    J=0;
+  }
+  else
+  {
+    /* Replace the running state */
+    P=Regs;
+    CPU.AF.W=Get16(P);CPU.BC.W=Get16(P+2);CPU.DE.W=Get16(P+4);CPU.HL.W=Get16(P+6);
+    CPU.IX.W=Get16(P+8);CPU.IY.W=Get16(P+10);CPU.PC.W=Get16(P+12);CPU.SP.W=Get16(P+14);
+    CPU.AF1.W=Get16(P+16);CPU.BC1.W=Get16(P+18);CPU.DE1.W=Get16(P+20);CPU.HL1.W=Get16(P+22);
+    CPU.IFF=P[24];CPU.I=P[25];CPU.R=P[26];
+    CPU.IPeriod=Get32(P+27);CPU.ICount=Get32(P+31);CPU.IBackup=Get32(P+35);
+    CPU.IRequest=Get16(P+39);
+    CPU.IAutoReset=P[41];CPU.TrapBadOps=P[42];
+
+    memcpy(Ports,HW,sizeof(Ports));
+    FlashStep=HW[sizeof(Ports)];
+    StartupOn=HW[sizeof(Ports)+1];
+
+    if((P=Scr))
+    {
+      memcpy(LCD.Buffer,P,sizeof(LCD.Buffer));
+      J=sizeof(LCD.Buffer);
+      LCD.Status=P[J];LCD.Col=P[J+1];LCD.Row=P[J+2];
+      LCD.Delay=P[J+3];LCD.Scroll=P[J+4];LCD.Contrast=P[J+5];
+    }
+
+    /* Unused pages get NORAM when mapped */
+    for(J=0;J<RAMSize;J+=STA_PAGE)
+      if((Used&(1<<(J/STA_PAGE)))&&memcmp(RAM+J,NewRAM+J,STA_PAGE))
+        memcpy(RAM+J,NewRAM+J,STA_PAGE);
+    RAMFilled=Used;
+
+    if(NewFlash) { DropFlashBase(ROM);PutFlash(NewFlash); }
+    J=1;
+  }
+
+  free(Regs);
+  free(HW);
+  free(Scr);
+  free(NewRAM);
+  free(NewFlash);
+  free(OldROM);
+
+  if(J) StateLoaded();
+  return(J);
+}
+
+/** LoadSTA() ************************************************/
+/** Load emulation state from a .STA file.                  **/
+/*************************************************************/
+int LoadSTA(const char *FileName) { return(LoadState(FileName,0)); }
+
+/** HashBoot() ***********************************************/
+/** Hash the whole ROM or flash contents and the model, to  **/
+/** tell if a boot snapshot still applies.                  **/
+/*************************************************************/
+static unsigned int HashBoot(void)
+{
+  const unsigned int *P;
+  unsigned int H;
+  int J,K;
+
+  H=2166136261U^(Mode&ATI_MODEL);
+  for(K=0;K<(ROMSize>>14);++K)
+    for(P=(const unsigned int *)ROMPage(K),J=0;J<0x4000/4;++J) H=(H^P[J])*16777619U;
+  return(H? H:1);
+}
+
+/** LoadBoot() ***********************************************/
+/** Restore the boot snapshot made with the current ROM.    **/
+/** Returns 0 if there is none.                             **/
+/*************************************************************/
+int LoadBoot(void)
+{
+  if(!RAMName(BootPath,".BOOT")) return(0);
+  BootKey=HashBoot();
+  return(LoadState(BootPath,BootKey));
+}
+
+/** WatchBoot() **********************************************/
+/** Called on each tick after a cold boot. Saves the boot   **/
+/** snapshot once the OS mostly sits in HALT, waiting for   **/
+/** keys with interrupts on. Gives up once a key is down,   **/
+/** as the user's input must not end up in the snapshot.    **/
+/*************************************************************/
+void WatchBoot(Z80 *R)
+{
+  int J;
+
+  /* Keypad() keeps each key event for a few ticks, so any */
+  /* key the user presses is seen here                     */
+  for(J=0;(J<sizeof(KbdStatus))&&(KbdStatus[J]==0xFF);++J);
+  if(J<sizeof(KbdStatus))
+  {
+    if(Verbose) LOGD("Key pressed, no boot snapshot this time");
+    BootIdle=-1;
+  }
+  else if(StartupOn||SLEEP_ON||(R->IFF&(IFF_HALT|IFF_1))!=(IFF_HALT|IFF_1))
+  { if(BootIdle) --BootIdle; }
+  else if(++BootIdle>=BOOT_IDLE)
+  {
+    BootIdle=-1;
+    if(Verbose) LOGD("Saving boot snapshot %s",BootPath);
+    SnapState(BootPath,BootKey);
+  }
+}
+
+/** ResetRAM() ***********************************************/
+/** Clear calculator RAM and restart, restoring the boot    **/
+/** snapshot if there is one. Returns 1 if it was restored, **/
+/** 0 if the OS boots from scratch.                         **/
+/*************************************************************/
+int ResetRAM(void)
+{
+  if(LoadBoot()) return(1);
+
+  /* Pages get filled with NORAM as they are mapped */
+  RAMFilled=0;
+  ResetTI85(Mode);
+  if(*BootPath) BootIdle=0;
+  return(0);
+}
+
+
+/** InfoSTA() ************************************************/
+/** Read model and screen thumbnail (16 bytes per line, 64  **/
+/** lines) from a .STA file without loading it. Returns the **/
+/** thumbnail width or 0 on failure.                        **/
+/*************************************************************/
+int InfoSTA(const char *FileName,int *Model,byte *Thumb)
+{
+  char Tag[4];
+  byte H[12],*P;
+  int J,N;
+  FILE *F;
+
+  if(!(F=fopen(FileName,"rb"))) return(0);
+  if((fread(H,1,12,F)!=12)||memcmp(H,STA_MAGIC,8)) { fclose(F);return(0); }
+
+  for(J=0;(N=GetChunk(F,Tag,&P))>=0;free(P))
+    if(!memcmp(Tag,"HEAD",4)&&(N>=STA_HEAD)) *Model=Get32(P);
+    else if(!memcmp(Tag,"THMB",4)&&(N>=STA_THUMB))
+    { J=Get16(P);memcpy(Thumb,P+4,16*64);break; }
+    else if(memcmp(Tag,"THMB",4)&&memcmp(Tag,"HEAD",4)) break;
+
+  free(P);
+  fclose(F);
+  return(J);
+}
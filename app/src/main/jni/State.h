@@ -0,0 +1,53 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          State.h                        **/
+/**                                                         **/
+/** This file contains declarations for state file helpers  **/
+/** and the boot snapshot, shared with TI85.c and Slots.c.  **/
+/** State file calls themselves are declared in TI85.h.     **/
+/**                                                         **/
+/*************************************************************/
+#ifndef STATE_H
+#define STATE_H
+
+#include "Z80/Z80.h"           /* byte, word, Z80            */
+
+#define STA_PAGE 0x4000        /* Memory is saved by pages   */
+
+/** Boot snapshot ********************************************/
+extern int  BootIdle;          /* Idle ticks so far, -1: off */
+extern char BootPath[264];     /* Boot snapshot file name    */
+/*************************************************************/
+
+/** HashPages() **********************************************/
+/** FNV-1a hash of the first (OS) and last (boot) 16kB ROM  **/
+/** pages, given at OS and Boot.                            **/
+/*************************************************************/
+unsigned int HashPages(const byte *OS,const byte *Boot);
+
+/** HashROM() ************************************************/
+/** Identify the ROM by HashPages() of its first and last   **/
+/** pages.                                                  **/
+/*************************************************************/
+unsigned int HashROM(void);
+
+/** PeekROM() ************************************************/
+/** Read the first and last 16kB pages of the ROM image     **/
+/** that ResetTI85() maps for Config[M] into Buf[8000h],    **/
+/** without mapping it. Returns 0 on failure.               **/
+/*************************************************************/
+int PeekROM(int M,byte *Buf);
+
+/** LoadBoot() ***********************************************/
+/** Restore the boot snapshot made with the current ROM.    **/
+/** Returns 0 if there is none.                             **/
+/*************************************************************/
+int LoadBoot(void);
+
+/** WatchBoot() **********************************************/
+/** Called on each tick while BootIdle>=0, after a cold     **/
+/** boot. Saves the boot snapshot once the OS idles.        **/
+/*************************************************************/
+void WatchBoot(Z80 *R);
+
+#endif /* STATE_H */
@@ -13,12 +13,21 @@
 /*************************************************************/
 
 #include "TI85.h"
+#include "Bench.h"
+#include "Link.h"
+#include "Pack.h"
+#include "State.h"
+#include "Slots.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <android/log.h>
 #define LOG_TAG "TI85"
@@ -26,31 +35,26 @@
 #define  LOGI(...)  __android_log_print(ANDROID_LOG_INFO,LOG_TAG,__VA_ARGS__)
 #define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
 
-#ifdef ZLIB
-#include <zlib.h>
-#define fopen           gzopen
-#define fclose          gzclose
-#define fread(B,L,N,F)  gzread(F,B,(L)*(N))
-#define fwrite(B,L,N,F) gzwrite(F,B,(L)*(N))
-#define fseek           gzseek
-#define rewind          gzrewind
-#define fgetc           gzgetc
-#define ftell           gztell
-#endif
-
 /** User-defined parameters for ATI85 ************************/
 int  Mode      = 0;          /* Various operating mode bits  */
 byte Verbose   = 3;          /* Debug messages ON/OFF switch */
 byte UPeriod   = 100;        /* % of actual screen updates   */
+byte SPeriod   = 0;          /* Interrupts per screen sample */
+byte LowMemory = 0;          /* 1: Keep ROM packed in memory */
 /*************************************************************/
 
 /** Main hardware: CPU, RAM, VRAM, mappers *******************/
 Z80  CPU;                    /* Z80 CPU registers and state  */
+int  CPUClock = CPU_CLOCK;   /* Current CPU clock (Hz)       */
 byte *Page[4];               /* 4x16kB read-only addr space  */
-byte *RAM,*ROM;              /* Preallocated RAM/ROM buffers */
+byte *RAM,*ROM;              /* Mapped RAM and ROM images    */
 int  RAMSize,ROMSize;        /* RAM/ROM sizes, in bytes      */
 byte Ports[32];              /* I/O ports                    */
 TI83LCD LCD;                 /* TI82/83/84 LCD controller    */
+unsigned int LCDGen;         /* Bumped on LCD image change   */
+unsigned int RAMDirty[DIRTY_BLOCKS]; /* DirtyGen at last write */
+unsigned int DirtyGen = 1;   /* Current RAM write mark       */
+byte *VRAM;                  /* TI85/86 screen buffer or 0   */
 byte ScreenOn;               /* 1: Show screen buffer        */
 byte ExitNow;                /* 1: Exit the emulator         */
 byte KbdStatus[8];           /* Keypad matrix status         */
@@ -59,6 +63,35 @@ char RAMPath[256];           /* RAM file name buffer         */
 char ROMPath[256];           /* ROM file name buffer         */
 /*************************************************************/
 
+/** TI83+ family flash chip **********************************/
+byte FlashStep;              /* Command cycles matched so far*/
+char FlashPath[264];         /* Writable flash image file    */
+/*************************************************************/
+
+/** Event scheduler ******************************************/
+/** LoopZ80() runs at the nearest pending event. EvLeft[]   **/
+/** counts CPU cycles from the start of current IPeriod.    **/
+#define EV_TICK    0         /* 200Hz keypad/screen refresh  */
+#define EV_TIMER   1         /* Hardware timer interrupt     */
+#define EV_XTAL    2         /* TI83+SE/TI84+ crystal timers */
+#define EV_LINK    5         /* Link cable sync with peer    */
+#define EV_COUNT   6
+#define EV_NEVER   0x7FFFFFFF
+static int EvLeft[EV_COUNT]; /* Cycles left until each event */
+static int EvPeriod;         /* Cycles in current IPeriod    */
+static unsigned int EvTime;  /* LINK_HZ time at IPeriod start*/
+static byte ONKeyOn;         /* 1: [ON] key is held down     */
+/*************************************************************/
+
+/** Mapped ROM image and RAM ********************************/
+int  ROMMapSize;             /* Bytes mapped at ROM, or 0    */
+byte ROMShared;              /* 1: ROM is MAP_SHARED flash   */
+static byte ROMCached;       /* 1: ROM belongs to ROMMaps[]  */
+byte *PageAt[4];             /* ROM/RAM address in Page[]    */
+static int  RAMMapSize;      /* Bytes mapped at RAM, or 0    */
+unsigned int RAMFilled;      /* 16kB RAM pages with NORAM    */
+/*************************************************************/
+
 /** Working directory names, etc. ****************************/
 const char *LinkPeer = 0;          /* Link peer IP address   */
 int LinkPort         = 8385;       /* Link peer IP port      */
@@ -136,8 +169,6 @@ const byte Keys[256][2] =
   { 0,0x00 },{ 0,0x00 },{ 0,0x00 },{ 0,0x00 }
 };
 
-byte SIOExchange(byte Vout);
-
 void TI83LCDReset(void);
 byte TI83LCDDataRD(void);
 void TI83LCDDataWR(register byte V);
@@ -155,6 +186,37 @@ byte *TI84PPage(register byte PortValue);
 void TI85Colors(register byte V);
 void TI83Colors(register byte V);
 
+void UpdateVRAM(void);
+void FlashWrite(int A,byte V);
+
+static void SetupPorts(int Model);
+static void SetupPages(int Model);
+static void SetClock(void);
+static void ResetEvents(void);
+static void Schedule(int E,int Cycles);
+static int  TimerPeriod(void);
+
+static int  MapROM(int M);
+static void UnmapROM(void);
+static void UnmapRAM(void);
+
+/** ResidentKB() *********************************************/
+/** Return resident memory of this process, in kB.          **/
+/*************************************************************/
+int ResidentKB(void)
+{
+  char Buf[64];
+  long Size,RSS;
+  int F,N;
+
+  if((F=open("/proc/self/statm",O_RDONLY))<0) return(0);
+  N=read(F,Buf,sizeof(Buf)-1);
+  close(F);
+  Buf[N>0? N:0]='\0';
+  if(sscanf(Buf,"%ld %ld",&Size,&RSS)!=2) return(0);
+  return((int)(RSS*(sysconf(_SC_PAGESIZE)>>10)));
+}
+
 /** StartTI85() **********************************************/
 /** Allocate memory, load ROM image, initialize hardware,   **/
 /** CPU and start the emulation. This function returns 0 in **/
@@ -162,8 +224,11 @@ void TI83Colors(register byte V);
 /*************************************************************/
 int StartTI85()
 {
+  struct timespec T0,T1;
   word A;
-  int J,I,K;
+  int J;
+
+  clock_gettime(CLOCK_MONOTONIC,&T0);
 
   Page[0]=Page[1]=Page[2]=Page[3]=0;
   RAMSize=ROMSize=0;
@@ -177,22 +242,7 @@ int StartTI85()
   /* UPeriod has ot be in 1%..100% range */
   UPeriod=UPeriod<1? 1:UPeriod>100? 100:UPeriod;
 
-  /* Find largest RAM/ROM sizes to allocate */
-  for(I=J=K=0;Config[J].ROMSize;++J)
-  {
-    if(Config[J].RAMSize>I) I=Config[J].RAMSize;
-    if(Config[J].ROMSize>K) K=Config[J].ROMSize;
-  }
-
-  /* Allocate memory for RAM/ROM */
-  if(Verbose) LOGD("Allocating %dkB+%dkB for RAM+ROM...",I>>10,K>>10);
-  RAM = (byte *)malloc(I+K);
-  if(Verbose) LOGD(RAM? "OK":"FAILED");
-  if(!RAM) return(0);
-  memset(RAM, NORAM, I+K);
-  ROM=RAM+I;
-
-  /* Reset hardware, force loading system ROM */
+  /* Reset hardware, force mapping system ROM and RAM */
   J    = Mode;
   Mode|= ATI_MODEL;
   Mode = ResetTI85(J);
@@ -207,6 +257,25 @@ int StartTI85()
       LOGD("Loading %s...%s\n",RAMPath,J? "OK":"FAILED");
   }
 
+  /* Cold start from boot snapshot, or make one */
+  if(!J)
+  {
+    J=LoadBoot();
+    if(Verbose&&*BootPath)
+      LOGD("Loading %s...%s\n",BootPath,J? "OK":"FAILED");
+    if(!J&&*BootPath) BootIdle=0;
+  }
+
+  /* Report startup cost */
+  if(Verbose)
+  {
+    clock_gettime(CLOCK_MONOTONIC,&T1);
+    LOGD("Started in %ldms, resident %dkB\n",
+      (long)(T1.tv_sec-T0.tv_sec)*1000+(T1.tv_nsec-T0.tv_nsec)/1000000,
+      ResidentKB()
+    );
+  }
+
   if(Verbose) LOGD("RUNNING ROM CODE...\n");
   A=RunZ80(&CPU);
 
@@ -221,15 +290,391 @@ void TrashTI85()
 {
   int J;
 
-  /* Save state */
+  /* Save state right here, the process may end after this */
   if(RAMPath&&RAM)
   {
     J=SaveSTA(RAMPath);
     if(Verbose) LOGD("Saving %s...%s\n",RAMPath,J? "OK":"FAILED");
   }
 
-  /* Free memory */
-  if(RAM) { free(RAM);RAM=ROM=0; }
+  /* Drop link cable */
+  LinkClose();
+
+  /* Background slot saves must finish before memory goes, */
+  /* SaveWorker() reports how they went                     */
+  PollSTA(1);
+
+  /* Free memory, write back flash */
+  FreeSlots();
+  UnmapRAM();
+  UnmapROM();
+}
+
+/** RAMName() ************************************************/
+/** Make a file name from RAMPath, replacing its extension  **/
+/** with Ext (.FLASH, .BOOT). Returns 0 if there is no      **/
+/** RAMPath.                                                **/
+/*************************************************************/
+int RAMName(char *Name,const char *Ext)
+{
+  char *P;
+
+  if(!*RAMPath) { *Name='\0';return(0); }
+  strcpy(Name,RAMPath);
+  P=strrchr(Name,'.');
+  if(P&&!strchr(P,'/')) *P='\0';
+  strcat(Name,Ext);
+  return(1);
+}
+
+/** BlankEEPROM() ********************************************/
+/** Clear TI83+ EEPROM program storage in a ROM image.      **/
+/*************************************************************/
+static void BlankEEPROM(byte *P,int M)
+{
+  if(Config[M].Model==ATI_TI83P)
+  {
+    P[0x78000]=0;
+    memset(P+0x78001,0xFF,0x7C000-0x78001);
+  }
+}
+
+/** MakeFlash() **********************************************/
+/** Create flash image file Name from the ROM image for     **/
+/** Config[M]. Returns open file descriptor or -1.          **/
+/*************************************************************/
+static int MakeFlash(const char *Name,int M)
+{
+  char Tmp[sizeof(FlashPath)+4];
+  int F,R,J,N,Size;
+  byte *P;
+
+  Size=Config[M].ROMSize;
+  sprintf(Tmp,"%s.tmp",Name);
+
+  if((R=open(ROMPath,O_RDONLY))<0) return(-1);
+  if((F=open(Tmp,O_RDWR|O_CREAT|O_TRUNC,0644))<0) { close(R);return(-1); }
+
+  /* Copy ROM image straight into the mapped new file */
+  P = ftruncate(F,Size)? MAP_FAILED
+    : (byte *)mmap(0,Size,PROT_READ|PROT_WRITE,MAP_SHARED,F,0);
+  for(J=0;(P!=MAP_FAILED)&&(J<Size);J+=N)
+    if((N=read(R,P+J,Size-J))<=0) break;
+  close(R);
+
+  if(P!=MAP_FAILED)
+  {
+    if(J==Size) BlankEEPROM(P,M);
+    munmap(P,Size);
+  }
+
+  if((J==Size)&&!rename(Tmp,Name)) return(F);
+
+  close(F);
+  unlink(Tmp);
+  return(-1);
+}
+
+
+/** ROMMapping ***********************************************/
+/** ROM images mapped earlier in this process, kept mapped  **/
+/** so that model switches and state loads can get them     **/
+/** back without touching storage.                          **/
+/*************************************************************/
+#define ROM_MAPS 4             /* Mappings kept at most      */
+
+typedef struct
+{
+  byte *P;                     /* Mapped image, 0 if unused  */
+  int Size,M;                  /* Image size, Config[] index */
+  byte Shared;                 /* 1: MAP_SHARED flash image  */
+  unsigned int Hash;           /* IdentROM() contents hash   */
+  unsigned int Used;           /* Last use, for replacement  */
+  ino_t Inode;                 /* Flash image file inode     */
+  char Flash[sizeof(FlashPath)]; /* Flash image file name    */
+} ROMMapping;
+
+static ROMMapping ROMMaps[ROM_MAPS];
+static unsigned int ROMMapUse;
+
+/** FindROM() ************************************************/
+/** Find a kept mapping of the ROM image with given hash,   **/
+/** for Config[M]. Flash images also have to be the same    **/
+/** file. Returns 0 if none.                                **/
+/*************************************************************/
+static ROMMapping *FindROM(unsigned int Hash,int M,const char *Flash)
+{
+  struct stat St;
+  int J;
+
+  for(J=0;J<ROM_MAPS;++J)
+    if(ROMMaps[J].P&&(ROMMaps[J].Hash==Hash)&&(ROMMaps[J].M==M)&&!strcmp(ROMMaps[J].Flash,Flash))
+    {
+      if(*Flash&&(stat(Flash,&St)||(St.st_ino!=ROMMaps[J].Inode))) return(0);
+      ROMMaps[J].Used=++ROMMapUse;
+      return(ROMMaps+J);
+    }
+
+  return(0);
+}
+
+/** KeepROM() ************************************************/
+/** Keep the current ROM mapping for later, replacing the   **/
+/** least recently used one if all are taken.              **/
+/*************************************************************/
+static void KeepROM(unsigned int Hash,int M,const char *Flash)
+{
+  struct stat St;
+  ROMMapping *C;
+  int J;
+
+  if(*Flash&&stat(Flash,&St)) return;
+
+  for(C=ROMMaps,J=1;C->P&&(J<ROM_MAPS);++J)
+    if(!ROMMaps[J].P||(ROMMaps[J].Used<C->Used)) C=ROMMaps+J;
+
+  if(C->P)
+  {
+    if(C->Shared) msync(C->P,C->Size,MS_SYNC);
+    DropFlashBase(C->P);
+    munmap(C->P,C->Size);
+  }
+
+  C->P      = ROM;
+  C->Size   = ROMMapSize;
+  C->M      = M;
+  C->Shared = ROMShared;
+  C->Hash   = Hash;
+  C->Used   = ++ROMMapUse;
+  C->Inode  = *Flash? St.st_ino:0;
+  strcpy(C->Flash,Flash);
+  ROMCached = 1;
+}
+
+/** KeptROM() ************************************************/
+/** Return 1 if ROM image mapped at P for Config[M] is kept **/
+/** in ROMMaps[], 0 if it is gone.                          **/
+/*************************************************************/
+int KeptROM(const byte *P,int M)
+{
+  int J;
+
+  for(J=0;(J<ROM_MAPS)&&((ROMMaps[J].P!=P)||(ROMMaps[J].M!=M));++J);
+  return(J<ROM_MAPS);
+}
+
+/** MapROM() *************************************************/
+/** Map ROM image for Config[M] at ROM. TI83+ family flash  **/
+/** is mapped shared from a writable flash image file, made **/
+/** on first use, so flash changes persist. Other ROMs are  **/
+/** mapped private and read-only. Mappings are kept and    **/
+/** reused by ROM contents hash. Returns 0 on failure.      **/
+/*************************************************************/
+static int MapROM(int M)
+{
+  struct stat St;
+  ROMMapping *C;
+  unsigned int Hash;
+  int F,Size,Flash,Shared;
+  byte *P;
+
+  Size   = Config[M].ROMSize;
+  Flash  = Config[M].Model>=ATI_TI83P;
+  Shared = 0;
+  F      = -1;
+
+  /* Flash image goes with the RAM file */
+  if(!Flash||!RAMName(FlashPath,".FLASH")) *FlashPath='\0';
+
+  /* Reuse a mapping of the same ROM, IdentROM() only does */
+  /* a stat() for files it has seen before                 */
+  if(IdentROM(ROMPath,&Hash,0)<0) Hash=0;
+  if(Hash&&(C=FindROM(Hash,M,FlashPath)))
+  {
+    if(Verbose) LOGD("Reusing mapped %s",*FlashPath? FlashPath:ROMPath);
+    UnmapROM();
+    ROM        = C->P;
+    ROMMapSize = C->Size;
+    ROMShared  = C->Shared;
+    ROMCached  = 1;
+
+    /* Kept mappings are unpacked, low memory mode packs   */
+    /* them and lets go of the whole image                 */
+    if(LowMemory&&PackROM(C->P,C->Size))
+    {
+      if(C->Shared) msync(C->P,C->Size,MS_SYNC);
+      DropFlashBase(C->P);
+      munmap(C->P,C->Size);
+      C->P      = 0;
+      ROMCached = 0;
+    }
+    return(1);
+  }
+
+  /* Open flash image, recreate it if it does not fit */
+  if(*FlashPath)
+  {
+    F=open(FlashPath,O_RDWR);
+    if((F>=0)&&(fstat(F,&St)||(St.st_size!=Size))) { close(F);F=-1; }
+    if(F<0) F=MakeFlash(FlashPath,M);
+    Shared=F>=0;
+    if(Verbose) LOGD("Flash image %s...%s",FlashPath,Shared? "OK":"FAILED");
+  }
+
+  /* Fall back to the ROM image itself */
+  if(F<0) F=open(ROMPath,O_RDONLY);
+  if(F<0) return(0);
+
+  if(fstat(F,&St)||(St.st_size<Size))
+  {
+    if(Verbose) LOGD("ROM Size 0x%lx does not match expected value 0x%x",(long)St.st_size,Size);
+    close(F);
+    return(0);
+  }
+
+  /* Without a flash image, flash changes stay in memory */
+  P=(byte *)mmap(0,Size,
+    Shared? PROT_READ|PROT_WRITE:Flash? PROT_READ|PROT_WRITE:PROT_READ,
+    Shared? MAP_SHARED:MAP_PRIVATE,
+    F,0
+  );
+  close(F);
+  if(P==MAP_FAILED) return(0);
+  if(Flash&&!Shared) BlankEEPROM(P,M);
+
+  /* Replace previous ROM */
+  UnmapROM();
+  ROM        = P;
+  ROMMapSize = Size;
+  ROMShared  = Shared;
+
+  /* Pack ROM in low memory mode, unless private flash */
+  if(LowMemory&&(!Flash||Shared)&&PackROM(P,Size))
+  {
+    munmap(P,Size);
+    return(1);
+  }
+
+  /* Private flash gets written to, only keep clean images */
+  if(Hash&&(!Flash||Shared)) KeepROM(Hash,M,FlashPath);
+  return(1);
+}
+
+/** MapPage() ************************************************/
+/** Map 16kB page at P into Z80 address space slot N. RAM   **/
+/** pages get filled with NORAM the first time they appear, **/
+/** the rest of RAM stays untouched and costs no memory.    **/
+/*************************************************************/
+static void MapPage(int N,byte *P)
+{
+  size_t J;
+
+  /* Packed ROM pages get unpacked */
+  PageAt[N]=P;
+  if(ROMPacked&&((size_t)(P-ROM)<(size_t)ROMMapSize))
+    P=ROMPage((P-ROM)>>14)+((P-ROM)&0x3FFF);
+
+  J=P-RAM;
+  if((J<(size_t)RAMSize)&&!(RAMFilled&(1<<(J>>14))))
+  {
+    RAMFilled|=1<<(J>>14);
+    memset(RAM+(J&~0x3FFF),NORAM,0x4000);
+    DirtyRAM(J&~0x3FFF,0x4000);
+  }
+
+  Page[N]=P;
+}
+
+/** DirtyMark() **********************************************/
+/** Return a mark to check RAM changes against later, with  **/
+/** DirtySince().                                           **/
+/*************************************************************/
+unsigned int DirtyMark(void) { return(DirtyGen++); }
+
+/** DirtySince() *********************************************/
+/** Return 1 if any of N RAM bytes at offset A have been    **/
+/** written since DirtyMark() returned Mark.                **/
+/*************************************************************/
+int DirtySince(unsigned int Mark,int A,int N)
+{
+  int J;
+
+  for(J=A>>DIRTY_SHIFT,N=(A+N-1)>>DIRTY_SHIFT;J<=N;++J)
+    if(RAMDirty[J]>Mark) return(1);
+  return(0);
+}
+
+/** DirtyRAM() ***********************************************/
+/** Mark N RAM bytes at offset A as written. Call it after  **/
+/** changing RAM other than through WrZ80().                **/
+/*************************************************************/
+void DirtyRAM(int A,int N)
+{
+  int J;
+
+  for(J=A>>DIRTY_SHIFT,N=(A+N-1)>>DIRTY_SHIFT;J<=N;++J)
+    RAMDirty[J]=DirtyGen;
+}
+
+/** HashRAM() ************************************************/
+/** Return a hash of used RAM, rehashing only blocks that   **/
+/** changed since the last call.                            **/
+/*************************************************************/
+unsigned int HashRAM(void)
+{
+  static unsigned int Hash[DIRTY_BLOCKS];
+  static unsigned int Mark;
+  static byte *HashedRAM;
+  const byte *P;
+  unsigned int H,K;
+  int J,I;
+
+  /* Different RAM means nothing hashed yet */
+  if(HashedRAM!=RAM) { HashedRAM=RAM;DirtyRAM(0,RAMSize); }
+
+  /* FNV-1a of each changed block, FNV-1a of all blocks, */
+  /* with never used blocks hashing to 0                  */
+  for(H=2166136261U,J=0;J<(RAMSize>>DIRTY_SHIFT);++J)
+  {
+    if(!(RAMFilled&(1<<(J>>(14-DIRTY_SHIFT))))) Hash[J]=0;
+    else if(RAMDirty[J]>Mark)
+    {
+      P=RAM+(J<<DIRTY_SHIFT);
+      for(K=2166136261U,I=0;I<(1<<DIRTY_SHIFT);++I) K=(K^P[I])*16777619U;
+      Hash[J]=K;
+    }
+    H=(H^Hash[J])*16777619U;
+  }
+
+  Mark=DirtyMark();
+  return(H);
+}
+
+/** UnmapRAM() ***********************************************/
+/** Release RAM mapping.                                    **/
+/*************************************************************/
+static void UnmapRAM(void)
+{
+  if(RAMMapSize) munmap(RAM,RAMMapSize);
+  RAM        = 0;
+  RAMMapSize = 0;
+  RAMFilled  = 0;
+}
+
+/** UnmapROM() ***********************************************/
+/** Write back flash changes and unmap ROM image, unless it **/
+/** is kept in ROMMaps[] for later.                         **/
+/*************************************************************/
+static void UnmapROM(void)
+{
+  if(!ROMMapSize) return;
+  FlushROM();
+  if(ROMPacked) { ReportROM();UnpackROM(); }
+  if(!ROMCached) { DropFlashBase(ROM);munmap(ROM,ROMMapSize); }
+  ROM        = 0;
+  ROMMapSize = 0;
+  ROMShared  = 0;
+  ROMCached  = 0;
 }
 
 /** ResetTI85() **********************************************/
@@ -238,7 +683,7 @@ void TrashTI85()
 /*************************************************************/
 int ResetTI85(int NewMode)
 {
-  FILE *F;
+  byte *P;
   int J,M;
 
   /* Figure out configuration */
@@ -248,44 +693,34 @@ int ResetTI85(int NewMode)
   /* If calculator model changed... */
   if((Mode^NewMode)&ATI_MODEL)
   {
-    /* Try loading ROM file */
-    J=0;
+    /* Get page-aligned, lazily zeroed RAM of the right size */
+    P=(byte *)mmap(0,Config[M].RAMSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
 
+    /* Try mapping ROM file */
     if(Verbose) LOGD("Loading %s...",ROMPath);
-    if(F=fopen(ROMPath,"rb"))
-    {
-      if(Verbose) LOGD("Reading %s...",ROMPath);
-      J = fread(ROM,1,Config[M].ROMSize,F);
-      if (J != Config[M].ROMSize) {
-        if (Verbose) LOGD("ROM Size 0x%x does not match expected value 0x%x", J, Config[M].ROMSize);
-        J = 0;
-      }
-      fclose(F);
-    }
-
+    J=(P!=MAP_FAILED)&&MapROM(M);
     if(Verbose) LOGD(J? "OK":"FAILED");
 
     /* If failed loading ROM file, default to previous model */
-    if(!J) NewMode=(NewMode&~ATI_MODEL)|(Mode&ATI_MODEL);
+    if(!J)
+    {
+      NewMode=(NewMode&~ATI_MODEL)|(Mode&ATI_MODEL);
+      if(P!=MAP_FAILED) munmap(P,Config[M].RAMSize);
+    }
     else
     {
       /* Load faceplate backdrop image */
       ShowBackdrop(Config[M].Backdrop);
 
+      /* Switch to new RAM, pages get cleared when mapped */
+      UnmapRAM();
+      RAM        = P;
+      RAMMapSize = Config[M].RAMSize;
+
       /* New RAM/ROM sizes are now valid */
       RAMSize = Config[M].RAMSize;
       ROMSize = Config[M].ROMSize;
-
-      /* Clear memory contents */
-      memset(RAM,NORAM,RAMSize);
-
-      /* If dealing with TI83+... */
-      if(Config[M].Model==ATI_TI83P)
-      {
-        /* Clear EEPROM program storage */
-        ROM[0x78000]=0;
-        for(J=0x78001;J<0x7C000;J++) ROM[J]=0xFF;
-      }
+      DirtyRAM(0,RAMSize);
     }
   }
 
@@ -293,8 +728,11 @@ int ResetTI85(int NewMode)
   memset(KbdStatus,0xFF,sizeof(KbdStatus));
   memset(Ports,0x00,sizeof(Ports));
 
-  /* Reset state */
+  /* Reset state, back to 6MHz */
+  FlashStep     = 0;
   Mode          = NewMode;
+  SetupPorts(Mode);
+  SetupPages(Mode);
   StartupOn     = 128;
   PORT_LCDBUF   = 0x3C;
   PORT_LCDCTRL  = 0x16;
@@ -308,10 +746,10 @@ int ResetTI85(int NewMode)
   {
     case ATI_TI82:
       /* TI82-specific initialization */
-      Page[0] = ROM;
-      Page[1] = ROM;
-      Page[2] = RAM;
-      Page[3] = RAM+0x4000;
+      MapPage(0,ROM);
+      MapPage(1,ROM);
+      MapPage(2,RAM);
+      MapPage(3,RAM+0x4000);
       /* Reset LCD controller */
       TI83LCDReset();
       break;
@@ -322,10 +760,10 @@ int ResetTI85(int NewMode)
       PORT_ROMPAGE = 0x99;
       PORT_POWER   = 0x00;
       /* TI83-specific initialization */
-      Page[0] = ROM;
-      Page[1] = ROM+0x4000;
-      Page[2] = RAM+0x4000;
-      Page[3] = RAM;
+      MapPage(0,ROM);
+      MapPage(1,ROM+0x4000);
+      MapPage(2,RAM+0x4000);
+      MapPage(3,RAM);
       /* Reset LCD controller */
       TI83LCDReset();
       break;
@@ -351,6 +789,7 @@ int ResetTI85(int NewMode)
       PORT_ROMPAGE  = 0x01; 
       PORT_ROMPAGE2 = 0x41;
       PORT_ROMPAGE3 = 0x00;
+      PORT_LACTRL   = 0x80;
       /* Initial memory layout */
       TI84PMapper(PORT_POWER,PORT_ROMPAGE,PORT_ROMPAGE2,PORT_ROMPAGE3);
       /* Reset LCD controller */
@@ -359,100 +798,68 @@ int ResetTI85(int NewMode)
 
    case ATI_TI85:
       /* TI85-specific initialization */
-      Page[0] = ROM;
-      Page[1] = ROM;
-      Page[2] = RAM;
-      Page[3] = RAM+0x4000;
+      MapPage(0,ROM);
+      MapPage(1,ROM);
+      MapPage(2,RAM);
+      MapPage(3,RAM+0x4000);
       break;
 
     case ATI_TI86:
       /* Do TI86-specific initialization */
-      Page[0] = ROM;
-      Page[1] = ROM;
-      Page[2] = ROM;
-      Page[3] = RAM;
+      MapPage(0,ROM);
+      MapPage(1,ROM);
+      MapPage(2,ROM);
+      MapPage(3,RAM);
       break;
   }
 
+  /* Screen contents have changed */
+  UpdateVRAM();
+
   /* Reset CPU */
+  SetClock();
+  ResetEvents();
   ResetZ80(&CPU);
   return(Mode);
 }
 
-/** SaveSTA() ************************************************/
-/** Save emulation state to a .STA file.                    **/
-/*************************************************************/
-int SaveSTA(const char *FileName)
-{
-    LOGD("Saving state: %s", FileName);
-  FILE *F;
-
-  /* Open state file */
-  F=fopen(FileName,"wb");
-  if(!F) return(0);
 
-  /* Write out hardware state */
-  if(fwrite(&Mode,1,sizeof(Mode),F)!=sizeof(Mode))
-  { fclose(F);unlink(FileName);return(0); }
-  if(fwrite(&CPU,1,sizeof(CPU),F)!=sizeof(CPU))
-  { fclose(F);unlink(FileName);return(0); }
-  if(fwrite(Ports,1,sizeof(Ports),F)!=sizeof(Ports))
-  { fclose(F);unlink(FileName);return(0); }
-  if(fwrite(&LCD,1,sizeof(LCD),F)!=sizeof(LCD))
-  { fclose(F);unlink(FileName);return(0); }
-  if(fwrite(RAM,1,RAMSize,F)!=RAMSize)
-  { fclose(F);unlink(FileName);return(0); }
-
-  /* Done */
-  fclose(F);
-  return(1);
-}
-
-/** LoadSTA() ************************************************/
-/** Load emulation state from a .STA file.                  **/
+/** StateLoaded() ********************************************/
+/** Bring the rest of hardware in line with loaded state.   **/
 /*************************************************************/
-int LoadSTA(const char *FileName)
+void StateLoaded(void)
 {
-    LOGD("Loading State: %s", FileName);
-
-  FILE *F;
-  int J;
-
-  /* Open state file */
-  F=fopen(FileName,"rb");
-  if(!F) return(0);
-
-  /* Read and match modes */
-  if(fread(&J,1,sizeof(J),F)!=sizeof(J)) { fclose(F);return(0); }
-  if((J!=Mode)&&(J!=ResetTI85(J)))       { fclose(F);return(0); }
-
-  /* Read in hardware state */
-  if(fread(&CPU,1,sizeof(CPU),F)!=sizeof(CPU))
-  { fclose(F);ResetTI85(Mode);return(0); }
-  if(fread(Ports,1,sizeof(Ports),F)!=sizeof(Ports))
-  { fclose(F);ResetTI85(Mode);return(0); }
-  if(fread(&LCD,1,sizeof(LCD),F)!=sizeof(LCD))
-  { fclose(F);ResetTI85(Mode);return(0); }
-  if(fread(RAM,1,RAMSize,F)!=RAMSize)
-  { fclose(F);ResetTI85(Mode);return(0); }
-
   /* Restore memory layout */
   if(Mode&ATI_TI86)      TI86Mapper(PORT_ROMPAGE,PORT_ROMPAGE2);
   else if(Mode&ATI_TI85) TI85Mapper(PORT_ROMPAGE);
-  else if(TI83P_FAMILY)  TI83PMapper(PORT_POWER,PORT_ROMPAGE,PORT_ROMPAGE2);
+  else if((Mode&ATI_MODEL)==ATI_TI83P)
+    TI83PMapper(PORT_POWER,PORT_ROMPAGE,PORT_ROMPAGE2);
+  else if(TI83P_FAMILY)
+    TI84PMapper(PORT_POWER,PORT_ROMPAGE,PORT_ROMPAGE2,PORT_ROMPAGE3);
   else if(TI83_FAMILY)   TI83Mapper(PORT_LINK,PORT_ROMPAGE,PORT_POWER);
 
+  /* Restore CPU speed and timers */
+  SetClock();
+  ResetEvents();
+  CPU.ICount=CPU.IPeriod;
+
   /* Restore colors */
   if(TI83_FAMILY) TI83Colors(LCD.Contrast); else TI85Colors(PORT_CONTRAST);
 
   /* If not in "off" state, cancel [ON] key */
   if(!SLEEP_ON) StartupOn=0;
 
-  /* Done */
-  fclose(F);
-  return(1);
+  /* All of RAM may have changed */
+  DirtyRAM(0,RAMSize);
+
+  /* Loaded state is not a fresh boot */
+  BootIdle=-1;
+
+  /* Screen contents have changed */
+  UpdateVRAM();
 }
 
+
 /** RdZ80() **************************************************/
 /** Z80 emulation calls this function to read a byte from   **/
 /** address A of Z80 address space. Now moved to Z80.c and  **/
@@ -467,7 +874,22 @@ byte RdZ80(word A) { return(Page[A>>14][A&0x3FFF]); }
 /** address A of Z80 address space.                         **/
 /*************************************************************/
 #ifndef TI85
-void WrZ80(word A,byte V) { if(Page[A>>14]<ROM) Page[A>>14][A&0x3FFF]=V; }
+void WrZ80(word A,byte V)
+{
+  byte *P=Page[A>>14];
+
+  /* Fast path: one unsigned compare for RAM pages */
+  if((size_t)(P-RAM)<(size_t)RAMSize)
+  {
+    P+=A&0x3FFF;
+    DIRTY_WRITE(P-RAM);
+    /* Note changes to the TI85/TI86 screen buffer */
+    if(((size_t)P-(size_t)VRAM<0x400)&&(*P!=V)) ++LCDGen;
+    *P=V;
+  }
+  /* Slow path: TI83+ family flash chip commands */
+  else if(TI83P_FAMILY) FlashWrite(PageAt[A>>14]-ROM+(A&0x3FFF),V);
+}
 #endif
 
 /** PatchZ80() ***********************************************/
@@ -488,365 +910,878 @@ byte DebugZ80(register Z80 *R) {
 }
 #endif
 
-/** InZ80() **************************************************/
-/** Z80 emulation calls this function to read a byte from   **/
-/** a given I/O port.                                       **/
+/** I/O port handlers ****************************************/
+/** Each model gets its own table of 256 read and write     **/
+/** handlers, filled by SetupPorts() from ResetTI85().      **/
 /*************************************************************/
-byte InZ80(word Port)
-{
-  byte J;
+typedef byte (*InHandler)(byte Port);
+typedef void (*OutHandler)(byte Port,byte V);
 
-  /* Simulate different models on different port ranges */
-  Port=(Port&0xFF)|(Mode&ATI_MODEL);
+static InHandler  InPorts[256];  /* Port read handlers       */
+static OutHandler OutPorts[256]; /* Port write handlers      */
 
-#ifdef DEBUG
-  LOGD("READ from IO port %02Xh at PC=%04Xh\n",Port&0xFF,CPU.PC.W);
-#endif
+/** LinkNow() ************************************************/
+/** Return current emulated time in LINK_HZ units.          **/
+/*************************************************************/
+static unsigned int LinkNow(void)
+{
+  return(EvTime+(EvPeriod-CPU.ICount)*(LINK_HZ/CPUClock));
+}
 
-  switch(Port)
-  {
-    case 0x0001: /* TI85 Keypad    */
-    case 0x0101: /* TI86 Keypad    */
-    case 0x0201: /* TI82 Keypad    */
-    case 0x0401: /* TI83 Keypad    */
-    case 0x0801: /* TI83+ Keypad   */
-    case 0x1001: /* TI83+SE Keypad */
-    case 0x2001: /* TI84+ Keypad   */
-    case 0x4001: /* TI84+SE Keypad */
-      J    = PORT_KEYPAD;
-      Port = J&0x40? 0xFF:KbdStatus[6];
-      Port&= J&0x20? 0xFF:KbdStatus[5];
-      Port&= J&0x10? 0xFF:KbdStatus[4];
-      Port&= J&0x08? 0xFF:KbdStatus[3];
-      Port&= J&0x04? 0xFF:KbdStatus[2];
-      Port&= J&0x02? 0xFF:KbdStatus[1];
-      Port&= J&0x01? 0xFF:KbdStatus[0];
-      return(Port);
-
-    case 0x0000: /* TI85 Video Buffer      */
-    case 0x0002: /* TI85 LCD Contrast      */
-    case 0x0004: /* TI85 LCD Control       */
-    case 0x0005: /* TI85 ROM Page 4000h    */
-    case 0x0006: /* TI85 Power Register    */
-    case 0x0100: /* TI86 Video Buffer      */
-    case 0x0102: /* TI86 LCD Contrast      */
-    case 0x0105: /* TI86 Memory Page 4000h */
-    case 0x0404: /* TI83 IRQ Control       */
-      return(Ports[Port&0x07]);
-
-    case 0x0104: /* TI86 Power Register    */
-      return(PORT_POWER);
-
-    case 0x0106: /* TI86 Memory Page 8000h */
-      return(PORT_ROMPAGE2);
-
-    case 0x0003: /* TI85 Status    */
-    case 0x0103: /* TI86 Status    */
-    case 0x0203: /* TI82 Status    */
-    case 0x0403: /* TI83 Status    */
-    case 0x0803: /* TI83+ Status   */
-    case 0x1003: /* TI83+SE Status */
-    case 0x2003: /* TI84+ Status   */
-    case 0x4003: /* TI84+SE Status */
-    case 0x0804: /* TI83+ Status ???   */
-    case 0x1004: /* TI83+SE Status ??? */
-    case 0x2004: /* TI84+ Status ???   */
-    case 0x4004: /* TI84+SE Status ??? */
-      return(PORT_STATUS);
-
-    case 0x0007: /* TI85 Link Register    */
-    case 0x0107: /* TI86 Link Register    */
-    case 0x0200: /* TI82 Link Register    */
-//    J=PORT_LINK&0x0C;
-//    PORT_LINK=J|(~((J>>2)|SIOExchange(J>>2))&0x03);
-      return(PORT_LINK);
-
-    case 0x0400: /* TI83 Link Register    */
-    case 0x0800: /* TI83+ Link Register   */
-    case 0x1000: /* TI83+SE Link Register */
-    case 0x2000: /* TI84+ Link Register   */
-    case 0x4000: /* TI84+SE Link Register */
-      return(PORT_LINK);
-
-    case 0x0202: /* TI82 Memory Page 4000h */
-    case 0x0402: /* TI83 Memory Page 4000h */
-      return(PORT_ROMPAGE);
-
-    case 0x0210: /* TI82 LCD Status    */
-    case 0x0410: /* TI83 LCD Status    */
-    case 0x0810: /* TI83+ LCD Status   */
-    case 0x1010: /* TI83+SE LCD Status */
-    case 0x2010: /* TI84+ LCD Status   */
-    case 0x4010: /* TI83+SE LCD Status */
-      return(LCD.Status);
-
-    case 0x0211: /* TI82 VRAM    */
-    case 0x0411: /* TI83 VRAM    */
-    case 0x0811: /* TI83+ VRAM   */
-    case 0x1011: /* TI83+SE VRAM */
-    case 0x2011: /* TI84+ VRAM   */
-    case 0x4011: /* TI84+SE VRAM */
-      return(TI83LCDDataRD());   
-    case 0x0414: /* TI83 ??? */
-      return(0x01);
-
-    case 0x0802: /* TI83+ Hardware Status   */
-      /* Report "battery ok" + "TI83+" */
-      return(0x0b|((PORT_ROMPAGE3&0x07)<<3));
-    case 0x1002: /* TI83+SE Hardware Status */
-      /* Report "battery ok" + "TI83+SE" */
-      return(0x81);
-    case 0x2002: /* TI84+ Hardware Status   */
-    case 0x4002: /* TI84+SE Hardware Status */
-      /* Report "battery ok" + "TI84+/TI84+SE" */
-      return(0xA1);
-
-    case 0x1021: /* TI83+SE Hardware Type  */
-    case 0x4021: /* TI84+SE Hardware Type  */
-      /* Report "TI83+SE/TI84+SE" */
-      return(0x01);
-    case 0x2021: /* TI84+ Hardware Type    */
-      /* Report "TI84+" */
-      return(0x00);
-
-    case 0x0806: /* TI83+ Memory Page #1   */
-    case 0x1006: /* TI83+SE Memory Page #1 */
-    case 0x2006: /* TI84+ Memory Page #1   */
-    case 0x4006: /* TI84+SE Memory Page #1 */
-      return(PORT_ROMPAGE);
-
-    case 0x0807: /* TI83+ Memory Page #2   */
-    case 0x1007: /* TI83+SE Memory Page #2 */
-    case 0x2007: /* TI84+ Memory Page #2   */
-    case 0x4007: /* TI84+SE Memory Page #2 */
-      return(PORT_ROMPAGE2);
-
-    case 0x1005: /* TI83+SE Memory Page #3 */
-    case 0x2005: /* TI84+ Memory Page #3   */
-    case 0x4005: /* TI84+SE Memory Page #3 */
-      return(PORT_ROMPAGE3);
-  }
+/** TI83+ family page tables *********************************/
+/** Page addresses for every value of ports 6,7 (PageMap)   **/
+/** and port 5 (RAMMap), filled by SetupPages().            **/
+/*************************************************************/
+static byte *PageMap[256];       /* Ports 6,7 -> ROM/RAM page */
+static byte *RAMMap[256];        /* Port 5 -> RAM page at C000h */
 
-  if(Verbose&0x02) LOGE("READ from IO port %02Xh\n",Port&0xFF);
+static byte InNone(byte Port)
+{
+  if(Verbose&0x02) LOGE("READ from IO port %02Xh\n",Port);
   return(NORAM);
 }
 
-/** OutZ80() *************************************************/
-/** Z80 emulation calls this function to write byte V to a  **/
-/** given I/O port.                                         **/
-/*************************************************************/
-void OutZ80(word Port,byte V)
+static byte InKeypad(byte Port)
 {
-  byte Vin,Vout;
-
-  /* Simulate different models on different port ranges */
-  Port=(Port&0xFF)|(Mode&ATI_MODEL);
+  byte J = PORT_KEYPAD;
+  byte V;
+
+  V = J&0x40? 0xFF:KbdStatus[6];
+  V&= J&0x20? 0xFF:KbdStatus[5];
+  V&= J&0x10? 0xFF:KbdStatus[4];
+  V&= J&0x08? 0xFF:KbdStatus[3];
+  V&= J&0x04? 0xFF:KbdStatus[2];
+  V&= J&0x02? 0xFF:KbdStatus[1];
+  V&= J&0x01? 0xFF:KbdStatus[0];
+  return(V);
+}
 
-#ifdef DEBUG
-  LOGE("WRITE %02Xh to IO port %02Xh at PC=%04Xh\n",V,Port&0xFF,CPU.PC.W);
-#endif
+static byte InPort(byte Port)      { return(Ports[Port&0x07]); }
+static byte InPower(byte Port)     { return(PORT_POWER); }
+static byte InStatus(byte Port)    { return(PORT_STATUS); }
+static byte InLink(byte Port)
+{
+  /* TI82/TI85/TI86 read line levels in bits 0-1 */
+  byte D = (PORT_LINK>>2)&0x03;
+  return(PORT_LINK=(PORT_LINK&0xFC)|SIOExchange(D,LinkNow()));
+}
 
-  switch(Port)
-  {
-    case 0x0000: /* TI85 Video Buffer */
-    case 0x0100: /* TI86 Video Buffer */
-      PORT_LCDBUF=V;
-      return;
+static byte InLink83(byte Port)
+{
+  /* TI83 keeps driven lines in bits 5-6, hidden */
+  byte D = (PORT_LINK>>5)&0x03;
+  PORT_LINK=(PORT_LINK&0xFC)|SIOExchange(D,LinkNow());
+  return(PORT_LINK&0x1F);
+}
 
-    case 0x0001: /* TI85 Keypad    */
-    case 0x0101: /* TI86 Keypad    */
-    case 0x0201: /* TI82 Keypad    */
-    case 0x0401: /* TI83 Keypad    */
-    case 0x0801: /* TI83+ Keypad   */
-    case 0x1001: /* TI83+SE Keypad */
-    case 0x2001: /* TI84+ Keypad   */
-    case 0x4001: /* TI84+SE Keypad */
-      PORT_KEYPAD=V;
-      return;
+static byte InLink83P(byte Port)
+{
+  /* TI83+ family reads line levels in bits 0-1 */
+  byte D = (PORT_LINK>>4)&0x03;
+  return(PORT_LINK=(PORT_LINK&0xFC)|SIOExchange(D,LinkNow()));
+}
+static byte InPage(byte Port)      { return(PORT_ROMPAGE); }
+static byte InPage2(byte Port)     { return(PORT_ROMPAGE2); }
+static byte InPage3(byte Port)     { return(PORT_ROMPAGE3); }
+static byte InFlash(byte Port)     { return(PORT_FLASH); }
+static byte InSpeed(byte Port)     { return(PORT_SPEED); }
+static byte InLCDStatus(byte Port) { return(LCD.Status); }
+static byte InLCDData(byte Port)   { return(TI83LCDDataRD()); }
+static byte InZero(byte Port)      { return(0x00); }
+static byte InOne(byte Port)       { return(0x01); }
+
+/* Report "battery ok" + "TI83+" */
+static byte In83PHW(byte Port)     { return(0x0b|((PORT_ROMPAGE3&0x07)<<3)); }
+/* Report "battery ok" + "TI83+SE" */
+static byte In83SEHW(byte Port)    { return(0x81); }
+/* Report "battery ok" + "TI84+/TI84+SE" */
+static byte In84PHW(byte Port)     { return(0xA1); }
+
+static void OutNone(byte Port,byte V)
+{
+  if(Verbose&0x02) LOGE("WRITE %02Xh to IO port %02Xh\n",V,Port);
+}
 
-    case 0x0002: /* TI85 LCD Contrast */
-    case 0x0102: /* TI86 LCD Contrast */
-      PORT_CONTRAST=V&0x1F;
-      TI85Colors(V);
-      return;
+static void OutLCDBuf(byte Port,byte V)
+{
+  PORT_LCDBUF=V;
+  UpdateVRAM();
+}
 
-    case 0x0003: /* TI85 Control    */
-    case 0x0103: /* TI86 Control    */
-    case 0x0203: /* TI82 Control    */
-    case 0x0403: /* TI83 Control    */
-    case 0x0803: /* TI83+ Control   */
-    case 0x1003: /* TI83+SE Control */
-    case 0x2003: /* TI84+ Control   */
-    case 0x4003: /* TI84+SE Control */
-      PORT_CONTROL=V;
-      PORT_STATUS&=V|~0x07;
-      return;
+static void OutKeypad(byte Port,byte V)   { PORT_KEYPAD=V; }
+static void OutLCDCtrl(byte Port,byte V)  { PORT_LCDCTRL=V; }
+static void OutPower(byte Port,byte V)    { PORT_POWER=V; }
+static void OutLCDCmd(byte Port,byte V)   { TI83LCDCtrl(V); }
+static void OutLCDData(byte Port,byte V)  { TI83LCDDataWR(V); }
 
-    case 0x0004: /* TI85 LCD Control */
-      PORT_LCDCTRL=V;
-      return;
+static void OutContrast(byte Port,byte V)
+{
+  PORT_CONTRAST=V&0x1F;
+  TI85Colors(V);
+}
 
-    case 0x0005: /* TI85 ROM Page 4000h */
-    case 0x0202: /* TI82 ROM Page 4000h */
-      /* Plain TI82/TI85 only allow ROM at 4000h */
-      Page[1] = ROM+((int)(V&0x07)<<14);
-      PORT_ROMPAGE=V;
-      return;
+static void OutControl(byte Port,byte V)
+{
+  /* LCD on/off changes the picture */
+  if((PORT_CONTROL^V)&0x0F) ++LCDGen;
+  PORT_CONTROL=V;
+  PORT_STATUS&=V|~0x07;
+}
 
-    case 0x0006: /* TI85 Power Register */
-    case 0x0104: /* TI86 Power Register */
-      PORT_POWER=V;
-      return;
+static void OutLink85(byte Port,byte V)
+{
+  /* Bits 2-3 or 4-5 pull link lines low */
+  byte D = ((V|(V>>2))>>2)&0x03;
+  PORT_LINK=(PORT_LINK&0xF0)|(D<<2)|SIOExchange(D,LinkNow());
+}
 
-    case 0x0007: /* TI85 Link Register */
-    case 0x0107: /* TI86 Link Register */
-    case 0x0200: /* TI82 Link Register */
-//      V=(V|(V>>2))&0x0C;
-//      PORT_LINK=V|(~((V>>2)|SIOExchange(V>>2))&0x03);
-      PORT_LINK=(PORT_LINK&0xF3)|(V&0x0C);
-      return;
+static void OutPage85(byte Port,byte V)
+{
+  /* Plain TI82/TI85 only allow ROM at 4000h */
+  MapPage(1,ROM+((int)(V&0x07)<<14));
+  PORT_ROMPAGE=V;
+}
 
-    case 0x0105: /* TI86 Memory Page 4000h */
-      /* TI86 allows either ROM or RAM at 4000h */
-      PORT_ROMPAGE=V;
-      Page[1] = V&0x40?
-        RAM+((int)(V&0x07)<<14)
-      : ROM+((int)(V&0x0F)<<14);
-      return;
+static void OutPage86(byte Port,byte V)
+{
+  /* TI86 allows either ROM or RAM at 4000h */
+  PORT_ROMPAGE=V;
+  MapPage(1,V&0x40?
+    RAM+((int)(V&0x07)<<14)
+  : ROM+((int)(V&0x0F)<<14));
+}
 
-    case 0x0106: /* TI86 Memory Page 8000h */
-      /* TI86 allows either ROM or RAM at 8000h */
-      PORT_ROMPAGE2=V;
-      Page[2] = V&0x40?
-        RAM+((int)(V&0x07)<<14)
-      : ROM+((int)(V&0x0F)<<14);
-      return;
+static void OutPage86B(byte Port,byte V)
+{
+  /* TI86 allows either ROM or RAM at 8000h */
+  PORT_ROMPAGE2=V;
+  MapPage(2,V&0x40?
+    RAM+((int)(V&0x07)<<14)
+  : ROM+((int)(V&0x0F)<<14));
+}
 
-    case 0x0400: /* TI83 Link Register + Memory Bit */
-      PORT_LINK=((V^0x03)|0x0C)&0x1F;
-      TI83Mapper(V,PORT_ROMPAGE,PORT_POWER);
-      return;   
-
-    case 0x0800: /* TI83+ Link Register + Link Assist   */
-    case 0x1000: /* TI83+SE Link Register + Link Assist */
-    case 0x2000: /* TI84+ Link Register + Link Assist   */
-    case 0x4000: /* TI84+SE Link Register + Link Assist */
-      PORT_LINK=((V&0x03)<<4)|(V&0x04)|0x03;
-      return;   
-
-    case 0x0402: /* TI83 Memory Page 4000h */
-      PORT_ROMPAGE=V;
-      TI83Mapper(PORT_LINK,V,PORT_POWER);
-      return;   
-
-    case 0x0404: /* TI83 Power + Timer + Memory Bit */
-      PORT_POWER=V;
-      TI83Mapper(PORT_LINK,PORT_ROMPAGE,V);
-      return;   
-
-    case 0x0210: /* TI82 LCD Command    */
-    case 0x0410: /* TI83 LCD Command    */
-    case 0x0810: /* TI83+ LCD Command   */
-    case 0x1010: /* TI83+SE LCD Command */
-    case 0x2010: /* TI84+ LCD Command   */
-    case 0x4010: /* TI84+SE LCD Command */
-      TI83LCDCtrl(V);
-      return;   
-
-    case 0x0211: /* TI82 VRAM Access    */ 
-    case 0x0411: /* TI83 VRAM Access    */ 
-    case 0x0811: /* TI83+ VRAM Access   */ 
-    case 0x1011: /* TI83+SE VRAM Access */ 
-    case 0x2011: /* TI84+ VRAM Access   */ 
-    case 0x4011: /* TI84+SE VRAM Access */ 
-      TI83LCDDataWR(V);
-      return;   
-
-    case 0x0804: /* TI83+ Timers + Memory Map */
-      PORT_POWER=V;
-      TI83PMapper(V,PORT_ROMPAGE,PORT_ROMPAGE2);
-      return;
-   
-    case 0x1004: /* TI83+SE Timers + Memory Map */
-    case 0x2004: /* TI84+ Timers + Memory Map   */
-    case 0x4004: /* TI84+SE Timers + Memory Map */
-      PORT_POWER=V;
-      TI84PMapper(V,PORT_ROMPAGE,PORT_ROMPAGE2,PORT_ROMPAGE3);
-      return;
-   
-    case 0x0806: /* TI83+ Memory Page #1 */
-      PORT_ROMPAGE=V;
-      TI83PMapper(PORT_POWER,V,PORT_ROMPAGE2);
-      return;   
-
-    case 0x1006: /* TI83+SE Memory Page #1 */
-    case 0x2006: /* TI84+ Memory Page #1   */
-    case 0x4006: /* TI84+SE Memory Page #1 */
-      PORT_ROMPAGE=V;
-      TI84PMapper(PORT_POWER,V,PORT_ROMPAGE2,PORT_ROMPAGE3);
-      return;   
-
-    case 0x0807: /* TI83+ Memory Page #2 */
-      PORT_ROMPAGE2=V;
-      TI83PMapper(PORT_POWER,PORT_ROMPAGE,V);
-      return;   
-
-    case 0x1007: /* TI83+SE Memory Page #2 */
-    case 0x2007: /* TI84+ Memory Page #2   */
-    case 0x4007: /* TI84+SE Memory Page #2 */
-      PORT_ROMPAGE2=V;
-      TI84PMapper(PORT_POWER,PORT_ROMPAGE,V,PORT_ROMPAGE3);
-      return;   
-
-    case 0x0805: /* TI83+ Flash Protect Model */
-      PORT_ROMPAGE3=V;
-      return;   
-
-    case 0x1005: /* TI83+SE Memory Page #3 */
-    case 0x2005: /* TI84+ Memory Page #3   */
-    case 0x4005: /* TI84+SE Memory Page #3 */
-      PORT_ROMPAGE3=V;
-      TI84PMapper(PORT_POWER,PORT_ROMPAGE,PORT_ROMPAGE2,V);
-      return;   
-  }
+static void OutLink83(byte Port,byte V)
+{
+  /* TI83 Link Register + Memory Bit */
+  byte D = V&0x03;
+  PORT_LINK=SIOExchange(D,LinkNow())|0x0C|(V&0x10)|(D<<5);
+  TI83Mapper(V,PORT_ROMPAGE,PORT_POWER);
+}
 
-  if(Verbose&0x02) LOGE("WRITE %02Xh to IO port %02Xh\n",V,Port&0xFF);
+static void OutPage83(byte Port,byte V)
+{
+  PORT_ROMPAGE=V;
+  TI83Mapper(PORT_LINK,V,PORT_POWER);
 }
 
-/** LoopZ80() ************************************************/
-/** Z80 emulation calls this function periodically to check **/
-/** if the system hardware requires any interrupts.         **/
-/*************************************************************/
-word LoopZ80(Z80 *R)
+static void OutPower83(byte Port,byte V)
 {
-  static int  UCount=0;
-  static byte ICount=0;
-  byte ONKeyOn;
+  /* TI83 Power + Timer + Memory Bit */
+  PORT_POWER=V;
+  TI83Mapper(PORT_LINK,PORT_ROMPAGE,V);
+}
 
-  /* When calculator turned off, exit */
-  if(!StartupOn&&SLEEP_ON&&(R->IFF&IFF_HALT)) ExitNow=1;
+static void OutLink83P(byte Port,byte V)
+{
+  /* TI83+/TI84+ Link Register + Link Assist */
+  byte D = V&0x03;
+  PORT_LINK=(D<<4)|(V&0x04)|SIOExchange(D,LinkNow());
+}
+
+static void OutPower83P(byte Port,byte V)
+{
+  /* TI83+ Timers + Memory Map, remap only if map changes */
+  byte Old=PORT_POWER;
+  PORT_POWER=V;
+  if((Old^V)&0x01) TI83PMapper(V,PORT_ROMPAGE,PORT_ROMPAGE2);
+  if((Old^V)&0x06) Schedule(EV_TIMER,TimerPeriod());
+}
+
+static void OutPage83P(byte Port,byte V)
+{
+  /* Page #1 lives at 4000h, or at 8000h in map mode 1 */
+  PORT_ROMPAGE=V;
+  MapPage(1+(PORT_POWER&0x01),PageMap[V]);
+}
+
+static void OutPage83P2(byte Port,byte V)
+{
+  /* Page #2 lives at 8000h, or at C000h in map mode 1 */
+  PORT_ROMPAGE2=V;
+  MapPage(2+(PORT_POWER&0x01),PageMap[V]);
+}
+
+static void OutProtect83P(byte Port,byte V)
+{
+  /* TI83+ Flash Protect Model */
+  PORT_ROMPAGE3=V;
+}
+
+static void OutFlash(byte Port,byte V)
+{
+  /* TI83+ family flash write protection */
+  PORT_FLASH=V&0x01;
+}
+
+/** SetClock() ***********************************************/
+/** Set CPU clock from PORT_SPEED. Scheduled events pick up **/
+/** the new clock when they are next reloaded.               **/
+/*************************************************************/
+static void SetClock(void)
+{
+  CPUClock = PORT_SPEED&0x03? CPU_FAST:CPU_CLOCK;
+}
+
+static void OutSpeed(byte Port,byte V)
+{
+  /* TI83+SE/TI84+ CPU speed: 0 is 6MHz, else 15MHz */
+  PORT_SPEED=V&0x03;
+  SetClock();
+}
+
+/** TimerPeriod() ********************************************/
+/** Return hardware timer interrupt period in CPU cycles.   **/
+/** TI83+ family selects one of four rates with port 4.     **/
+/*************************************************************/
+static int TimerPeriod(void)
+{
+  static const int HZ83P[4] = { 560,248,170,118 };
+  static const int HZ84P[4] = { 512,227,156,108 };
+
+  switch(Mode&ATI_MODEL)
+  {
+    case ATI_TI83P:  return(CPUClock/HZ83P[(PORT_POWER>>1)&0x03]);
+    case ATI_TI83SE:
+    case ATI_TI84P:
+    case ATI_TI84SE: return(CPUClock/HZ84P[(PORT_POWER>>1)&0x03]);
+    default:         return(TIMER_CLK);
+  }
+}
+
+/** XtalDiv[] ************************************************/
+/** 32768Hz crystal divisors for timer values 40h..47h.     **/
+/*************************************************************/
+static const int XtalDiv[8] = { 3,10,30,100,300,1000,3000,10000 };
+
+/** XtalCycles() *********************************************/
+/** Return CPU cycles taken by given number of crystal      **/
+/** timer N ticks, or EV_NEVER if the timer is off. Values  **/
+/** 40h..47h count 32768Hz divided by XtalDiv[n], values    **/
+/** 80h..87h count CPU clock divided by 2^n.                **/
+/*************************************************************/
+static int XtalCycles(int N,int Ticks)
+{
+  byte F = XTAL_FREQ(N);
+  long long C;
+
+  if(F&0x80)      C = (long long)Ticks<<(F&0x07);
+  else if(F&0x40) C = (long long)Ticks*CPUClock*XtalDiv[F&0x07]/32768;
+  else            return(EV_NEVER);
+
+  return(C<1? 1:C<EV_NEVER/2? (int)C:EV_NEVER/2);
+}
+
+/** XtalTicks() **********************************************/
+/** Return crystal timer N ticks left in given CPU cycles,  **/
+/** rounded up.                                             **/
+/*************************************************************/
+static int XtalTicks(int N,int Cycles)
+{
+  byte F = XTAL_FREQ(N);
+  long long D;
+
+  if(Cycles<=0) return(0);
+  if(F&0x80) return((Cycles+(1<<(F&0x07))-1)>>(F&0x07));
+  D = (long long)CPUClock*XtalDiv[F&0x07];
+  return(((long long)Cycles*32768+D-1)/D);
+}
+
+/** Schedule() ***********************************************/
+/** Make event E happen in given number of CPU cycles from  **/
+/** now, cutting current IPeriod short if it comes sooner.  **/
+/*************************************************************/
+static void Schedule(int E,int Cycles)
+{
+  EvLeft[E] = EvPeriod-CPU.ICount+Cycles;
+
+  /* ICount is adjusted, not set, to stay valid after EI */
+  if(EvLeft[E]<EvPeriod)
+  {
+    CPU.ICount-= EvPeriod-EvLeft[E];
+    EvPeriod   = EvLeft[E];
+  }
+}
+
+/** NextEvent() **********************************************/
+/** Return CPU cycles until the nearest pending event.      **/
+/*************************************************************/
+static int NextEvent(void)
+{
+  int J,N;
+
+  for(J=1,N=EvLeft[0];J<EV_COUNT;++J)
+    if(EvLeft[J]<N) N=EvLeft[J];
+  return(N);
+}
+
+/** ResetEvents() ********************************************/
+/** Schedule timers from current port values and set CPU    **/
+/** IPeriod to the nearest one.                             **/
+/*************************************************************/
+static void ResetEvents(void)
+{
+  int J;
+
+  EvLeft[EV_TICK]  = TIMER_CLK;
+  EvLeft[EV_TIMER] = TimerPeriod();
+
+  /* Restart crystal timers that were running */
+  for(J=0;J<3;++J)
+    EvLeft[EV_XTAL+J] = XTAL_CTRL(J)&0x10?
+      XtalCycles(J,XTAL_COUNT(J)):EV_NEVER;
+
+  /* Link sync restarts on the next tick */
+  EvLeft[EV_LINK] = EV_NEVER;
+
+  EvPeriod    = NextEvent();
+  CPU.IPeriod = EvPeriod;
+}
+
+static void OutPower84P(byte Port,byte V)
+{
+  /* TI83+SE/TI84+ Timers + Memory Map, remap if map changes */
+  byte Old=PORT_POWER;
+  PORT_POWER=V;
+  if((Old^V)&0x01) TI84PMapper(V,PORT_ROMPAGE,PORT_ROMPAGE2,PORT_ROMPAGE3);
+  if((Old^V)&0x06) Schedule(EV_TIMER,TimerPeriod());
+}
+
+static void OutPage84P3(byte Port,byte V)
+{
+  /* Page #3 is the RAM page at C000h in map mode 0 */
+  PORT_ROMPAGE3=V;
+  if(!(PORT_POWER&0x01)) MapPage(3,RAMMap[V]);
+}
+
+static byte InXtalFreq(byte Port)
+{
+  return(XTAL_FREQ((Port-0x30)/3));
+}
+
+static byte InXtalCtrl(byte Port)
+{
+  /* Bit 0: timer expired, bit 1: expired again since ack */
+  return((XTAL_CTRL((Port-0x30)/3)>>2)&0x03);
+}
+
+static byte InXtalCount(byte Port)
+{
+  int N = (Port-0x30)/3;
+  int J;
+
+  if(!(XTAL_CTRL(N)&0x10)) return(0);
+  J = XtalTicks(N,EvLeft[EV_XTAL+N]-(EvPeriod-CPU.ICount));
+  return(J<XTAL_COUNT(N)? J:XTAL_COUNT(N));
+}
+
+static void OutXtalFreq(byte Port,byte V)
+{
+  /* Changing timer clock stops the timer */
+  int N = (Port-0x30)/3;
+  XTAL_FREQ(N)    = V;
+  XTAL_CTRL(N)   &= ~0x10;
+  EvLeft[EV_XTAL+N] = EV_NEVER;
+}
+
+static void OutXtalCtrl(byte Port,byte V)
+{
+  /* Set loop/interrupt bits, acknowledge expiration */
+  int N = (Port-0x30)/3;
+  XTAL_CTRL(N) = (XTAL_CTRL(N)&0x10)|(V&0x03);
+  PORT_STATUS &= ~(0x20<<N);
+}
+
+static void OutXtalCount(byte Port,byte V)
+{
+  /* Writing nonzero count starts the timer */
+  int N = (Port-0x30)/3;
+  int C = V? XtalCycles(N,V):EV_NEVER;
+
+  XTAL_COUNT(N) = V;
+  if(C==EV_NEVER)
+  {
+    XTAL_CTRL(N)     &= ~0x10;
+    EvLeft[EV_XTAL+N] = EV_NEVER;
+  }
+  else
+  {
+    XTAL_CTRL(N) |= 0x10;
+    Schedule(EV_XTAL+N,C);
+  }
+}
+
+/** LinkAssist() *********************************************/
+/** Update TI83+SE/TI84+ link assist status from the link,  **/
+/** flagging interrupts when a byte arrives or can be sent. **/
+/*************************************************************/
+static void LinkAssist(void)
+{
+  byte Old = PORT_LASTAT;
+  byte V   = Old&0x47;
+  int S    = LINKASSIST_ON? LinkBytes(LinkNow()):0;
+
+  if(S&LINK_RX)   V|=0x10;
+  if(S&LINK_TX)   V|=0x20;
+  if(S&LINK_BUSY) V|=0x80;
+
+  /* Interrupt on byte received or sent, if enabled */
+  if((V&~Old&0x10)&&(PORT_LACTRL&0x01)) V|=0x01;
+  if((V&~Old&0x20)&&(PORT_LACTRL&0x02)) V|=0x02;
+
+  PORT_LASTAT = V;
+  PORT_STATUS = V&0x07? (PORT_STATUS|0x10):(PORT_STATUS&~0x10);
+}
+
+static byte InLAStatus(byte Port)
+{
+  LinkAssist();
+  return(PORT_LASTAT);
+}
+
+static byte InLAData(byte Port)
+{
+  /* Taking the byte lets the peer send the next one */
+  int V = LINKASSIST_ON? LinkGet(LinkNow()):-1;
+  if(V>=0) PORT_LADATA=V;
+  PORT_LASTAT&=~0x11;
+  LinkAssist();
+  return(PORT_LADATA);
+}
+
+static byte InLACtrl(byte Port)    { return(PORT_LACTRL); }
+
+static void OutLACtrl(byte Port,byte V)
+{
+  /* Writing control acknowledges interrupts and errors */
+  PORT_LACTRL  = V&0x87;
+  PORT_LASTAT &= ~0x47;
+  LinkAssist();
+}
+
+static void OutLAData(byte Port,byte V)
+{
+  /* No peer to take the byte: link error */
+  PORT_LASTAT&=~0x22;
+  if(!LINKASSIST_ON||!LinkPut(V,LinkNow()))
+    PORT_LASTAT|=PORT_LACTRL&0x04? 0x44:0x40;
+  LinkAssist();
+}
+
+/** XtalEvent() **********************************************/
+/** Crystal timer N has counted down to zero.               **/
+/*************************************************************/
+static void XtalEvent(int N)
+{
+  byte C = XTAL_CTRL(N);
+
+  /* Flag expiration, or repeated expiration before ack */
+  XTAL_CTRL(N) = C|(C&0x04? 0x08:0x04);
+  if(C&0x02) PORT_STATUS|=0x20<<N;
+
+  /* Looping timers reload the count, others stop */
+  if(C&0x01) EvLeft[EV_XTAL+N]+=XtalCycles(N,XTAL_COUNT(N));
+  else
+  {
+    XTAL_CTRL(N)     &= ~0x10;
+    EvLeft[EV_XTAL+N] = EV_NEVER;
+  }
+}
+
+/** SetupPages() *********************************************/
+/** Fill PageMap[]/RAMMap[] for a given calculator model.   **/
+/** Must be called again whenever RAM, ROM or their sizes   **/
+/** change.                                                 **/
+/*************************************************************/
+static void SetupPages(int Model)
+{
+  int J;
+
+  if(!((Model&ATI_MODEL)>=ATI_TI83P)||!RAMSize||!ROMSize) return;
+
+  for(J=0;J<256;++J)
+  {
+    PageMap[J] = (Model&ATI_MODEL)==ATI_TI83P? TI83PPage(J):TI84PPage(J);
+    /* TI83+ always has RAM page 0 at C000h */
+    RAMMap[J]  = (Model&ATI_MODEL)==ATI_TI83P? RAM:RAM+(((int)J<<14)&(RAMSize-1));
+  }
+}
+
+/** SetupPorts() *********************************************/
+/** Fill InPorts[]/OutPorts[] for a given calculator model. **/
+/*************************************************************/
+static void SetupPorts(int Model)
+{
+  int J;
+
+  for(J=0;J<256;++J) { InPorts[J]=InNone;OutPorts[J]=OutNone; }
 
-  /* Refresh keypad state, get [ON] key status */
-  ONKeyOn=Keypad()||StartupOn;
+  /* Keypad and control/status ports are the same everywhere */
+  InPorts[0x01]  = InKeypad;
+  OutPorts[0x01] = OutKeypad;
+  InPorts[0x03]  = InStatus;
+  OutPorts[0x03] = OutControl;
 
-  /* [ON] key is held at startup */
-  if(StartupOn) --StartupOn;
+  switch(Model&ATI_MODEL)
+  {
+    case ATI_TI85:
+      InPorts[0x00]  = InPort;      /* Video Buffer   */
+      InPorts[0x02]  = InPort;      /* LCD Contrast   */
+      InPorts[0x04]  = InPort;      /* LCD Control    */
+      InPorts[0x05]  = InPort;      /* ROM Page 4000h */
+      InPorts[0x06]  = InPort;      /* Power Register */
+      InPorts[0x07]  = InLink;      /* Link Register  */
+      OutPorts[0x00] = OutLCDBuf;
+      OutPorts[0x02] = OutContrast;
+      OutPorts[0x04] = OutLCDCtrl;
+      OutPorts[0x05] = OutPage85;
+      OutPorts[0x06] = OutPower;
+      OutPorts[0x07] = OutLink85;
+      break;
+
+    case ATI_TI86:
+      InPorts[0x00]  = InPort;      /* Video Buffer      */
+      InPorts[0x02]  = InPort;      /* LCD Contrast      */
+      InPorts[0x04]  = InPower;     /* Power Register    */
+      InPorts[0x05]  = InPort;      /* Memory Page 4000h */
+      InPorts[0x06]  = InPage2;     /* Memory Page 8000h */
+      InPorts[0x07]  = InLink;      /* Link Register     */
+      OutPorts[0x00] = OutLCDBuf;
+      OutPorts[0x02] = OutContrast;
+      OutPorts[0x04] = OutPower;
+      OutPorts[0x05] = OutPage86;
+      OutPorts[0x06] = OutPage86B;
+      OutPorts[0x07] = OutLink85;
+      break;
+
+    case ATI_TI82:
+      InPorts[0x00]  = InLink;      /* Link Register     */
+      InPorts[0x02]  = InPage;      /* Memory Page 4000h */
+      InPorts[0x10]  = InLCDStatus; /* LCD Status        */
+      InPorts[0x11]  = InLCDData;   /* VRAM              */
+      OutPorts[0x00] = OutLink85;
+      OutPorts[0x02] = OutPage85;
+      OutPorts[0x10] = OutLCDCmd;
+      OutPorts[0x11] = OutLCDData;
+      break;
+
+    case ATI_TI83:
+      InPorts[0x00]  = InLink83;    /* Link Register     */
+      InPorts[0x02]  = InPage;      /* Memory Page 4000h */
+      InPorts[0x04]  = InPort;      /* IRQ Control       */
+      InPorts[0x10]  = InLCDStatus; /* LCD Status        */
+      InPorts[0x11]  = InLCDData;   /* VRAM              */
+      InPorts[0x14]  = InOne;       /* ???               */
+      OutPorts[0x00] = OutLink83;
+      OutPorts[0x02] = OutPage83;
+      OutPorts[0x04] = OutPower83;
+      OutPorts[0x10] = OutLCDCmd;
+      OutPorts[0x11] = OutLCDData;
+      break;
+
+    case ATI_TI83P:
+    case ATI_TI83SE:
+    case ATI_TI84P:
+    case ATI_TI84SE:
+      InPorts[0x00]  = InLink83P;   /* Link Register     */
+      InPorts[0x04]  = InStatus;    /* Status ???        */
+      InPorts[0x06]  = InPage;      /* Memory Page #1    */
+      InPorts[0x07]  = InPage2;     /* Memory Page #2    */
+      InPorts[0x10]  = InLCDStatus; /* LCD Status        */
+      InPorts[0x11]  = InLCDData;   /* VRAM              */
+      InPorts[0x14]  = InFlash;     /* Flash Protection  */
+      OutPorts[0x00] = OutLink83P;
+      OutPorts[0x10] = OutLCDCmd;
+      OutPorts[0x11] = OutLCDData;
+      OutPorts[0x14] = OutFlash;
+
+      if((Model&ATI_MODEL)==ATI_TI83P)
+      {
+        InPorts[0x02]  = In83PHW;   /* Hardware Status   */
+        OutPorts[0x04] = OutPower83P;
+        OutPorts[0x05] = OutProtect83P;
+        OutPorts[0x06] = OutPage83P;
+        OutPorts[0x07] = OutPage83P2;
+        break;
+      }
+
+      InPorts[0x02]  = (Model&ATI_MODEL)==ATI_TI83SE? In83SEHW:In84PHW;
+      InPorts[0x05]  = InPage3;     /* Memory Page #3    */
+      InPorts[0x20]  = InSpeed;     /* CPU Speed         */
+      InPorts[0x21]  = (Model&ATI_MODEL)==ATI_TI84P? InZero:InOne;
+      OutPorts[0x20] = OutSpeed;
+
+      /* Link assist moves whole bytes */
+      InPorts[0x08]  = InLACtrl;
+      InPorts[0x09]  = InLAStatus;
+      InPorts[0x0A]  = InLAData;
+      OutPorts[0x08] = OutLACtrl;
+      OutPorts[0x0D] = OutLAData;
+
+      /* Three crystal timers at 30h..38h */
+      for(J=0x30;J<0x39;J+=3)
+      {
+        InPorts[J]    = InXtalFreq;
+        InPorts[J+1]  = InXtalCtrl;
+        InPorts[J+2]  = InXtalCount;
+        OutPorts[J]   = OutXtalFreq;
+        OutPorts[J+1] = OutXtalCtrl;
+        OutPorts[J+2] = OutXtalCount;
+      }
+      OutPorts[0x04] = OutPower84P;
+      OutPorts[0x05] = OutPage84P3;
+      OutPorts[0x06] = OutPage83P;  /* Same as on TI83+ */
+      OutPorts[0x07] = OutPage83P2;
+      break;
+  }
+}
+
+/** InZ80() **************************************************/
+/** Z80 emulation calls this function to read a byte from   **/
+/** a given I/O port.                                       **/
+/*************************************************************/
+byte InZ80(word Port)
+{
+#ifdef DEBUG
+  LOGD("READ from IO port %02Xh at PC=%04Xh\n",Port&0xFF,CPU.PC.W);
+#endif
+
+  return((*InPorts[Port&0xFF])(Port&0xFF));
+}
 
-  /* Screen updates 1/4 of the timer ticks */
-  ICount=(ICount+1)&3;
+/** OutZ80() *************************************************/
+/** Z80 emulation calls this function to write byte V to a  **/
+/** given I/O port.                                         **/
+/*************************************************************/
+void OutZ80(word Port,byte V)
+{
+#ifdef DEBUG
+  LOGE("WRITE %02Xh to IO port %02Xh at PC=%04Xh\n",V,Port&0xFF,CPU.PC.W);
+#endif
+
+  (*OutPorts[Port&0xFF])(Port&0xFF,V);
+}
+
+#ifdef BENCHMARK
+/** BenchWrite() *********************************************/
+/** WrZ80() RAM path without dirty tracking, for BenchDirty.**/
+/*************************************************************/
+static void __attribute__((noinline)) BenchWrite(word A,byte V)
+{
+  byte *P=Page[A>>14];
+
+  if((size_t)(P-RAM)<(size_t)RAMSize)
+  {
+    P+=A&0x3FFF;
+    if(((size_t)P-(size_t)VRAM<0x400)&&(*P!=V)) ++LCDGen;
+    *P=V;
+  }
+  else if(TI83P_FAMILY) FlashWrite(PageAt[A>>14]-ROM+(A&0x3FFF),V);
+}
 
-  /* Update status port */
-  PORT_STATUS = (ONKeyOn?               0x00:0x08)
-              | (TIMER_IRQ_ON?          0x04:0x00)
-              | (VIDEO_IRQ_ON?          0x02:0x00)
-              | (ONKEY_IRQ_ON&&ONKeyOn? 0x01:0x00);
+/** BenchDirty() *********************************************/
+/** Log the cost of dirty RAM tracking in WrZ80(), and of   **/
+/** full and incremental HashRAM() calls.                   **/
+/*************************************************************/
+void BenchDirty(void)
+{
+  byte *SavedPage[4],*SavedRAMPtr=RAM,*SavedVRAM=VRAM;
+  unsigned int SavedFilled=RAMFilled,H;
+  int SavedRAM=RAMSize;
+  long long T,T0;
+  int N;
+
+  if(!(RAM=(byte *)malloc(0x20000))) { RAM=SavedRAMPtr;return; }
+  memcpy(SavedPage,Page,sizeof(Page));
+  memset(RAM,0,0x20000);
+  RAMSize   = 0x20000;
+  RAMFilled = ~0;
+  VRAM      = 0;
+  Page[2]   = RAM;
+  Page[3]   = RAM+0x4000;
+
+  /* Scattered writes, like stack and variable accesses */
+  T0=BenchNS();
+  for(N=0;N<4000000;++N) BenchWrite(0x8000+((N*77)&0x7FFF),N);
+  T0=BenchNS()-T0;
+  T=BenchNS();
+  for(N=0;N<4000000;++N) WrZ80(0x8000+((N*77)&0x7FFF),N);
+  T=BenchNS()-T;
+  LOGD("WrZ80: %lldps/write untracked, %lldps/write tracked",T0/4000,T/4000);
+
+  /* Hash all of 128kB, then after a few writes */
+  T=BenchNS();
+  H=HashRAM();
+  T=BenchNS()-T;
+  for(N=0;N<100;++N) WrZ80(0x8000+N*97,N);
+  T0=BenchNS();
+  H^=HashRAM();
+  T0=BenchNS()-T0;
+  LOGD("HashRAM: %lldus full, %lldus after 100 writes (%08X)",T/1000,T0/1000,H);
+
+  free(RAM);
+  memcpy(Page,SavedPage,sizeof(Page));
+  RAM=SavedRAMPtr;
+  VRAM=SavedVRAM;
+  RAMFilled=SavedFilled;
+  RAMSize=SavedRAM;
+  DirtyRAM(0,RAMSize);
+}
+
+/** BenchPorts() *********************************************/
+/** Time the I/O ports TI-OS uses most, for every model,   **/
+/** and bank switching on TI83+ family. Leaves ports and    **/
+/** pages set up for the current model.                     **/
+/*************************************************************/
+void BenchPorts(void)
+{
+  byte Saved[sizeof(Ports)],*SavedPage[4];
+  byte *SavedRAMPtr=RAM,*SavedROMPtr=ROM;
+  unsigned int SavedFilled=RAMFilled;
+  int SavedRAM=RAMSize,SavedROM=ROMSize;
+  long long T;
+  int J,M,N;
+  byte V;
+
+  memcpy(Saved,Ports,sizeof(Ports));
+  memcpy(SavedPage,Page,sizeof(Page));
+
+  for(M=0;Config[M].ROMSize;++M)
+  {
+    SetupPorts(Config[M].Model);
+    T=BenchNS();
+    for(N=V=0;N<1000000;++N)
+    {
+      OutZ80(0x01,0xFE);
+      V+=InZ80(0x01);
+      V+=InZ80(0x03);
+      V+=InZ80(0x10);
+    }
+    T=BenchNS()-T;
+    LOGD("%s ports: %lldns/access (%02X)",Config[M].ROMFile,T/4000000,V);
 
-  /* Refresh display 1/4 of the time */
-  if(UCount>=400) { UCount-=400;RefreshScreen(); }
-  UCount+=UPeriod;
+    /* Flash apps and bcalls switch pages at 4000h/8000h a lot */
+    if((Config[M].Model>=ATI_TI83P)&&(RAM=(byte *)malloc(Config[M].RAMSize)))
+    {
+      RAMSize=Config[M].RAMSize;
+      ROMSize=Config[M].ROMSize;
+      RAMFilled=~0;
+      SetupPages(Config[M].Model);
+      T=BenchNS();
+      for(N=0;N<1000000;++N)
+      {
+        OutZ80(0x06,N);
+        OutZ80(0x07,N>>3);
+        OutZ80(0x05,N>>5);
+      }
+      T=BenchNS()-T;
+      LOGD("%s page switch: %lldns/OUT",Config[M].ROMFile,T/3000000);
+      free(RAM);
+    }
+  }
+
+  memcpy(Ports,Saved,sizeof(Ports));
+  memcpy(Page,SavedPage,sizeof(Page));
+  RAM=SavedRAMPtr;
+  ROM=SavedROMPtr;
+  RAMFilled=SavedFilled;
+  RAMSize=SavedRAM;
+  ROMSize=SavedROM;
+  SetupPorts(Mode);
+  SetupPages(Mode);
+}
+#endif
+
+/** LoopZ80() ************************************************/
+/** Z80 emulation calls this function periodically to check **/
+/** if the system hardware requires any interrupts.         **/
+/*************************************************************/
+word LoopZ80(Z80 *R)
+{
+  static int  UCount=0;
+  static byte ICount=0;
+  static byte SCount=0;
+  int J;
+
+  /* Rebase events to the end of elapsed period */
+  for(J=0;J<EV_COUNT;++J)
+    if(EvLeft[J]!=EV_NEVER) EvLeft[J]-=EvPeriod;
+  EvTime+=EvPeriod*(LINK_HZ/CPUClock);
+  EvPeriod=0;
+
+  if(EvLeft[EV_TICK]<=0)
+  {
+    EvLeft[EV_TICK]+=TIMER_CLK;
+
+    /* When calculator turned off, exit */
+    if(!StartupOn&&SLEEP_ON&&(R->IFF&IFF_HALT)) ExitNow=1;
+
+    /* Refresh keypad state, get [ON] key status */
+    ONKeyOn=Keypad()||StartupOn;
+
+    /* [ON] key is held at startup */
+    if(StartupOn) --StartupOn;
+
+    /* Snapshot the OS once it idles after a cold boot */
+    if(BootIdle>=0) WatchBoot(R);
+
+    /* Screen updates 1/4 of the timer ticks */
+    ICount=(ICount+1)&3;
+
+    /* Update [ON] key status */
+    PORT_STATUS = (PORT_STATUS&0xF6)
+                | (ONKeyOn?               0x00:0x08)
+                | (ONKEY_IRQ_ON&&ONKeyOn? 0x01:0x00);
+
+    /* Sample display for grayscale blending, if requested */
+    if(SPeriod&&(++SCount>=SPeriod)) { SCount=0;SampleScreen(); }
+
+    /* Refresh display 1/4 of the time */
+    if(UCount>=400) { UCount-=400;RefreshScreen(); }
+    UCount+=UPeriod;
+
+    /* Start syncing with link peer once connected */
+    if(LinkTick()&&(EvLeft[EV_LINK]==EV_NEVER)) EvLeft[EV_LINK]=0;
+  }
+
+  /* Link cable sync, only scheduled while connected */
+  if(EvLeft[EV_LINK]<=0)
+  {
+    J=LinkSync(LinkNow());
+    EvLeft[EV_LINK]=J? EvLeft[EV_LINK]+J/(LINK_HZ/CPUClock):EV_NEVER;
+    if(LINKASSIST_ON) LinkAssist();
+  }
+
+  /* Hardware timer interrupts stay latched until port 3   */
+  /* acknowledges them on TI83+ family, older models follow */
+  /* port 3 enable bits on every tick                       */
+  if(EvLeft[EV_TIMER]<=0)
+  {
+    EvLeft[EV_TIMER]+=TimerPeriod();
+    if(!TI83P_FAMILY) PORT_STATUS&=~0x06;
+    PORT_STATUS|= (TIMER_IRQ_ON? 0x04:0x00)
+                | (VIDEO_IRQ_ON? 0x02:0x00);
+  }
+
+  /* Crystal timers, only scheduled while running */
+  for(J=0;J<3;++J)
+    while(EvLeft[EV_XTAL+J]<=0) XtalEvent(J);
+
+  /* Run until the nearest event */
+  EvPeriod=NextEvent();
+  R->IPeriod=EvPeriod;
 
   /* Return any pending interrupts */
-  return(ExitNow? INT_QUIT:(PORT_STATUS&0x07)? INT_IRQ:INT_NONE);
+  return(ExitNow? INT_QUIT:(PORT_STATUS&0xF7)? INT_IRQ:INT_NONE);
 }
 
 /** TI8*Colors() *********************************************/
@@ -854,6 +1789,7 @@ word LoopZ80(Z80 *R)
 /*************************************************************/
 void TI85Colors(register byte V)
 {
+  ++LCDGen;
   V = 0x7C-((V&0x1F)<<2);
   SetColor(1,V,V,V+0x20);
   V = 0xFF-V;
@@ -862,6 +1798,7 @@ void TI85Colors(register byte V)
 
 void TI83Colors(register byte V)
 {
+  ++LCDGen;
   V = 0x7F-((V&0x3F)<<1);
   SetColor(1,V,V,V+0x20);
   V = 0xFF-V;
@@ -892,10 +1829,10 @@ byte *TI84PPage(register byte PortValue)
 /*************************************************************/
 void TI85Mapper(register byte Port5)
 {
-  Page[0] = ROM;
-  Page[1] = ROM+((int)(Port5&0x07)<<14);
-  Page[2] = RAM;
-  Page[3] = RAM+0x4000;
+  MapPage(0,ROM);
+  MapPage(1,ROM+((int)(Port5&0x07)<<14));
+  MapPage(2,RAM);
+  MapPage(3,RAM+0x4000);
 }
 
 /** TI86Mapper() *********************************************/
@@ -904,14 +1841,14 @@ void TI85Mapper(register byte Port5)
 void TI86Mapper(register byte Port5,register byte Port6)
 {
   /* TI86 allows either ROM or RAM at 4000h and 8000h */
-  Page[0] = ROM;
-  Page[1] = Port5&0x40?
+  MapPage(0,ROM);
+  MapPage(1,Port5&0x40?
     RAM+((int)(Port5&0x07)<<14)
-  : ROM+((int)(Port5&0x0F)<<14);
-  Page[2] = Port6&0x40?
+  : ROM+((int)(Port5&0x0F)<<14));
+  MapPage(2,Port6&0x40?
     RAM+((int)(Port6&0x07)<<14)
-  : ROM+((int)(Port6&0x0F)<<14);
-  Page[3] = RAM;
+  : ROM+((int)(Port6&0x0F)<<14));
+  MapPage(3,RAM);
 }
 
 /** TI83Mapper() *********************************************/
@@ -929,30 +1866,30 @@ void TI83Mapper(register byte Port0,register byte Port2,register byte Port4)
   /* Set up pages at 4000h,8000h,C000h */
   if(!(Port4&0x01))
   {
-    Page[0] = ROM;
-    Page[1] = SwapPage;
-    Page[2] = Port2&0x80? RAM+((int)(Port2&0x08)<<11)
+    MapPage(0,ROM);
+    MapPage(1,SwapPage);
+    MapPage(2,Port2&0x80? RAM+((int)(Port2&0x08)<<11)
             : Port0&0x10? ROM+0x20000
-            : ROM+((int)(Port2&0x08)<<11);
-    Page[3] = RAM;
+            : ROM+((int)(Port2&0x08)<<11));
+    MapPage(3,RAM);
   }
   else if(Port2&0x40)
   {
-    Page[0] = ROM;
-    Page[1] = RAM;
-    Page[2] = RAM+0x4000;
-    Page[3] = Port2&0x80?
+    MapPage(0,ROM);
+    MapPage(1,RAM);
+    MapPage(2,RAM+0x4000);
+    MapPage(3,Port2&0x80?
               RAM+((int)(Port2&0x08)<<11)
-            : ROM+((int)(Port2&0x08)<<11)+((int)(Port0&0x10)<<13);
+            : ROM+((int)(Port2&0x08)<<11)+((int)(Port0&0x10)<<13));
   }
   else
   {
-    Page[0] = ROM;
-    Page[1] = ROM+((int)(Port0&0x10)<<13);
-    Page[2] = SwapPage;
-    Page[3] = Port2&0x80?
+    MapPage(0,ROM);
+    MapPage(1,ROM+((int)(Port0&0x10)<<13));
+    MapPage(2,SwapPage);
+    MapPage(3,Port2&0x80?
               RAM+((int)(Port2&0x08)<<11)
-            : ROM+((int)(Port2&0x08)<<11)+((int)(Port0&0x10)<<13);
+            : ROM+((int)(Port2&0x08)<<11)+((int)(Port0&0x10)<<13));
   }
 }
 
@@ -964,17 +1901,17 @@ void TI83PMapper(register byte Port4,register byte Port6,register byte Port7)
   /* Depending on the memory map selection... */
   if(Port4&0x01)
   {
-    Page[0] = ROM;
-    Page[1] = RAM;
-    Page[2] = TI83PPage(Port6);
-    Page[3] = TI83PPage(Port7);
+    MapPage(0,ROM);
+    MapPage(1,RAM);
+    MapPage(2,PageMap[Port6]);
+    MapPage(3,PageMap[Port7]);
   }
   else
   {
-    Page[0] = ROM;
-    Page[1] = TI83PPage(Port6);
-    Page[2] = TI83PPage(Port7);
-    Page[3] = RAM;
+    MapPage(0,ROM);
+    MapPage(1,PageMap[Port6]);
+    MapPage(2,PageMap[Port7]);
+    MapPage(3,RAM);
   }
 }
 
@@ -986,25 +1923,117 @@ void TI84PMapper(register byte Port4,register byte Port6,register byte Port7,reg
   /* Depending on the memory map selection... */
   if(Port4&0x01)
   {
-    Page[0] = ROM;
-    Page[1] = RAM;
-    Page[2] = TI84PPage(Port6);
-    Page[3] = TI84PPage(Port7);
+    MapPage(0,ROM);
+    MapPage(1,RAM);
+    MapPage(2,PageMap[Port6]);
+    MapPage(3,PageMap[Port7]);
   }
   else
   {
-    Page[0] = ROM;
-    Page[1] = TI84PPage(Port6);
-    Page[2] = TI84PPage(Port7);
-    Page[3] = RAM+(((int)Port5<<14)&(RAMSize-1));
+    MapPage(0,ROM);
+    MapPage(1,PageMap[Port6]);
+    MapPage(2,PageMap[Port7]);
+    MapPage(3,RAMMap[Port5]);
   }
 }
 
+/** Flash chip commands **************************************/
+/** TI83+ family flash chips take AMD-style command cycles: **/
+/**   AAh@AAAh 55h@555h A0h@AAAh Data@Addr       - program  **/
+/**   AAh@AAAh 55h@555h 80h@AAAh AAh@AAAh 55h@555h 30h@Sect **/
+/**                                         - sector erase  **/
+/**   ...same as above, but 10h@AAAh        - chip erase    **/
+/** F0h anywhere resets the sequence. Operations complete   **/
+/** at once, so status polls just read back final data.     **/
+/*************************************************************/
+/** FlashSector() ********************************************/
+/** Find flash sector containing chip address A. Sectors    **/
+/** are 64kB, except the top 64kB split into 32kB, 8kB,     **/
+/** 8kB and 16kB (boot) sectors.                            **/
+/*************************************************************/
+static int FlashSector(int A,int *Size)
+{
+  int Top=ROMSize-0x10000;
+
+  if(A<Top)          { *Size=0x10000;return(A&~0xFFFF); }
+  if(A<Top+0x8000)   { *Size=0x8000;return(Top); }
+  if(A<Top+0xA000)   { *Size=0x2000;return(Top+0x8000); }
+  if(A<Top+0xC000)   { *Size=0x2000;return(Top+0xA000); }
+  *Size=FLASH_BOOT;
+  return(Top+0xC000);
+}
+
+/** FlashWrite() *********************************************/
+/** Feed a write to chip address A into the flash command   **/
+/** state machine. Writes are ignored while port 14h keeps  **/
+/** the flash locked, and never touch the boot sector.      **/
+/*************************************************************/
+void FlashWrite(int A,byte V)
+{
+  int Start,Size;
+  byte *P;
+
+  if((A<0)||(A>=ROMSize)) return;
+  if(!(PORT_FLASH&0x01)) { FlashStep=0;return; }
+
+  /* Reset command works in any state */
+  if(V==0xF0) { FlashStep=0;return; }
+
+  switch(FlashStep)
+  {
+    case 0: /* Unlock cycle 1 */
+    case 3: /* Erase unlock cycle 1 */
+      FlashStep = (V==0xAA)&&((A&0xFFF)==0xAAA)? FlashStep+1:0;
+      return;
+
+    case 1: /* Unlock cycle 2 */
+    case 4: /* Erase unlock cycle 2 */
+      FlashStep = (V==0x55)&&((A&0xFFF)==0x555)? FlashStep+1:0;
+      return;
+
+    case 2: /* Command */
+      FlashStep = (A&0xFFF)!=0xAAA? 0:V==0xA0? 6:V==0x80? 3:0;
+      return;
+
+    case 5: /* Erase command */
+      FlashStep=0;
+      if(V==0x30)
+      {
+        Start=FlashSector(A,&Size);
+        if(Start<ROMSize-FLASH_BOOT)
+        { FlashKeep(Start,Size);FillROM(Start,Size); }
+      }
+      else if((V==0x10)&&((A&0xFFF)==0xAAA))
+      { FlashKeep(0,ROMSize-FLASH_BOOT);FillROM(0,ROMSize-FLASH_BOOT); }
+      if(Verbose&0x02) LOGD("Flash erase %02Xh at %06Xh",V,A);
+      return;
+
+    case 6: /* Program: flash bits can only go from 1 to 0 */
+      FlashStep=0;
+      if(A>=ROMSize-FLASH_BOOT) return;
+      P=ROMPage(A>>14)+(A&0x3FFF);
+      if(((*P&V)!=*P)&&(P=WritePage(A>>14))) { FlashKeep(A,1);P[A&0x3FFF]&=V; }
+      return;
+  }
+
+  FlashStep=0;
+}
+
+/** UpdateVRAM() *********************************************/
+/** Locate TI85/TI86 screen buffer for WrZ80() to watch.    **/
+/*************************************************************/
+void UpdateVRAM(void)
+{
+  VRAM = TI85_FAMILY? SCREEN_BUFFER:0;
+  ++LCDGen;
+}
+
 /** TI83LCDReset() *******************************************/
 /** Reset TI83 LCD controller.                              **/
 /*************************************************************/
 void TI83LCDReset(void)
 {
+  ++LCDGen;
   memset(LCD.Buffer,0x00,sizeof(LCD.Buffer));
   LCD.Status   = 0x00;
   LCD.Row      = 0;
@@ -1061,13 +2090,17 @@ byte TI83LCDDataRD(void)
 /*************************************************************/
 void TI83LCDDataWR(register byte V)
 {
-  byte W,J,*P;
+  byte W,J,*P,Old;
  
   /* Write a byte */
   if(LCD.Status&TI83LCD_8BIT)
   {
     W = 14;
-    if(LCD.Col<=W) LCD.Buffer[LCD.Row*16+LCD.Col]=V;
+    if(LCD.Col<=W)
+    {
+      P = LCD.Buffer+LCD.Row*16+LCD.Col;
+      if(*P!=V) { *P=V;++LCDGen; }
+    }
   }
   else
   {
@@ -1077,12 +2110,16 @@ void TI83LCDDataWR(register byte V)
       J    = LCD.Col*6;
       P    = LCD.Buffer+LCD.Row*16+(J>>3);
       J   &= 0x07;
+      Old  = P[0];
       P[0] = (P[0] & ~(0xFC>>J)) | ((V<<2)>>J);
+      if(P[0]!=Old) ++LCDGen;
 
       if(J)
       {
         J    = 8-J;
+        Old  = P[1];
         P[1] = (P[1] & ~(0xFC<<J)) | ((V<<2)<<J);
+        if(P[1]!=Old) ++LCDGen;
       }
     }
   }
@@ -1122,8 +2159,8 @@ void TI83LCDCtrl(register byte V)
   {
     case 0: LCD.Status&=~TI83LCD_8BIT;break;
     case 1: LCD.Status|=TI83LCD_8BIT;break;
-    case 2: LCD.Status&=~TI83LCD_ON;break;
-    case 3: LCD.Status|=TI83LCD_ON;break;
+    case 2: LCD.Status&=~TI83LCD_ON;++LCDGen;break;
+    case 3: LCD.Status|=TI83LCD_ON;++LCDGen;break;
     case 4:
     case 5:
     case 6:
@@ -1131,33 +2168,4 @@ void TI83LCDCtrl(register byte V)
   }
 }
 
-/** SIOExchange() ********************************************/
-/** Exchange signals with the other end of the link.        **/
-/*************************************************************/
-byte SIOExchange(byte Vout)
-{
-  return(0x03);
-#if 0
-  static byte MakeConnection = 1;
-  byte Vin;
-
-  /* Make connection when calling this function for the first time */
-  if(MakeConnection)
-  {
-    MakeConnection=0;
-    if(LinkPeer)
-    {
-      if(Verbose) LOGE("Connecting to %s:%d...",LinkPeer,LinkPort);
-      fflush(stdout);
-      Vin=NETConnect(LinkPeer,LinkPort);
-      if(Verbose) LOGE("%s\n",Vin? "OK":"FAILED");
-    } 
-  }
 
-  /* Make sure other end only receives two bits */
-  Vout&=0x03;
-
-  /* Try exchanging signals with the other end */
-  return(NETExchange(&Vin,&Vout,1)? Vin:0x03);  
-#endif //0
-}
@@ -21,8 +21,9 @@
                                /* non-existing addresses     */
 
 #define CPU_CLOCK 6000000         /* TI85 Z80 CPU clock (Hz) */
-#define VIDEO_CLK (CPU_CLOCK/50)  /* Screen refresh period   */
-#define TIMER_CLK (CPU_CLOCK/200) /* Time clock period       */
+#define CPU_FAST  15000000        /* TI83+SE/84+ fast clock  */
+#define VIDEO_CLK (CPUClock/50)   /* Screen refresh period   */
+#define TIMER_CLK (CPUClock/200)  /* Time clock period       */
 
 /** Mode Bits ************************************************/
 #define ATI_MODEL   0xFF00        /* Calculator model        */
@@ -52,12 +53,21 @@
 #define PORT_ROMPAGE2 Ports[8]   /* xMxxPPPP in TI86         */
 #define PORT_STATUS   Ports[15]  /* 0000KTLO                 */
 #define PORT_ROMPAGE3 Ports[16]  /* xxxxxPPP in TI83+SE      */
+#define PORT_FLASH    Ports[17]  /* 0000000U flash unlocked  */
+#define PORT_SPEED    Ports[18]  /* 000000SS CPU speed       */
+#define XTAL_FREQ(N)  Ports[19+3*(N)] /* Crystal timer clock */
+#define XTAL_CTRL(N)  Ports[20+3*(N)] /* 000ROXIL timer ctrl  */
+#define XTAL_COUNT(N) Ports[21+3*(N)] /* Crystal timer count */
+#define PORT_LACTRL   Ports[29]  /* D0000EXR link assist ctrl*/
+#define PORT_LASTAT   Ports[30]  /* SEXTRYXR link assist stat*/
+#define PORT_LADATA   Ports[31]  /* Link assist received byte*/
 
 #define TIMER_IRQ_ON  (PORT_CONTROL&0x04)  /* Timer IRQ on   */
 #define VIDEO_IRQ_ON  (PORT_CONTROL&0x02)  /* Video IRQ on   */
 #define ONKEY_IRQ_ON  (PORT_CONTROL&0x01)  /* ON key IRQ on  */
 #define LCD_ON        (PORT_CONTROL&0x08)  /* LCD display on */
 #define SLEEP_ON      ((PORT_CONTROL&0x0F)==0x01)
+#define LINKASSIST_ON (((Mode&ATI_MODEL)>ATI_TI83P)&&!(PORT_LACTRL&0x80))
 
 #define SCREEN_BUFFER (Page[3]+((int)(PORT_LCDBUF&0x3F)<<8))
 
@@ -150,14 +160,21 @@ typedef struct
 extern int  Mode;              /* Operating mode bits        */
 extern byte Verbose;           /* Debugging messages ON/OFF  */
 extern byte UPeriod;           /* Interrupts / Screen update */
+extern byte SPeriod;           /* Interrupts / Screen sample */
+                               /* (0: no SampleScreen calls) */
+extern byte LowMemory;         /* 1: Keep ROM packed in RAM  */
 extern char *RAMFile;          /* Default state file name    */
 /*************************************************************/
 
 extern Z80 CPU;                /* CPU registers and state    */
+extern int CPUClock;           /* Current CPU clock (Hz)     */
 extern byte *Page[4];          /* 4x16kB address space       */
 extern byte *ROM,*RAM;         /* RAM and ROM buffers        */
 extern byte Ports[32];         /* I/O ports                  */
 extern TI83LCD LCD;            /* TI82/83/84 LCD controller  */
+extern unsigned int LCDGen;    /* Bumped on LCD image change */
+extern unsigned int RAMDirty[];/* DirtyGen at last RAM write */
+extern unsigned int DirtyGen;  /* Current RAM write mark     */
 extern byte ExitNow;           /* 1: Exit the emulator       */
 extern byte KbdStatus[8];      /* Keyboard matrix status     */
 extern const byte Keys[][2];   /* KBD_* to row/column map    */
@@ -168,6 +185,41 @@ extern const TIConfig Config[];/* Config parameters by model */
 extern char RAMPath[256];      /* RAM file name buffer       */
 extern char ROMPath[256];      /* ROM file name buffer       */
 
+/** Shared by TI85.c, Pack.c, State.c, and Slots.c ***********/
+#define FLASH_BOOT 0x4000      /* Locked 16kB flash boot page*/
+extern int  RAMSize,ROMSize;   /* RAM/ROM sizes, in bytes    */
+extern byte StartupOn;         /* [ON] key counter on startup*/
+extern byte FlashStep;         /* Flash command cycles so far*/
+extern char FlashPath[264];    /* Writable flash image file  */
+extern int  ROMMapSize;        /* Bytes mapped at ROM, or 0  */
+extern byte ROMShared;         /* 1: ROM is MAP_SHARED flash */
+extern byte *PageAt[4];        /* ROM/RAM address in Page[]  */
+extern unsigned int RAMFilled; /* 16kB RAM pages with NORAM  */
+/*************************************************************/
+
+/** RAMName() ************************************************/
+/** Make a file name from RAMPath, replacing its extension  **/
+/** with Ext (.FLASH, .BOOT). Returns 0 if there is no      **/
+/** RAMPath.                                                **/
+/*************************************************************/
+int RAMName(char *Name,const char *Ext);
+
+/** ResidentKB() *********************************************/
+/** Return resident memory of this process, in kB.          **/
+/*************************************************************/
+int ResidentKB(void);
+
+/** KeptROM() ************************************************/
+/** Return 1 if ROM image mapped at P for Config[M] is kept **/
+/** in ROMMaps[], 0 if it is gone.                          **/
+/*************************************************************/
+int KeptROM(const byte *P,int M);
+
+/** StateLoaded() ********************************************/
+/** Bring the rest of hardware in line with loaded state.   **/
+/*************************************************************/
+void StateLoaded(void);
+
 /** StartTI85() **********************************************/
 /** Allocate memory, load ROM image, initialize hardware,   **/
 /** CPU and start the emulation. This function returns 0 in **/
@@ -186,16 +238,127 @@ void TrashTI85(void);
 /*************************************************************/
 int ResetTI85(int NewMode);
 
+/** Dirty RAM tracking ***************************************/
+/** Each 256-byte RAM block remembers the DirtyGen value of **/
+/** its last write. DirtyMark() returns a mark and bumps    **/
+/** DirtyGen, so later writes are seen by DirtySince().     **/
+/*************************************************************/
+#define DIRTY_SHIFT  8                      /* 256-byte blocks */
+#define DIRTY_BLOCKS (0x20000>>DIRTY_SHIFT) /* 128kB RAM max   */
+#define DIRTY_WRITE(Offset) RAMDirty[(Offset)>>DIRTY_SHIFT]=DirtyGen
+
+/** DirtyMark() **********************************************/
+/** Return a mark to check RAM changes against later, with  **/
+/** DirtySince().                                           **/
+/*************************************************************/
+unsigned int DirtyMark(void);
+
+/** DirtySince() *********************************************/
+/** Return 1 if any of N RAM bytes at offset A have been    **/
+/** written since DirtyMark() returned Mark.                **/
+/*************************************************************/
+int DirtySince(unsigned int Mark,int A,int N);
+
+/** DirtyRAM() ***********************************************/
+/** Mark N RAM bytes at offset A as written. Call it after  **/
+/** changing RAM other than through WrZ80().                **/
+/*************************************************************/
+void DirtyRAM(int A,int N);
+
+/** HashRAM() ************************************************/
+/** Return a hash of used RAM, rehashing only blocks that   **/
+/** changed since the last call.                            **/
+/*************************************************************/
+unsigned int HashRAM(void);
+
+#ifdef BENCHMARK
+/** BenchDirty() *********************************************/
+/** Log the cost of dirty RAM tracking in WrZ80().          **/
+/*************************************************************/
+void BenchDirty(void);
+
+/** BenchPorts() *********************************************/
+/** Log the time taken by frequently used I/O ports.        **/
+/*************************************************************/
+void BenchPorts(void);
+#endif
+
 /** SaveSTA() ************************************************/
 /** Save emulation state to a .STA file.                    **/
 /*************************************************************/
 int SaveSTA(const char *FileName);
 
+/** SnapSTA() ************************************************/
+/** Take a state snapshot and save it to a .STA file in the **/
+/** background. Returns 0 if the snapshot failed. Check     **/
+/** completion with PollSTA().                              **/
+/*************************************************************/
+int SnapSTA(const char *FileName);
+
+/** PollSTA() ************************************************/
+/** Return -1 while SnapSTA() is still saving, else 1 if    **/
+/** the last save succeeded, 0 if it failed. With Wait=1,   **/
+/** wait for saving to finish.                              **/
+/*************************************************************/
+int PollSTA(int Wait);
+
 /** LoadSTA() ************************************************/
 /** Load emulation state from a .STA file.                  **/
 /*************************************************************/
 int LoadSTA(const char *FileName);
 
+/** ResetRAM() ***********************************************/
+/** Clear calculator RAM and restart, restoring the boot    **/
+/** snapshot if there is one. Returns 1 if it was restored, **/
+/** 0 if the OS boots from scratch.                         **/
+/*************************************************************/
+int ResetRAM(void);
+
+/** InfoSTA() ************************************************/
+/** Read model and screen thumbnail (16 bytes per line, 64  **/
+/** lines) from a .STA file without loading it. Returns the **/
+/** thumbnail width or 0 on failure.                        **/
+/*************************************************************/
+int InfoSTA(const char *FileName,int *Model,byte *Thumb);
+
+/** LoadVAR() ************************************************/
+/** Load variables from a TI variable file into calculator  **/
+/** RAM. Returns number of variables loaded, 0 on failure.  **/
+/*************************************************************/
+int LoadVAR(const char *FileName);
+
+/** SaveSlot() ***********************************************/
+/** Copy emulation state into in-memory slot N, only RAM    **/
+/** pages written since the last copy. If Persist=1, also   **/
+/** save it to a file in the background. Returns 1 on       **/
+/** success, 0 on failure.                                  **/
+/*************************************************************/
+int SaveSlot(int N,int Persist);
+
+/** LoadSlot() ***********************************************/
+/** Restore emulation state from slot N, or from its file   **/
+/** if the slot is empty. Returns 1 on success, 0 on        **/
+/** failure.                                                **/
+/*************************************************************/
+int LoadSlot(int N);
+
+#define ROM_VERSION 16         /* Max OS version length + 1  */
+
+/** IdentROM() ***********************************************/
+/** Identify a ROM image file by its contents. Returns one  **/
+/** of ATI_* models, or -1 if it is not a ROM. Hash, if not **/
+/** 0, gets contents hash. Version, if not 0, gets the OS   **/
+/** version, or "" if unknown, and must have ROM_VERSION    **/
+/** bytes. Safe to call from any thread.                    **/
+/*************************************************************/
+int IdentROM(const char *FileName,unsigned int *Hash,char *Version);
+
+/** ROMCache() ***********************************************/
+/** Keep IdentROM() results in a file, so they survive      **/
+/** restarts. Loads results saved there before.             **/
+/*************************************************************/
+void ROMCache(const char *FileName);
+
 /** InitMachine() ********************************************/
 /** Allocate resources needed by the machine-dependent code.**/
 /************************************ TO BE WRITTEN BY USER **/
@@ -211,6 +374,12 @@ void TrashMachine(void);
 /************************************ TO BE WRITTEN BY USER **/
 void RefreshScreen(void);
 
+/** SampleScreen() *******************************************/
+/** Take a snapshot of the LCD between screen refreshes,    **/
+/** every SPeriod interrupts. Used for grayscale blending.  **/
+/************************************ TO BE WRITTEN BY USER **/
+void SampleScreen(void);
+
 /** SetColor() ***********************************************/
 /** Set color N (0/1) to (R,G,B).                           **/
 /************************************ TO BE WRITTEN BY USER **/
@@ -0,0 +1,402 @@
+/** AlmostTI: portable TI calcs emulator *********************/
+/**                                                         **/
+/**                          Vars.c                         **/
+/**                                                         **/
+/** This file contains the loader putting TI83+ family     **/
+/** variable files (.8xp, .8xv, ...) straight into          **/
+/** calculator RAM, the way the OS would after receiving    **/
+/** them over a link. Other models are refused.             **/
+/**                                                         **/
+/*************************************************************/
+#include "TI85.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <android/log.h>
+#define LOG_TAG "Vars"
+#define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
+#define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+#define VAR_MAXFILE 0x40000    /* Largest variable file      */
+#define VAR_HEADER  55         /* Signature, comment, length */
+#define VAR_SLACK   64         /* Free RAM left to the OS    */
+
+/** Variable types *******************************************/
+#define VT_REAL     0x00
+#define VT_LIST     0x01
+#define VT_MATRIX   0x02
+#define VT_CPLX     0x0C
+#define VT_CLIST    0x0D
+#define VT_PROG     0x05
+#define VT_PROTPROG 0x06
+#define VT_APPVAR   0x15
+#define VT_GROUP    0x17
+
+/** VATLayout ************************************************/
+/** OS system pointers locating user memory and the         **/
+/** Variable Allocation Table, by model.                    **/
+/*************************************************************/
+typedef struct
+{
+  int  Model;                  /* ATI_* model                */
+  const char *Signature;       /* Variable file sig, 0 ends  */
+  word TempMem;                /* End of user variable data  */
+  word FPBase;                 /* Floating point stack start */
+  word FPS;                    /* Floating point stack top   */
+  word OPBase;                 /* Operator stack start       */
+  word OPS;                    /* Operator stack top         */
+  word PTemp;                  /* End of program VAT         */
+  word ProgPtr;                /* End of variable VAT        */
+  word NewDataPtr;             /* Next data in user memory   */
+  word SymTable;               /* Start of VAT               */
+} VATLayout;
+
+/* TI83+SE and TI84+ share the TI83+ layout. TI82 and TI85   */
+/* system addresses change between ROM versions, TI85/TI86   */
+/* VATs use other entry formats and the TI86 one sits in a   */
+/* paged RAM bank. Guessing at those would corrupt user RAM, */
+/* so TI82/83/85/86 are left out until they can be checked   */
+/* against real ROMs.                                        */
+static const VATLayout Layouts[] =
+{
+  { ATI_TI83P,"**TI83F*",0x9820,0x9822,0x9824,0x9826,0x9828,0x982E,0x9830,0x9832,0xFE66 },
+  { 0,0 }
+};
+
+static const VATLayout *L;     /* Layout of current model    */
+static byte Junk;              /* Stands in for non-RAM bytes*/
+static int  BadAddr;           /* 1: went outside RAM        */
+
+/** Addr() ***************************************************/
+/** Return RAM byte at address A, as the OS maps it: RAM    **/
+/** page 1 at 8000h, RAM page 0 at C000h. Addresses below   **/
+/** 8000h are not RAM, they set BadAddr and go to Junk.     **/
+/*************************************************************/
+static byte *Addr(word A)
+{
+  if(A<0x8000) { BadAddr=1;return(&Junk); }
+  return(RAM+(A>=0xC000? A-0xC000:A-0x8000+0x4000));
+}
+
+static byte Rd(word A)         { return(*Addr(A)); }
+static void Wr(word A,byte V)  { byte *P=Addr(A);*P=V;if(P!=&Junk) DIRTY_WRITE(P-RAM); }
+static word RdW(word A)        { return(Rd(A)+((word)Rd(A+1)<<8)); }
+static void WrW(word A,word V) { Wr(A,V&0xFF);Wr(A+1,V>>8); }
+static void AddW(word A,int N) { WrW(A,RdW(A)+N); }
+
+/** CheckVAT() ***********************************************/
+/** Return 1 if OS pointers are all in RAM and in the order **/
+/** the OS keeps them, 0 if not, as happens while booting   **/
+/** or right after a RAM reset.                             **/
+/*************************************************************/
+static int CheckVAT(void)
+{
+  word P[8];
+  int J;
+
+  P[0] = RdW(L->TempMem);
+  P[1] = RdW(L->FPBase);
+  P[2] = RdW(L->FPS);
+  P[3] = RdW(L->OPS);
+  P[4] = RdW(L->OPBase);
+  P[5] = RdW(L->PTemp);
+  P[6] = RdW(L->ProgPtr);
+  P[7] = L->SymTable;
+
+  /* User memory, FP stack, operator stack, temp and user VAT */
+  if(RdW(L->NewDataPtr)<0x8000) return(0);
+  for(J=0;J<8;++J)
+    if((P[J]<0x8000)||(J&&(P[J]<P[J-1]))) return(0);
+  return(1);
+}
+
+/** Move() ***************************************************/
+/** Move N bytes from Src to Dst, which may overlap. RAM is **/
+/** not contiguous in address space, so go byte by byte.    **/
+/*************************************************************/
+static void Move(word Dst,word Src,int N)
+{
+  int J;
+
+  if(Dst<Src) for(J=0;J<N;++J)    Wr(Dst+J,Rd(Src+J));
+  else        for(J=N-1;J>=0;--J) Wr(Dst+J,Rd(Src+J));
+}
+
+/** IsNamed() ************************************************/
+/** Programs, appvars, and groups have variable length      **/
+/** names. Others have 3-byte token names.                  **/
+/*************************************************************/
+static int IsNamed(byte Type)
+{
+  Type&=0x1F;
+  return((Type==VT_PROG)||(Type==VT_PROTPROG)||(Type==VT_APPVAR)||(Type==VT_GROUP));
+}
+
+/** EntrySize() **********************************************/
+/** Return size of the VAT entry starting (at the top) at P.**/
+/*************************************************************/
+static int EntrySize(word P)
+{
+  return(IsNamed(Rd(P))? 7+Rd(P-6):9);
+}
+
+/** DataSize() ***********************************************/
+/** Return size of variable data of a given type at D, or   **/
+/** -1 if unknown.                                          **/
+/*************************************************************/
+static int DataSize(byte Type,word D)
+{
+  switch(Type&0x1F)
+  {
+    case VT_REAL:   return(9);
+    case VT_CPLX:   return(18);
+    case VT_LIST:   return(2+9*RdW(D));
+    case VT_CLIST:  return(2+18*RdW(D));
+    case VT_MATRIX: return(2+9*Rd(D)*Rd(D+1));
+    case 0x03: /* Equation */
+    case 0x04: /* String   */
+    case VT_PROG:
+    case VT_PROTPROG:
+    case 0x07: /* Picture  */
+    case 0x08: /* GDB      */
+    case VT_APPVAR:
+    case VT_GROUP:  return(2+RdW(D));
+    default:        return(-1);
+  }
+}
+
+/** FindVar() ************************************************/
+/** Find VAT entry of a variable with a given type and name,**/
+/** return its top address or 0 if not found.               **/
+/*************************************************************/
+static word FindVar(byte Type,const byte *Name,int NL)
+{
+  word P,End;
+  int J;
+
+  for(P=L->SymTable,End=RdW(L->PTemp);P>End;P-=EntrySize(P))
+  {
+    /* Programs share names, others match by name only */
+    if(IsNamed(Type)!=IsNamed(Rd(P))) continue;
+    if(IsNamed(Type))
+    {
+      J=Rd(P)&0x1F;
+      if((J==VT_PROTPROG? VT_PROG:J)!=((Type&0x1F)==VT_PROTPROG? VT_PROG:(Type&0x1F))) continue;
+      if(Rd(P-6)!=NL) continue;
+      for(J=0;(J<NL)&&(Rd(P-7-J)==Name[J]);++J);
+    }
+    else
+      for(J=0;(J<3)&&(Rd(P-6-J)==Name[J]);++J);
+    if(J==(IsNamed(Type)? NL:3)) return(P);
+  }
+
+  return(0);
+}
+
+/** EntryData() **********************************************/
+/** VAT entries run downwards, so the data pointer has its  **/
+/** low byte at P-3 and high byte at P-4.                   **/
+/*************************************************************/
+static word EntryData(word P) { return(Rd(P-3)+((word)Rd(P-4)<<8)); }
+
+/** ShiftData() **********************************************/
+/** Add N to data pointers at or above address D, after     **/
+/** user memory moved.                                      **/
+/*************************************************************/
+static void ShiftData(word D,int N)
+{
+  word P,End,A;
+
+  for(P=L->SymTable,End=RdW(L->OPBase);P>End;P-=EntrySize(P))
+    if(!Rd(P-5)&&((A=EntryData(P))>=D))
+    { A+=N;Wr(P-3,A&0xFF);Wr(P-4,A>>8); }
+
+  if(RdW(L->NewDataPtr)>=D) AddW(L->NewDataPtr,N);
+}
+
+/** DeleteVar() **********************************************/
+/** Remove a RAM variable with VAT entry at P. Returns 0 if **/
+/** it is archived or of unknown size.                      **/
+/*************************************************************/
+static int DeleteVar(word P)
+{
+  word D,Top;
+  int N,S;
+
+  if(Rd(P-5)) return(0);
+  D = EntryData(P);
+  N = DataSize(Rd(P),D);
+  S = EntrySize(P);
+  if((N<0)||(D<0x8000)||(D+N>RdW(L->TempMem))) return(0);
+
+  /* Close the gap in user memory */
+  Top=RdW(L->FPS);
+  Move(D,D+N,Top-D-N);
+  AddW(L->TempMem,-N);
+  AddW(L->FPBase,-N);
+  AddW(L->FPS,-N);
+
+  /* Close the gap in the VAT */
+  Top=RdW(L->OPS);
+  Move(Top+1+S,Top+1,P-S-Top);
+  if(P>RdW(L->ProgPtr)) AddW(L->ProgPtr,S);
+  AddW(L->PTemp,S);
+  AddW(L->OPBase,S);
+  AddW(L->OPS,S);
+
+  /* Data after the removed variable moved down */
+  ShiftData(D,-N);
+  return(1);
+}
+
+/** InsertVar() **********************************************/
+/** Create a RAM variable with given type, name, version,   **/
+/** and data. Returns 0 if there is not enough memory.      **/
+/*************************************************************/
+static int InsertVar(byte Type,const byte *Name,int NL,byte Ver,const byte *Data,int N)
+{
+  word D,P,Top;
+  int J,S;
+
+  S = IsNamed(Type)? 7+NL:9;
+  if(RdW(L->FPS)+N+S+VAR_SLACK>RdW(L->OPS)) return(0);
+
+  /* Data goes at the end of user memory, before temp data */
+  D   = RdW(L->TempMem);
+  Top = RdW(L->FPS);
+  ShiftData(D,N);
+  Move(D+N,D,Top-D);
+  for(J=0;J<N;++J) Wr(D+J,Data[J]);
+  AddW(L->TempMem,N);
+  AddW(L->FPBase,N);
+  AddW(L->FPS,N);
+
+  /* Entry goes at the end of its table, pushing temp entries */
+  /* and the operator stack down                              */
+  P   = IsNamed(Type)? RdW(L->PTemp):RdW(L->ProgPtr);
+  Top = RdW(L->OPS);
+  Move(Top+1-S,Top+1,P-Top);
+  if(!IsNamed(Type)) AddW(L->ProgPtr,-S);
+  AddW(L->PTemp,-S);
+  AddW(L->OPBase,-S);
+  AddW(L->OPS,-S);
+
+  Wr(P,Type);
+  Wr(P-1,0);
+  Wr(P-2,Ver);
+  Wr(P-3,D&0xFF);
+  Wr(P-4,D>>8);
+  Wr(P-5,0);
+  if(IsNamed(Type))
+  {
+    Wr(P-6,NL);
+    for(J=0;J<NL;++J) Wr(P-7-J,Name[J]);
+  }
+  else
+    for(J=0;J<3;++J) Wr(P-6-J,Name[J]);
+
+  return(1);
+}
+
+/** LoadVAR() ************************************************/
+/** Load variables from a TI variable file into calculator  **/
+/** RAM, replacing ones with the same names. Returns number **/
+/** of variables loaded, or 0 on failure. Call it between   **/
+/** instructions, with the OS idle.                         **/
+/*************************************************************/
+int LoadVAR(const char *FileName)
+{
+  byte *Buf,*P,*End,Type,Ver,NL;
+  byte Name[8];
+  int J,N,Len,Count;
+  word Sum;
+  FILE *F;
+
+  /* Find VAT layout for the current model */
+  for(L=Layouts;L->Signature&&(L->Model!=(TI83P_FAMILY? ATI_TI83P:(Mode&ATI_MODEL)));++L);
+  if(!L->Signature)
+  {
+    LOGE("%s: loading variables only works on TI83+/TI84+\n",FileName);
+    return(0);
+  }
+
+  /* Do not touch RAM unless the OS has set it up */
+  BadAddr=0;
+  if(!CheckVAT())
+  {
+    LOGE("%s: calculator memory is not ready for variables\n",FileName);
+    return(0);
+  }
+
+  /* Read the whole file */
+  if(!(F=fopen(FileName,"rb"))) return(0);
+  if(!(Buf=(byte *)malloc(VAR_MAXFILE))) { fclose(F);return(0); }
+  Len=fread(Buf,1,VAR_MAXFILE,F);
+  fclose(F);
+
+  /* Check signature, data length, and checksum */
+  N = Len>=VAR_HEADER+2? Buf[53]+((int)Buf[54]<<8):-1;
+  if((N<0)||(VAR_HEADER+N+2>Len)||memcmp(Buf,L->Signature,8))
+  {
+    LOGE("%s: not a %.8s variable file\n",FileName,L->Signature);
+    free(Buf);
+    return(0);
+  }
+  for(J=0,Sum=0;J<N;++J) Sum+=Buf[VAR_HEADER+J];
+  if(Sum!=Buf[VAR_HEADER+N]+((word)Buf[VAR_HEADER+N+1]<<8))
+  {
+    LOGE("%s: bad checksum\n",FileName);
+    free(Buf);
+    return(0);
+  }
+
+  /* Go through variable entries:                    */
+  /* HdrLen(2) Len(2) Type Name(8) [Ver Flags] Len(2) Data */
+  for(P=Buf+VAR_HEADER,End=P+N,Count=0;P+4<=End;)
+  {
+    J   = P[0]+((int)P[1]<<8);
+    Len = P[2]+((int)P[3]<<8);
+    if((J<11)||(P+2+J+2+Len>End)) break;
+
+    Type = P[4];
+    memcpy(Name,P+5,8);
+    for(NL=0;(NL<8)&&Name[NL];++NL);
+    Ver  = J>=13? P[13]:0;
+
+    /* Archived variables land in RAM, the user may archive */
+    /* them later. Flash archive layout is up to the OS.     */
+    if((J>=13)&&(P[14]&0x80)&&Verbose)
+      LOGD("%s: %.8s stored in RAM, not archive\n",FileName,Name);
+
+    /* A damaged VAT may point outside RAM */
+    J=FindVar(Type,Name,NL);
+    if(BadAddr||!CheckVAT())
+    {
+      LOGE("%s: calculator memory is damaged\n",FileName);
+      break;
+    }
+
+    /* Replace existing variable */
+    if(J&&!DeleteVar(J))
+    {
+      LOGE("%s: %.8s exists and cannot be replaced\n",FileName,Name);
+      break;
+    }
+
+    P += 2+P[0]+((int)P[1]<<8)+2;
+    if(!InsertVar(Type,Name,NL,Ver,P,Len))
+    {
+      LOGE("%s: not enough memory for %.8s\n",FileName,Name);
+      break;
+    }
+
+    P += Len;
+    ++Count;
+  }
+
+  if(Verbose) LOGD("%s: loaded %d variables\n",FileName,Count);
+  free(Buf);
+  return(Count);
+}
@@ -7,12 +7,17 @@
 
 #include "Z80/Z80.h"
 #include "TI85.h"
+#include "Render.h"
+#include "Link.h"
+#include "Bench.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #define  LOG_TAG    "libti8x"
 #define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,__VA_ARGS__)
@@ -30,6 +35,78 @@ const char *kInterfacePath = "net/supware/tipro/NativeLib";
 
 static int  palette[PALETTE_SIZE];
 
+/* Frames are rendered by the emulator thread at the size   */
+/* last requested by renderScreen(), which only copies them */
+static pthread_mutex_t frameLock = PTHREAD_MUTEX_INITIALIZER;
+static int *frame;              /* Last rendered frame       */
+static int frameSize;           /* Pixels allocated in frame */
+static int frameLen;            /* Pixels rendered in frame  */
+static int frameParams;         /* Scale and flags of frame  */
+static int wantParams;          /* Requested by renderScreen */
+static unsigned int frameGen;   /* LCD state in frame        */
+static unsigned int frameSeq;   /* Bumped on each new frame  */
+
+#define FRAME_PARAMS(sx, sy, flags) (((sx) << 16) | ((sy) << 8) | ((flags) & ~RENDER_FORCE))
+
+/* Key events queued by exchangeFrame(), applied by the    */
+/* emulator thread in Keypad(). One producer, one consumer. */
+#define KEY_QUEUE    64          /* Power of 2                */
+#define KEY_PRESSED  0x100       /* Same as NativeLib.java    */
+#define KEY_MIN_GAP  4           /* Ticks between events, so  */
+#define KEY_MAX_GAP  40          /* the OS scan sees them     */
+#define TICK_MS      5           /* Timer tick, 200Hz         */
+static int keyQueue[KEY_QUEUE][2]; /* Key|KEY_PRESSED, time ms */
+static volatile unsigned int keyHead, keyTail;
+static unsigned int keyTick;    /* Keypad() calls so far     */
+static unsigned int keyLastTick; /* Tick of last event       */
+static int keyLastTime;         /* JAVA time of last event   */
+
+/* Variable file queued by loadVariable(), loaded by the   */
+/* emulator thread in Keypad(), between instructions.       */
+static char varPath[256];       /* File to load              */
+static volatile int varPending; /* 1: varPath is waiting     */
+
+/* State file queued by saveState(), snapshot taken by the  */
+/* emulator thread in Keypad() and written in background.   */
+static char statePath[256];     /* File to save              */
+static volatile int statePending; /* 1: statePath is waiting */
+
+/* Grayscale setting from setGrayscale(), applied in Keypad() */
+/* so that blending never changes under RenderFrame().         */
+static volatile int grayWanted = -1; /* frames<<8|period, -1: none */
+
+/* RAM reset queued by resetRAM(), done in Keypad() */
+static volatile int resetPending; /* 1: reset is waiting       */
+
+/* State slot queued by saveSlot() or loadSlot(), -1: none */
+static volatile int slotSave = -1; /* Slot to save to         */
+static volatile int slotLoad = -1; /* Slot to load from       */
+static int slotPersist;         /* 1: also save slot to file */
+
+/* Emulator thread parks in Keypad() between suspend() and  */
+/* resume(), keeping ROM, RAM and everything else resident. */
+static pthread_mutex_t parkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  parkCond = PTHREAD_COND_INITIALIZER;
+static volatile int parkWanted; /* 1: suspend() is in effect  */
+
+/* Emulated speed, measured in RefreshScreen() */
+static unsigned int emuCycles;  /* CPU cycles since last time */
+static int emuKHz;              /* Emulated CPU clock, kHz   */
+static struct timespec speedTime; /* Start of speed interval */
+
+/* Status flags and fields returned by exchangeFrame(), same */
+/* as STATUS_* in NativeLib.java                             */
+#define STATUS_RUNNING   0x01
+#define STATUS_SCREEN_ON 0x02
+#define STATUS_NEW_FRAME 0x04
+#define STATUS_FLAGS     0
+#define STATUS_FRAME     1
+#define STATUS_KHZ       2
+#define STATUS_EVENTS    3
+#define STATUS_SIZE      4
+
+static int registerNatives(JNIEnv *env);
+
 int Running     = 0;
 int ScreenReady = 0;
 byte KeyReady   = 0;       /* 1: Key has been pressed        */
@@ -107,14 +184,78 @@ void SetColor(byte N,byte R,byte G,byte B)
     //LOGD("SetColor called");
 }
 
+/** RenderFrame() ********************************************/
+/** Render the LCD into frame at the requested scale, with  **/
+/** filters, unless frame is already up to date.            **/
+/*************************************************************/
+static void RenderFrame(void)
+{
+    unsigned int gen = LCDGen + BlendGen;
+    int params = wantParams;
+    int scaleX = (params >> 16) & 0xFF;
+    int scaleY = (params >> 8) & 0xFF;
+    int flags  = params & 0xFF;
+    int width, size;
+    int *p;
+
+    if (!scaleX || !scaleY) return;
+    if (frame && gen == frameGen && params == frameParams) return;
+
+    // TI85, TI86 have 128x64 screens, TI82, TI83, TI83P, TI84P 96x64
+    width = TI85_FAMILY ? 128 : 96;
+    size  = width * scaleX * 64 * scaleY;
+
+    pthread_mutex_lock(&frameLock);
+
+    if (size > frameSize) {
+        p = (int *)realloc(frame, size * sizeof(int));
+        if (!p) {
+            LOGE("RenderFrame: failed to allocate %d pixels", size);
+            pthread_mutex_unlock(&frameLock);
+            return;
+        }
+        frame = p;
+        frameSize = size;
+    }
+
+    if (SLEEP_ON)
+        RenderFill(frame, COLOR_OFF, size);
+    else if (BlendCount())
+        RenderBlend(frame, width, 64, scaleX, scaleY, palette, flags);
+    else
+        RenderLCD(frame, TI85_FAMILY ? SCREEN_BUFFER : LCD.Buffer,
+            width, 64, scaleX, scaleY, palette, flags);
+
+    frameGen = gen;
+    frameLen = size;
+    frameParams = params;
+    ++frameSeq;
+
+    pthread_mutex_unlock(&frameLock);
+}
+
 /** RefreshScreen() ******************************************/
 /** Put an image on the screen.                             **/
 /*************************************************************/
 void RefreshScreen(void)
 {
+    struct timespec now;
+    long long usec;
+
     //LOGD("RefreshScreen called");
+    RenderFrame();
     ScreenReady = 1;
 
+    // Measure emulated CPU speed about once a second
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usec = (now.tv_sec - speedTime.tv_sec) * 1000000LL
+         + (now.tv_nsec - speedTime.tv_nsec) / 1000;
+    if (usec >= 1000000) {
+        if (speedTime.tv_sec) emuKHz = (int)(emuCycles * 1000LL / usec);
+        emuCycles = 0;
+        speedTime = now;
+    }
+
     // Introduce an artificial delay to simulate CPU speed
     useconds_t periodUsec = 22222;
 
@@ -136,11 +277,102 @@ void RefreshScreen(void)
     ScreenReady = 0;
 }
 
+/** SampleScreen() *******************************************/
+/** Feed an LCD snapshot to the grayscale blending stage.   **/
+/*************************************************************/
+void SampleScreen(void)
+{
+    static const byte blank[16*64];
+
+    if (SLEEP_ON)
+        BlendFrame(blank);
+    else
+        BlendFrame(TI85_FAMILY ? SCREEN_BUFFER : LCD.Buffer);
+}
+
+/** Park() ***************************************************/
+/** Wait until resume() or stop(), then restart real time   **/
+/** sync so the pause does not count as emulated time.      **/
+/*************************************************************/
+static void Park(void)
+{
+    pthread_mutex_lock(&parkLock);
+    while (parkWanted && !ExitNow)
+        pthread_cond_wait(&parkCond, &parkLock);
+    pthread_mutex_unlock(&parkLock);
+
+    TickSec = 0;
+    speedTime.tv_sec = 0;
+    emuCycles = 0;
+}
+
 /** Keypad() *************************************************/
 /** Poll the keyboard.                                      **/ 
 /*************************************************************/
 byte Keypad(void) {
+    int key, time, gap, gray;
+
     //LOGD("Keypad called");
+    emuCycles += TIMER_CLK;
+    ++keyTick;
+
+    if (varPending) {
+        __sync_synchronize();
+        LoadVAR(varPath);
+        varPending = 0;
+    }
+
+    if (statePending) {
+        __sync_synchronize();
+        SnapSTA(statePath);
+        statePending = 0;
+    }
+
+    if (grayWanted >= 0) {
+        gray = __sync_lock_test_and_set(&grayWanted, -1);
+        SPeriod = 0;
+        BlendReset(gray >> 8);
+        if (BlendCount()) SPeriod = gray & 0xFF;
+    }
+
+    if (resetPending) {
+        ResetRAM();
+        resetPending = 0;
+    }
+
+    if (slotSave >= 0) {
+        __sync_synchronize();
+        SaveSlot(slotSave, slotPersist);
+        slotSave = -1;
+    }
+
+    if (slotLoad >= 0) {
+        LoadSlot(slotLoad);
+        slotLoad = -1;
+    }
+
+    // Queued work is done, this is a good place to stop
+    if (parkWanted) Park();
+
+    // Apply the next queued key event once it is due, keeping
+    // the spacing it had in JAVA, within KEY_MIN..MAX_GAP ticks
+    if (keyHead != keyTail) {
+        __sync_synchronize();
+        key  = keyQueue[keyHead & (KEY_QUEUE - 1)][0];
+        time = keyQueue[keyHead & (KEY_QUEUE - 1)][1];
+        gap  = (time - keyLastTime) / TICK_MS;
+        gap  = gap < KEY_MIN_GAP ? KEY_MIN_GAP : gap > KEY_MAX_GAP ? KEY_MAX_GAP : gap;
+
+        if (keyTick - keyLastTick >= gap) {
+            if (key & KEY_PRESSED) KBD_SET(key & 0xFF); else KBD_RES(key & 0xFF);
+            KeyReady = 1;
+            keyLastTick = keyTick;
+            keyLastTime = time;
+            __sync_synchronize();
+            ++keyHead;
+        }
+    }
+
     return (IS_KBD(KBD_ON));
 }
 
@@ -159,8 +391,15 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
     if ((*vm)->GetEnv(vm, (void**) &env, JNI_VERSION_1_4) != JNI_OK)
         return -1;
 
-    /* get class with (*env)->FindClass */
-    /* register methods with (*env)->RegisterNatives */
+#ifdef BENCHMARK
+    BenchRender();
+    BenchPorts();
+    BenchDirty();
+#endif
+
+    /* Bind native methods once, instead of by name on first call */
+    if (registerNatives(env) < 0)
+        return -1;
 
     /* Create an object of type NativeLib as a cached reference
     so we can call its methods later. JNI doesn't like us to
@@ -248,7 +487,10 @@ JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_loadState(
 }
 
 /** saveState() **********************************************/
-/** Key handler for saveState event, called from JAVA.      **/
+/** Key handler for saveState event, called from JAVA. The  **/
+/** emulator thread takes a snapshot on its next timer tick **/
+/** and keeps running while it is written out. Check the    **/
+/** result with saveStateStatus().                          **/
 /*************************************************************/
 JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_saveState(
     JNIEnv * env,
@@ -256,78 +498,289 @@ JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_saveState(
     jstring filename
 ) {
 
-    if (!Running) return;
+    if (!Running || statePending) return;
 
     jboolean isCopy;  
     const char * szFilename = (*env)->GetStringUTFChars(env, filename, &isCopy);  
-    SaveSTA(szFilename);
+    strncpy(statePath, szFilename, sizeof(statePath) - 1);
+    statePath[sizeof(statePath) - 1] = '\0';
+    __sync_synchronize();
+    statePending = 1;
   
     (*env)->ReleaseStringUTFChars(env, filename, szFilename);  
 }
 
+/** saveStateStatus() ****************************************/
+/** JNI call returning -1 while a state save is pending or  **/
+/** being written, 1 if the last one succeeded, 0 if not.   **/
+/*************************************************************/
+JNIEXPORT jint JNICALL Java_net_supware_tipro_NativeLib_saveStateStatus(
+    JNIEnv * env,
+    jobject thiz
+) {
+    return statePending ? -1 : PollSTA(0);
+}
+
+/** resetRAM() ***********************************************/
+/** JNI call to clear calculator RAM. The emulator thread   **/
+/** restores the boot snapshot, or reboots, on its next     **/
+/** timer tick.                                             **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_resetRAM(
+    JNIEnv * env,
+    jobject thiz
+) {
+    if (Running) resetPending = 1;
+}
+
+/** loadVariable() *******************************************/
+/** JNI call to put a TI variable file into calculator RAM. **/
+/** The emulator thread loads it on its next timer tick.    **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_loadVariable(
+    JNIEnv * env,
+    jobject thiz,
+    jstring filename
+) {
+
+    if (!Running || varPending) return;
+
+    jboolean isCopy;
+    const char * szFilename = (*env)->GetStringUTFChars(env, filename, &isCopy);
+    strncpy(varPath, szFilename, sizeof(varPath) - 1);
+    varPath[sizeof(varPath) - 1] = '\0';
+    __sync_synchronize();
+    varPending = 1;
+
+    (*env)->ReleaseStringUTFChars(env, filename, szFilename);
+}
+
+/** saveSlot() ***********************************************/
+/** JNI call to copy emulator state into in-memory slot,    **/
+/** and into its file in background if persist is set. The  **/
+/** emulator thread does it on its next timer tick.         **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_saveSlot(
+    JNIEnv * env,
+    jobject thiz,
+    int slot,
+    jboolean persist
+) {
+    if (!Running || slotSave >= 0) return;
+
+    slotPersist = persist ? 1 : 0;
+    __sync_synchronize();
+    slotSave = slot;
+}
+
+/** loadSlot() ***********************************************/
+/** JNI call to restore emulator state from a slot, or from **/
+/** its file if the slot is empty, on the next timer tick.  **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_loadSlot(
+    JNIEnv * env,
+    jobject thiz,
+    int slot
+) {
+    if (Running && slotLoad < 0) slotLoad = slot;
+}
+
+/** identifyRom() ********************************************/
+/** JNI call returning the ATI_* model of a ROM image file, **/
+/** or -1 if it is not one. Safe to call from any thread.   **/
+/*************************************************************/
+JNIEXPORT jint JNICALL Java_net_supware_tipro_NativeLib_identifyRom(
+    JNIEnv * env,
+    jobject thiz,
+    jstring filename
+) {
+    jboolean isCopy;
+    const char * szFilename = (*env)->GetStringUTFChars(env, filename, &isCopy);
+    int model = IdentROM(szFilename, 0, 0);
+
+    (*env)->ReleaseStringUTFChars(env, filename, szFilename);
+    return model;
+}
+
+/** romVersion() *********************************************/
+/** JNI call returning the OS version of a ROM image file,  **/
+/** or null if it is not one or the version is unknown.     **/
+/** Safe to call from any thread.                           **/
+/*************************************************************/
+JNIEXPORT jstring JNICALL Java_net_supware_tipro_NativeLib_romVersion(
+    JNIEnv * env,
+    jobject thiz,
+    jstring filename
+) {
+    jboolean isCopy;
+    const char * szFilename = (*env)->GetStringUTFChars(env, filename, &isCopy);
+    char version[ROM_VERSION];
+    int model = IdentROM(szFilename, 0, version);
+
+    (*env)->ReleaseStringUTFChars(env, filename, szFilename);
+    return model < 0 || !*version ? 0 : (*env)->NewStringUTF(env, version);
+}
+
+/** setRomCache() ********************************************/
+/** JNI call setting the file keeping identifyRom() results **/
+/** across runs.                                            **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_setRomCache(
+    JNIEnv * env,
+    jobject thiz,
+    jstring filename
+) {
+    jboolean isCopy;
+    const char * szFilename = (*env)->GetStringUTFChars(env, filename, &isCopy);
+
+    ROMCache(szFilename);
+    (*env)->ReleaseStringUTFChars(env, filename, szFilename);
+}
+
 /** renderScreen() ********************************************/
-/** JNI call to draw the screen                             **/
+/** JNI call to get the screen, scaled by integer factors   **/
+/** scaleX,scaleY and filtered per flags, so that JAVA can  **/
+/** blit it 1:1. The frame itself is rendered on the        **/
+/** emulator thread; this only copies it. Returns JNI_FALSE **/
+/** without touching colors if there is no new frame.       **/
 /*************************************************************/
-JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_renderScreen(
+JNIEXPORT jboolean JNICALL Java_net_supware_tipro_NativeLib_renderScreen(
     JNIEnv * env, 
     jobject thiz, 
-    jintArray colors
+    jintArray colors,
+    int scaleX,
+    int scaleY,
+    int flags
 ) {
-    void*    pixels;
-    int      x, y;
+    static unsigned int lastSeq;
+    jboolean result = JNI_FALSE;
+    int params;
 
-    if (!Running) return;
+    if (!Running) return JNI_FALSE;
 
-    while (!ScreenReady) {
-        if (!Running) return;
-        usleep(1000);
-    }
+    // Ask the emulator for frames of this size from now on
+    params = FRAME_PARAMS(scaleX, scaleY, flags);
+    wantParams = params;
 
-    //LOGD("RenderScreen called");
-
-    byte *vram;
-    byte mask;
-    int i = 0;
-
-    jsize len = (*env)->GetArrayLength(env, colors);
-    
-    jint *elems = (*env)->GetIntArrayElements(env, colors, NULL);
-
-    // TI85, TI86 (128x64 screens)
-    if (TI85_FAMILY) {
-      if (SLEEP_ON) {
-        for (y = 0; y < 64 * 128; y++)
-          elems[i++] = COLOR_OFF;
-      }
-      else {
-        for (y = 0; y < 64; y++) {
-          for (x = 0; x < 128; x++) {
-            vram = SCREEN_BUFFER + (x / 8) + (y * 16);
-            mask = 0x80 >> (x & 7);
-            elems[i++] = palette[*vram & mask ? 1:0];
-          }
+    pthread_mutex_lock(&frameLock);
+
+    // Skip copying if nothing has changed
+    if (frame && frameParams == params && (frameSeq != lastSeq || (flags & RENDER_FORCE))) {
+        if ((*env)->GetArrayLength(env, colors) >= frameLen) {
+            (*env)->SetIntArrayRegion(env, colors, 0, frameLen, frame);
+            lastSeq = frameSeq;
+            result = JNI_TRUE;
         }
-      }
     }
 
-    // TI82, TI83, TI83P, TI84P (96x64 screens)
-    else {
-      if (SLEEP_ON) {
-        for (y = 0; y < 64 * 96; y++)
-          elems[i++] = COLOR_OFF;
-      }
-      else {
-        for (y = 0; y < 64; y++) {
-          for (x = 0; x < 96; x++) {
-            vram = LCD.Buffer + (x / 8) + (y * 16);
-            mask = 0x80 >> (x & 7);
-            elems[i++] = palette[*vram & mask ? 1:0];
-          }
+    pthread_mutex_unlock(&frameLock);
+    return result;
+}
+
+/** exchangeFrame() *******************************************/
+/** JNI call doing all per-frame work at once: queues count **/
+/** key events (key|KEY_PRESSED, uptime ms pairs), copies   **/
+/** the new frame like renderScreen(), and fills status[]   **/
+/** with STATUS_* flags, frame number, emulated kHz, and    **/
+/** number of events queued. Events that do not fit are not **/
+/** taken, JAVA passes them again with the next frame.      **/
+/*************************************************************/
+JNIEXPORT jboolean JNICALL Java_net_supware_tipro_NativeLib_exchangeFrame(
+    JNIEnv * env,
+    jobject thiz,
+    jintArray events,
+    int count,
+    jintArray colors,
+    int scaleX,
+    int scaleY,
+    int flags,
+    jintArray status
+) {
+    jint buf[2 * KEY_QUEUE];
+    jint out[STATUS_SIZE];
+    jboolean result;
+    int j;
+#ifdef BENCHMARK
+    // Time spent natively; JAVA logs the time of the whole call
+    static long long benchNs;
+    static int benchCount;
+    long long t = BenchNS();
+#endif
+
+    // Queue key events, as many as fit. With no emulator
+    // running there is nothing to press, take them all.
+    j = Running ? 0 : count;
+    if (Running && count > 0) {
+        if (count > KEY_QUEUE) count = KEY_QUEUE;
+        (*env)->GetIntArrayRegion(env, events, 0, 2 * count, buf);
+        for (; j < count && keyTail - keyHead < KEY_QUEUE; ++j) {
+            keyQueue[keyTail & (KEY_QUEUE - 1)][0] = buf[2 * j];
+            keyQueue[keyTail & (KEY_QUEUE - 1)][1] = buf[2 * j + 1];
+            __sync_synchronize();
+            ++keyTail;
         }
-      }
     }
 
-    (*env)->ReleaseIntArrayElements(env, colors, elems, 0);
+    result = Java_net_supware_tipro_NativeLib_renderScreen(
+        env, thiz, colors, scaleX, scaleY, flags);
+
+    out[STATUS_FLAGS] = (Running ? STATUS_RUNNING : 0)
+                      | (Running && !SLEEP_ON ? STATUS_SCREEN_ON : 0)
+                      | (result ? STATUS_NEW_FRAME : 0);
+    out[STATUS_FRAME] = frameSeq;
+    out[STATUS_KHZ]   = emuKHz;
+    out[STATUS_EVENTS] = j;
+    (*env)->SetIntArrayRegion(env, status, 0, STATUS_SIZE, out);
+
+#ifdef BENCHMARK
+    benchNs += BenchNS() - t;
+    if (++benchCount == 600) {
+        LOGD("exchangeFrame: %lldns/frame native", benchNs / 600);
+        benchNs = benchCount = 0;
+    }
+#endif
+
+    return result;
+}
+
+/** setGrayscale() *******************************************/
+/** JNI call to blend the last frames LCD samples, taken    **/
+/** every period timer interrupts. frames<2 turns it off.   **/
+/** The emulator thread applies it in Keypad().             **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_setGrayscale(
+    JNIEnv * env,
+    jobject thiz,
+    int frames,
+    int period
+) {
+    frames = frames < 0 ? 0 : frames > 255 ? 255 : frames;
+    period = period < 1 ? 1 : period > 255 ? 255 : period;
+    grayWanted = (frames << 8) | period;
+}
+
+/** setLink() ************************************************/
+/** JNI call to connect or drop the link cable. The socket  **/
+/** work happens on the emulator thread, see LinkTick().    **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_setLink(
+    JNIEnv * env,
+    jobject thiz,
+    jboolean on
+) {
+    LinkEnable(on);
+}
+
+/** setLowMemory() *******************************************/
+/** JNI call to keep ROMs packed in memory, see PackROM().  **/
+/** Takes effect when the next ROM gets mapped.             **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_setLowMemory(
+    JNIEnv * env,
+    jobject thiz,
+    jboolean on
+) {
+    LowMemory = on;
 }
 
 /** start() **************************************************/
@@ -371,6 +824,31 @@ JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_start(
 
     return;
 }
+/** suspend() ************************************************/
+/** JNI call to park the emulator thread on its next timer  **/
+/** tick, without tearing anything down. Returns at once.   **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_suspend(
+    JNIEnv * env,
+    jobject thiz
+) {
+    parkWanted = 1;
+}
+
+/** resume() *************************************************/
+/** JNI call to let the emulator thread continue after      **/
+/** suspend().                                              **/
+/*************************************************************/
+JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_resume(
+    JNIEnv * env,
+    jobject thiz
+) {
+    pthread_mutex_lock(&parkLock);
+    parkWanted = 0;
+    pthread_cond_broadcast(&parkCond);
+    pthread_mutex_unlock(&parkLock);
+}
+
 /** stop() ***************************************************/
 /** JNI call to start the emulator                          **/
 /*************************************************************/
@@ -379,7 +857,51 @@ JNIEXPORT void JNICALL Java_net_supware_tipro_NativeLib_stop(
     jobject thiz
 ) {
     //LOGD("stop() called");
+    pthread_mutex_lock(&parkLock);
     ExitNow = 1;
+    pthread_cond_broadcast(&parkCond);
+    pthread_mutex_unlock(&parkLock);
     return;
 }
 
+/** registerNatives() ****************************************/
+/** Bind NativeLib methods to their C functions.            **/
+/*************************************************************/
+static int registerNatives(JNIEnv *env) {
+    static const JNINativeMethod methods[] = {
+        { "onResume",      "()V",         (void *)Java_net_supware_tipro_NativeLib_onResume },
+        { "onPause",       "()V",         (void *)Java_net_supware_tipro_NativeLib_onPause },
+        { "keyDown",       "(I)V",        (void *)Java_net_supware_tipro_NativeLib_keyDown },
+        { "keyUp",         "(I)V",        (void *)Java_net_supware_tipro_NativeLib_keyUp },
+        { "renderScreen",  "([IIII)Z",    (void *)Java_net_supware_tipro_NativeLib_renderScreen },
+        { "exchangeFrame", "([II[IIII[I)Z", (void *)Java_net_supware_tipro_NativeLib_exchangeFrame },
+        { "setGrayscale",  "(II)V",       (void *)Java_net_supware_tipro_NativeLib_setGrayscale },
+        { "setLink",       "(Z)V",        (void *)Java_net_supware_tipro_NativeLib_setLink },
+        { "setLowMemory",  "(Z)V",        (void *)Java_net_supware_tipro_NativeLib_setLowMemory },
+        { "saveState",     "(Ljava/lang/String;)V", (void *)Java_net_supware_tipro_NativeLib_saveState },
+        { "saveStateStatus", "()I",       (void *)Java_net_supware_tipro_NativeLib_saveStateStatus },
+        { "resetRAM",      "()V",         (void *)Java_net_supware_tipro_NativeLib_resetRAM },
+        { "saveSlot",      "(IZ)V",       (void *)Java_net_supware_tipro_NativeLib_saveSlot },
+        { "loadSlot",      "(I)V",        (void *)Java_net_supware_tipro_NativeLib_loadSlot },
+        { "identifyRom",   "(Ljava/lang/String;)I", (void *)Java_net_supware_tipro_NativeLib_identifyRom },
+        { "romVersion",    "(Ljava/lang/String;)Ljava/lang/String;", (void *)Java_net_supware_tipro_NativeLib_romVersion },
+        { "setRomCache",   "(Ljava/lang/String;)V", (void *)Java_net_supware_tipro_NativeLib_setRomCache },
+        { "loadVariable",  "(Ljava/lang/String;)V", (void *)Java_net_supware_tipro_NativeLib_loadVariable },
+        { "start",         "(ILjava/lang/String;Ljava/lang/String;)V", (void *)Java_net_supware_tipro_NativeLib_start },
+        { "suspend",       "()V",         (void *)Java_net_supware_tipro_NativeLib_suspend },
+        { "resume",        "()V",         (void *)Java_net_supware_tipro_NativeLib_resume },
+        { "stop",          "()V",         (void *)Java_net_supware_tipro_NativeLib_stop },
+    };
+    jclass cls = (*env)->FindClass(env, kInterfacePath);
+
+    if (!cls) {
+        LOGE("registerNatives: failed to get %s class reference", kInterfacePath);
+        return -1;
+    }
+    if ((*env)->RegisterNatives(env, cls, methods, sizeof(methods) / sizeof(methods[0])) < 0) {
+        LOGE("registerNatives: failed to register %s methods", kInterfacePath);
+        return -1;
+    }
+    (*env)->DeleteLocalRef(env, cls);
+    return 0;
+}